@@ -0,0 +1,57 @@
+// How long the GLR parser takes on chains of + and * in bench/ambiguous.rule, which
+// have exponentially many parses. The packed forest shares them, so doubling the
+// length should multiply the time by a constant rather than squaring it: RNGLR is
+// O(n^(k + 1)) for productions of up to k symbols, so at most 16 here. The LR parser,
+// which just shifts wherever there's a conflict, is there to compare with.
+
+#include "../src/grammar.hpp"
+#include "../src/utils.hpp"
+#include "measure.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+using std::string;
+
+/// "a0 + a1 * a2 + ..." with `n` operands.
+static string chain(int n) {
+  string result;
+  for (int i = 0; i < n; i++) {
+    if (i > 0) result += i % 2 ? " + " : " * ";
+    result += "a" + std::to_string(i);
+  }
+  return result + "\n";
+}
+
+int main() {
+  // The conflicts are the point here, so there's no need to hear about them.
+  std::ostringstream messages;
+  diagnosticStream = &messages;
+  const grammar::Grammar *grammar = grammar::parseGrammarFile("bench/ambiguous.rule");
+  diagnosticStream = &std::cerr;
+
+  printf("%8s %14s %10s %10s %8s\n", "operands", "parses", "LR", "GLR", "growth");
+  double last = 0;
+  for (int n = 25; n <= 400; n *= 2) {
+    string source = chain(n);
+    double lr = measure("chain.cpp", source,
+                        [&](lex::Lexer &lexer) { grammar::parse(grammar, lexer); });
+    double glr = measure("chain.cpp", source,
+                         [&](lex::Lexer &lexer) { grammar::parseGLR(grammar, lexer); });
+
+    // Catalan(n - 1) ~ 4^(n - 1) / ((n - 1)^1.5 sqrt(pi)), in powers of 10.
+    double k = n - 1;
+    double log10Parses = (k * std::log(4) - 1.5 * std::log(k) - 0.5 * std::log(M_PI)) /
+                         std::log(10);
+    char parses[32];
+    snprintf(parses, sizeof(parses), "~10^%.0f", log10Parses);
+
+    printf("%8d %14s %9.4fs %9.4fs", n, parses, lr, glr);
+    if (last > 0) printf(" %7.1fx", glr / last);
+    printf("\n");
+    last = glr;
+  }
+  return 0;
+}
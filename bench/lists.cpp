@@ -0,0 +1,64 @@
+// How long parsing and printing a function with N statements takes, from 1k to 1M of
+// them. Reducing `_statements -> _statements statement` appends to the list in O(1),
+// so the time per statement should stay about the same however long the list gets.
+
+#include "../src/grammar.hpp"
+#include "../src/utils.hpp"
+#include "measure.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+using std::string;
+
+/// main() with `n` statements of `x = x + i;`.
+static string function(int n) {
+  string result = "int main() {\n  int x = 0;\n";
+  for (int i = 0; i < n; i++) result += "  x = x + " + std::to_string(i) + ";\n";
+  return result + "  return x;\n}\n";
+}
+
+/// How many seconds `run` takes on a lexer for `source`, at best out of up to three
+/// tries (fewer once they've taken a second).
+template<typename Run>
+static double measure(const string &source, Run run) {
+  double best = INFINITY, total = 0;
+  for (int i = 0; i < 3 && total < 1; i++) {
+    lex::Lexer lexer("lists.cpp", source);
+    auto start = std::chrono::steady_clock::now();
+    run(lexer);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+    total += elapsed.count();
+  }
+  return best;
+}
+
+int main() {
+  const grammar::Grammar *grammar = grammar::defaultGrammar();
+  std::ofstream null("/dev/null");
+
+  printf("%10s %10s %10s %10s %10s %12s\n", "statements", "LR", "GLR", "LR+print",
+         "streaming", "LR per stmt");
+  for (int n = 1000; n <= 1000000; n *= 10) {
+    string source = function(n);
+    double lr = measure("lists.cpp", source,
+                        [&](lex::Lexer &lexer) { grammar::parse(grammar, lexer); });
+    double glr = measure("lists.cpp", source,
+                         [&](lex::Lexer &lexer) { grammar::parseGLR(grammar, lexer); });
+    double printed = measure("lists.cpp", source, [&](lex::Lexer &lexer) {
+      grammar::printNodeTree(grammar::parse(grammar, lexer), null);
+    });
+    double streamed = measure("lists.cpp", source, [&](lex::Lexer &lexer) {
+      grammar::TreePrinter printer(grammar, null);
+      grammar::Tree rest = grammar::parseStreaming(
+          grammar, lexer, [&](grammar::Tree item) { printer.print(std::move(item)); });
+      printer.finish(rest);
+    });
+
+    printf("%10d %9.3fs %9.3fs %9.3fs %9.3fs %10.0fns\n", n, lr, glr, printed, streamed,
+           lr / n * 1e9);
+  }
+  return 0;
+}
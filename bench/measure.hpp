@@ -0,0 +1,27 @@
+#pragma once
+
+// Timing for the benchmarks in bench/, which all run something on a fresh lexer a few
+// times and keep the best time.
+
+#include "../src/lex.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+
+/// How many seconds `run` takes on a lexer for `source`, at best out of up to three
+/// tries (fewer once they've taken a second).
+template<typename Run>
+inline double measure(const std::string &filename, const std::string &source, Run run) {
+  double best = INFINITY, total = 0;
+  for (int i = 0; i < 3 && total < 1; i++) {
+    lex::Lexer lexer(filename, source);
+    auto start = std::chrono::steady_clock::now();
+    run(lexer);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+    total += elapsed.count();
+  }
+  return best;
+}
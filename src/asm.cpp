@@ -0,0 +1,171 @@
+#include "asm.hpp"
+
+#include <charconv>
+#include <ostream>
+#include <streambuf>
+
+namespace compile {
+const char *mnemonicName(Mnemonic mnemonic) {
+  static const char *const NAMES[] = {
+      "mov",  "movzx", "movsx", "lea",   "add",  "sub",  "imul", "idiv",
+      "cdq",  "neg",   "cmp",   "sete",  "setne", "setl", "setg", "setle",
+      "setge", "jmp",  "jne",   "call",  "push", "pop",  "ret",  "syscall",
+  };
+  return NAMES[size_t(mnemonic)];
+}
+
+bool Operand::operator==(const Operand &other) const {
+  if (kind != other.kind) return false;
+  switch (kind) {
+  case None     : return true;
+  case Register : return size == other.size && regNumber(base) == regNumber(other.base);
+  case Immediate:
+  case Label    : return value == other.value;
+  case Memory:
+    return size == other.size && regNumber(base) == regNumber(other.base) &&
+           hasIndex == other.hasIndex &&
+           (!hasIndex || regNumber(index) == regNumber(other.index)) &&
+           value == other.value;
+  }
+  return false;
+}
+
+void Assembly::emit(Mnemonic mnemonic, uint8_t numOperands, Operand a, Operand b,
+                    Operand c) {
+  records.push_back(Record{.kind = Record::Instruction,
+                           .mnemonic = mnemonic,
+                           .numOperands = numOperands,
+                           .operands = {a, b, c}});
+}
+
+uint32_t Assembly::label(const string &name) {
+  auto [it, isNew] = labelIds.try_emplace(name, labelNames.size());
+  if (isNew) labelNames.push_back(name);
+  return it->second;
+}
+
+void Assembly::bind(uint32_t label) {
+  records.push_back(Record{.kind = Record::Label, .index = label});
+}
+
+void Assembly::comment(const ir::Function &function, ir::ValueId value) {
+  if (functions.empty() || functions.back() != &function) {
+    functions.push_back(&function);
+  }
+  records.push_back(Record{.kind = Record::Comment,
+                           .index = uint32_t(functions.size() - 1),
+                           .count = value});
+}
+
+void Assembly::text(string_view text) {
+  records.push_back(Record{.kind = Record::Text,
+                           .index = uint32_t(texts.size()),
+                           .count = uint32_t(text.size())});
+  texts += text;
+}
+
+void Assembly::blank() { records.push_back(Record{.kind = Record::Blank}); }
+
+namespace {
+/// Lets an std::ostream write right onto the end of a string.
+class AppendBuffer : public std::streambuf {
+public:
+  explicit AppendBuffer(string &output) : output(output) {}
+
+protected:
+  int_type overflow(int_type c) override {
+    if (c != traits_type::eof()) output += char(c);
+    return c;
+  }
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    output.append(s, n);
+    return n;
+  }
+
+private:
+  string &output;
+};
+
+void appendNumber(string &output, int64_t value) {
+  char buffer[24];
+  auto [end, error] = std::to_chars(std::begin(buffer), std::end(buffer), value);
+  output.append(buffer, end);
+}
+
+void appendOperand(string &output, const Assembly &assembly, const Operand &operand) {
+  static const char *const LOW_BYTES[] = {
+      "al",  "cl",  "dl",   "bl",   "spl",  "bpl",  "sil",  "dil",
+      "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+  };
+
+  switch (operand.kind) {
+  case Operand::None: break;
+  case Operand::Register:
+    switch (operand.size) {
+    case 1 : output += LOW_BYTES[regNumber(operand.base)]; break;
+    case 4 : output += regName(reg32(operand.base)); break;
+    default: output += regName(reg64(operand.base)); break;
+    }
+    break;
+  case Operand::Immediate: appendNumber(output, operand.value); break;
+  case Operand::Label    : output += assembly.labelName(operand.value); break;
+  case Operand::Memory:
+    switch (operand.size) {
+    case 1: output += "byte "; break;
+    case 4: output += "dword "; break;
+    case 8: output += "qword "; break;
+    }
+    output += '[';
+    output += regName(reg64(operand.base));
+    if (operand.hasIndex) {
+      output += '+';
+      output += regName(reg64(operand.index));
+    }
+    if (operand.value > 0) output += '+';
+    if (operand.value != 0) appendNumber(output, operand.value);
+    output += ']';
+    break;
+  }
+}
+} // namespace
+
+string Assembly::toText() const {
+  string output;
+  output.reserve(texts.size() + 24 * records.size());
+
+  // The comments are printed by the IR, as they would be anywhere else.
+  AppendBuffer buffer(output);
+  std::ostream os(&buffer);
+
+  for (const Record &record : records) {
+    switch (record.kind) {
+    case Record::Instruction:
+      output += "  ";
+      output += mnemonicName(record.mnemonic);
+      for (size_t i = 0; i < record.numOperands; i++) {
+        output += i == 0 ? " " : ", ";
+        appendOperand(output, *this, record.operands[i]);
+      }
+      output += '\n';
+      break;
+    case Record::Label:
+      output += labelNames[record.index];
+      output += ":\n";
+      break;
+    case Record::Comment:
+      output += "  ;; ";
+      ir::print(*functions[record.index], record.count, os);
+      output += '\n';
+      break;
+    case Record::Text:
+      output += textOf(record);
+      output += '\n';
+      break;
+    case Record::Blank  : output += '\n'; break;
+    case Record::Deleted: break;
+    }
+  }
+
+  return output;
+}
+} // namespace compile
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "compile.hpp"
+#include "ir.hpp"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Assembly as the code generator produces it: a buffer of compact records, one per
+// line, which only turns into text once everything is there. That keeps formatting
+// (and allocating strings for) every instruction out of code generation, and lets
+// passes like the peephole optimizer look at operands without parsing them back.
+
+namespace compile {
+using std::string, std::string_view, std::vector;
+
+/// The instructions the code generator uses.
+enum class Mnemonic : uint8_t {
+  mov,
+  movzx,
+  movsx,
+  lea,
+  add,
+  sub,
+  imul,
+  idiv,
+  cdq,
+  neg,
+  cmp,
+  sete,
+  setne,
+  setl,
+  setg,
+  setle,
+  setge,
+  jmp,
+  jne,
+  call,
+  push,
+  pop,
+  ret,
+  syscall,
+};
+
+const char *mnemonicName(Mnemonic mnemonic);
+
+struct Operand {
+  enum Kind : uint8_t { None, Register, Immediate, Memory, Label } kind = None;
+  /// For registers, and memory: 1, 4 or 8 bytes, or 0 for an address that isn't
+  /// accessed (see lea).
+  uint8_t size = 0;
+  /// For registers the register, for memory the base register.
+  reg base = reg::eax;
+  /// For memory, a register added to the base.
+  bool hasIndex = false;
+  reg index = reg::eax;
+  /// For immediates the value, for memory the displacement, for labels the label (see
+  /// Assembly::label()).
+  int32_t value = 0;
+
+  static Operand r(reg r) {
+    return {.kind = Register, .size = uint8_t(r < reg::rax ? 4 : 8), .base = r};
+  }
+  /// The lowest byte of `r`, e.g. al for eax.
+  static Operand lowByte(reg r) { return {.kind = Register, .size = 1, .base = r}; }
+  static Operand imm(int32_t value) { return {.kind = Immediate, .value = value}; }
+  static Operand mem(reg base, int32_t displacement, uint8_t size) {
+    return {.kind = Memory, .size = size, .base = base, .value = displacement};
+  }
+  /// `[base+index]`, for lea.
+  static Operand address(reg base, reg index) {
+    return {.kind = Memory, .base = base, .hasIndex = true, .index = index};
+  }
+  /// `[base+displacement]`, for lea.
+  static Operand address(reg base, int32_t displacement) {
+    return {.kind = Memory, .base = base, .value = displacement};
+  }
+  static Operand label(uint32_t label) {
+    return {.kind = Label, .value = int32_t(label)};
+  }
+
+  bool isReg32() const { return kind == Register && size == 4; }
+
+  bool operator==(const Operand &other) const;
+  bool operator!=(const Operand &other) const { return !(*this == other); }
+};
+
+struct Record {
+  enum Kind : uint8_t {
+    Instruction,
+    Label,
+    /// An IR instruction, which the instructions after it are the code for.
+    Comment,
+    /// A line (or lines) of text as is.
+    Text,
+    Blank,
+    /// Whatever was here has been optimized away.
+    Deleted,
+  } kind;
+
+  Mnemonic mnemonic = Mnemonic::mov;
+  uint8_t numOperands = 0;
+  Operand operands[3] = {};
+
+  /// For labels the label. For comments the function the IR instruction is in (see
+  /// Assembly::functions), for text where it starts in Assembly::texts.
+  uint32_t index = 0;
+  /// For comments the IR instruction, for text how long it is.
+  uint32_t count = 0;
+
+  bool is(Mnemonic m, size_t n) const {
+    return kind == Instruction && mnemonic == m && numOperands == n;
+  }
+};
+
+class Assembly {
+public:
+  vector<Record> records;
+
+  void emit(Mnemonic mnemonic) { emit(mnemonic, 0, {}, {}, {}); }
+  void emit(Mnemonic mnemonic, Operand a) { emit(mnemonic, 1, a, {}, {}); }
+  void emit(Mnemonic mnemonic, Operand a, Operand b) { emit(mnemonic, 2, a, b, {}); }
+  void emit(Mnemonic mnemonic, Operand a, Operand b, Operand c) {
+    emit(mnemonic, 3, a, b, c);
+  }
+
+  /// The label called `name`, which doesn't have to be anywhere yet.
+  uint32_t label(const string &name);
+  /// Put `label` here.
+  void bind(uint32_t label);
+
+  /// Note down that what comes next is the code for `value` of `function`, which has
+  /// to stay around until the text is produced.
+  void comment(const ir::Function &function, ir::ValueId value);
+  void text(string_view text);
+  void blank();
+
+  inline const string &labelName(uint32_t label) const { return labelNames[label]; }
+  inline size_t numLabels() const { return labelNames.size(); }
+  inline string_view textOf(const Record &record) const {
+    return string_view(texts).substr(record.index, record.count);
+  }
+
+  /// The whole thing as FASM source.
+  string toText() const;
+
+private:
+  void emit(Mnemonic mnemonic, uint8_t numOperands, Operand a, Operand b, Operand c);
+
+  vector<string> labelNames;
+  std::unordered_map<string, uint32_t> labelIds;
+  vector<const ir::Function *> functions;
+  /// Every Text record's text, one after the other.
+  string texts;
+};
+} // namespace compile
@@ -1,65 +1,310 @@
 #include "ast.hpp"
 
 #include "color.hpp"
-#include "lex.hpp"
+#include "table.hpp"
+#include "utils.hpp"
 
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
-#include <iostream>
 #include <string>
 
 namespace ast {
-using std::cerr, std::endl, std::string;
-
-Expression *parseExpression(lex::Lexer &lexer) {
-  lex::Token t = lexer.nextToken();
-
-  switch (t.type) {
-  case lex::NumberLiteral: {
-    lex::Token next = lexer.peek();
-
-    switch (next.type) {
-    case lex::Semicolon:
-      return new Expression{
-          .type = Expr_IntConstant,
-          .integer = (int) t,
-      };
-    default:
-      cerr << color::boldred("ERROR") << ": Unexpected token " << next
-           << " while parsing expression!" << endl;
-      abort();
-    };
-
-  }; break;
-
-  case lex::Identifier: {
-    lex::Token next = lexer.peek();
-    switch (next.type) {
-    case lex::Plus:
-      lexer.eatToken(lex::Plus);
-      return new Expression{
-          .type = Expr_BinaryOp,
-          .binOpType = BinOp_Add,
-          .lhs = new Expression{.type = Expr_VarAccess, .identifier = string(t.span)},
-          .rhs = parseExpression(lexer),
-      };
-
-    case lex::Semicolon:
-      return new Expression{
-          .type = Expr_VarAccess,
-          .identifier = string(t.span),
-      };
-
-    default:
-      cerr << color::boldred("ERROR") << ": Unexpected token " << next
-           << " while parsing expression!" << endl;
-      abort();
+using std::endl, std::string;
+
+namespace {
+using grammar::NodeId, grammar::NO_NODE;
+
+class AstBuilder {
+public:
+  explicit AstBuilder(const grammar::Tree &tree) : tree(tree) {}
+
+  Program program() {
+    Program result;
+    for (NodeId child : children(tree.root)) {
+      if (isRule(child, "funcDef")) {
+        result.funcDefs.push_back(funcDef(child));
+      } else if (isRule(child, "varDef")) {
+        fail("Global variables aren't supported yet");
+      }
+    }
+
+    if (result.funcDefs.empty()) fail("There's nothing to compile");
+    return result;
+  }
+
+private:
+  [[noreturn]] void fail(const string &what) {
+    diagnostics() << color::boldred("ERROR") << ": ";
+    if (!functionName.empty()) diagnostics() << "In " << functionName << ": ";
+    diagnostics() << what << "!" << endl;
+    fatalError(1);
+  }
+
+  vector<NodeId> children(NodeId id) const {
+    vector<NodeId> result;
+    for (NodeId child = tree[id].firstChild; child != NO_NODE;
+         child = tree[child].nextSibling) {
+      result.push_back(child);
+    }
+    return result;
+  }
+
+  std::string_view text(NodeId id) const { return tree.name(id); }
+
+  bool isRule(NodeId id, std::string_view rule) const {
+    return !tree[id].isTerminal() && tree.name(id) == rule;
+  }
+
+  /// Whether `id` is a leaf spelled exactly `spelling`, i.e. a keyword or operator.
+  bool isLeaf(NodeId id, std::string_view spelling) const {
+    return tree[id].isTerminal() && terminal(id) == grammar::TT_Invalid &&
+           tree.name(id) == spelling;
+  }
+
+  /// The kind of token a leaf is, or TT_Invalid for keywords and operators.
+  grammar::TerminalToken terminal(NodeId id) const {
+    const auto &symbol = tree.grammar->table.symbols[tree[id].symbol];
+    if (symbol.type != grammar::RT_TerminalToken) return grammar::TT_Invalid;
+    return symbol.token;
+  }
+
+  FunctionDefinition funcDef(NodeId id) {
+    // type ptrOrRef Identifier "(" funcParams? ")" block
+    vector<NodeId> parts = children(id);
+    FunctionDefinition result{.returnType = type(parts[0]),
+                              .name = string(text(parts[2])),
+                              .parameters = {},
+                              .body = {}};
+    functionName = result.name;
+    checkNoPointer(parts[1]);
+
+    if (isRule(parts[4], "funcParams")) {
+      for (NodeId param : children(parts[4])) {
+        if (!isRule(param, "funcParam")) continue;
+
+        // type ptrOrRef Identifier ("=" expression)?
+        vector<NodeId> paramParts = children(param);
+        checkNoPointer(paramParts[1]);
+        if (paramParts.size() > 3) fail("Default arguments aren't supported yet");
+        result.parameters.push_back(
+            FuncParameter{type(paramParts[0]), string(text(paramParts[2]))});
+      }
+    }
+
+    for (NodeId statement : children(parts.back())) {
+      if (isRule(statement, "statement")) this->statement(statement, result.body);
+    }
+
+    functionName.clear();
+    return result;
+  }
+
+  Type type(NodeId id) {
+    // "const"? _basicType
+    vector<NodeId> parts = children(id);
+    if (parts.size() > 1) fail("const isn't supported yet");
+    return Type::FromBasicType(text(parts[0]));
+  }
+
+  void checkNoPointer(NodeId ptrOrRef) {
+    if (tree[ptrOrRef].firstChild != NO_NODE) {
+      fail("Pointers and references aren't supported yet");
+    }
+  }
+
+  void statement(NodeId id, vector<Statement> &body) {
+    vector<NodeId> parts = children(id);
+    NodeId first = parts[0];
+
+    if (isLeaf(first, "return")) {
+      ReturnStatement result;
+      if (parts.size() == 3) result.returnValue = *expression(parts[1]);
+      body.push_back(std::move(result));
+    } else if (isRule(first, "varDef")) {
+      varDef(first, body);
+    } else if (isRule(first, "expression")) {
+      expressionStatement(first, body);
+    } else if (isLeaf(first, "break") || isLeaf(first, "continue") ||
+               isRule(first, "forLoop") || isRule(first, "whileLoop") ||
+               isRule(first, "doWhileLoop")) {
+      fail("Loops aren't supported yet");
+    } else {
+      fail("Unexpected " + string(text(first)));
+    }
+  }
+
+  void varDef(NodeId id, vector<Statement> &body) {
+    // type varDefInner ("," varDefInner)*
+    vector<NodeId> parts = children(id);
+    VarDefStmt def{.type = type(parts[0]), .names = {}};
+    vector<VarAssignStmt> initializers;
+
+    for (NodeId inner : parts) {
+      if (!isRule(inner, "varDefInner")) continue;
+
+      // ptrOrRef Identifier ("=" expression)?
+      vector<NodeId> innerParts = children(inner);
+      checkNoPointer(innerParts[0]);
+      string name(text(innerParts[1]));
+      def.names.push_back(name);
+      if (innerParts.size() > 2) {
+        initializers.push_back(VarAssignStmt{name, *expression(innerParts[3])});
+      }
+    }
+
+    body.push_back(std::move(def));
+    for (auto &initializer : initializers) body.push_back(std::move(initializer));
+  }
+
+  /// Statements that are just an expression, which can only be an assignment or a
+  /// call, since nothing else has side effects (or can be represented in the AST).
+  void expressionStatement(NodeId id, vector<Statement> &body) {
+    vector<NodeId> parts = children(id);
+    if (parts.size() == 1 && isRule(parts[0], "varAssign")) {
+      // Identifier "=" expression
+      vector<NodeId> assignParts = children(parts[0]);
+      body.push_back(
+          VarAssignStmt{string(text(assignParts[0])), *expression(assignParts[2])});
+    } else if (parts.size() == 1 && isRule(parts[0], "funcCall")) {
+      // Identifier "(" funcCallArgs? ")"
+      vector<NodeId> callParts = children(parts[0]);
+      string name(text(callParts[0]));
+      vector<NodeId> args;
+      if (isRule(callParts[2], "funcCallArgs")) {
+        for (NodeId arg : children(callParts[2])) {
+          if (isRule(arg, "expression")) args.push_back(arg);
+        }
+      }
+
+      if (name == "asm") {
+        Expression *content = args.size() == 1 ? expression(args[0]) : nullptr;
+        if (content == nullptr || content->type != Expr_StringConstant) {
+          fail("asm() takes a single string literal");
+        }
+        body.push_back(InlineAssemblyStatement{content->string});
+      } else if (!args.empty()) {
+        fail("Calling '" + name + "' with arguments isn't supported yet");
+      } else {
+        body.push_back(FuncCallStatement{name});
+      }
+    } else {
+      fail("Expression statements other than assignments and calls aren't "
+           "supported yet");
+    }
+  }
+
+  Expression *newExpression(ExpressionType type) {
+    Expression *result = new Expression{};
+    result->type = type;
+    return result;
+  }
+
+  /// Reducing by `expression -> expression "+" expression` reuses the left hand side's
+  /// node, so an expression is a chain of operands with + or - between them, which
+  /// grammar.rule makes left-associative. The first operand can be a unary operator
+  /// along with the expression it applies to.
+  Expression *expression(NodeId id) {
+    vector<NodeId> parts = children(id);
+    size_t next = parts.size() >= 2 && isRule(parts[1], "expression") ? 2 : 1;
+    Expression *result = operand(parts, next);
+
+    for (; next + 1 < parts.size(); next += 2) {
+      Expression *binary = newExpression(Expr_BinaryOp);
+      binary->binOpType = isLeaf(parts[next], "+") ? BinOp_Add : BinOp_Sub;
+      binary->lhs = result;
+      binary->rhs = expression(parts[next + 1]);
+      result = binary;
+    }
+    return result;
+  }
+
+  Expression *unary(NodeId op, Expression *operand) {
+    if (isLeaf(op, "+")) return operand;
+
+    Expression *result = newExpression(Expr_UnaryOp);
+    result->lhs = operand;
+    if (isLeaf(op, "-")) {
+      result->unaryOpType = UnaryOp_Negate;
+    } else if (isLeaf(op, "!")) {
+      result->unaryOpType = UnaryOp_Not;
+    } else if (isLeaf(op, "*")) {
+      result->unaryOpType = UnaryOp_Deref;
+    } else {
+      result->unaryOpType = UnaryOp_Address;
     }
-  } break;
+    return result;
+  }
 
-  default:
-    cerr << color::boldred("ERROR") << ": Unexpected token " << t
-         << " while parsing expression!" << endl;
-    abort();
+  /// The expression made up of the first `count` of `parts`, which isn't a binary
+  /// operator: a leaf, a nested rule or a unary operator.
+  Expression *operand(const vector<NodeId> &parts, size_t count) {
+    NodeId first = parts[0];
+    if (count == 2) return unary(first, expression(parts[1]));
+
+    if (isRule(first, "string")) {
+      Expression *result = newExpression(Expr_StringConstant);
+      for (NodeId literal : children(first)) result->string += unescape(text(literal));
+      return result;
+    }
+    if (isRule(first, "funcCall")) fail("Calls in expressions aren't supported yet");
+    if (isRule(first, "varAssign")) {
+      fail("Assignments in expressions aren't supported yet");
+    }
+    if (isLeaf(first, "nullptr")) fail("Pointers aren't supported yet");
+
+    Expression *result = newExpression(Expr_IntConstant);
+    switch (terminal(first)) {
+    case grammar::TT_Identifier:
+      result->type = Expr_VarAccess;
+      result->identifier = text(first);
+      break;
+    case grammar::TT_IntegerLiteral: result->integer = integer(text(first)); break;
+    case grammar::TT_CharLiteral:
+      result->integer = (unsigned char) unescape(text(first))[0];
+      break;
+    default: result->integer = isLeaf(first, "true"); break;
+    }
+    return result;
   }
-}
+
+  int integer(std::string_view literal) {
+    string digits(literal);
+    char *end;
+    errno = 0;
+    long long value = strtoll(digits.c_str(), &end, 0);
+    if (errno != 0 || *end != '\0' || value > INT32_MAX) {
+      fail("Can't compile the number " + digits);
+    }
+    return int(value);
+  }
+
+  /// The contents of a string or character literal, with its escape sequences
+  /// replaced by what they stand for.
+  static string unescape(std::string_view literal) {
+    string result;
+    for (size_t i = 0; i < literal.size(); i++) {
+      if (literal[i] != '\\' || i + 1 == literal.size()) {
+        result += literal[i];
+        continue;
+      }
+
+      switch (literal[++i]) {
+      case 'n': result += '\n'; break;
+      case 't': result += '\t'; break;
+      case 'r': result += '\r'; break;
+      case '0': result += '\0'; break;
+      default : result += literal[i]; break;
+      }
+    }
+    return result;
+  }
+
+  const grammar::Tree &tree;
+  /// The function being built, for errors.
+  string functionName;
+};
+} // namespace
+
+Program buildProgram(const grammar::Tree &tree) { return AstBuilder(tree).program(); }
 } // namespace ast
@@ -1,10 +1,10 @@
 #pragma once
 
-#include "lex.hpp"
+#include "grammar.hpp"
 
-#include <cassert>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -14,23 +14,25 @@ using std::string, std::vector, std::optional, std::variant;
 enum TypeKind { Void, Char, Int, Float, Double, Bool, Auto, Class };
 
 struct Type {
-  static Type FromBasicType(lex::Token t) {
-    assert(t.type == lex::BasicType);
+  /// The type called `name`, one of the grammar's _basicType.
+  static Type FromBasicType(std::string_view name) {
     Type result;
 
-    result.name = t.span;
+    result.name = name;
 
-    if (t.span == "void") {
+    if (name == "void") {
       result.kind = Void;
-    } else if (t.span == "int") {
+    } else if (name == "char") {
+      result.kind = Char;
+    } else if (name == "int") {
       result.kind = Int;
-    } else if (t.span == "float") {
+    } else if (name == "float") {
       result.kind = Float;
-    } else if (t.span == "double") {
+    } else if (name == "double") {
       result.kind = Double;
-    } else if (t.span == "bool") {
+    } else if (name == "bool") {
       result.kind = Bool;
-    } else if (t.span == "auto") {
+    } else if (name == "auto") {
       result.kind = Auto;
     } else {
       result.kind = Class;
@@ -134,6 +136,9 @@ struct Program {
   vector<FunctionDefinition> funcDefs;
 };
 
-Expression *parseExpression(lex::Lexer &lexer);
+/// Build the AST of a parse tree of grammar.rule. Whatever the AST (or the code
+/// generator) can't represent yet, like loops or global variables, is reported to
+/// diagnostics() and ends in a fatalError().
+Program buildProgram(const grammar::Tree &tree);
 
 } // namespace ast
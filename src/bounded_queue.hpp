@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+/// A queue for handing things from one thread to another that holds at most
+/// `capacity` of them, so a producer that's faster than its consumer waits for it
+/// instead of piling up everything it produced in memory.
+template<typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : _capacity(capacity) {}
+  BoundedQueue(const BoundedQueue &) = delete;
+
+  /// Add `item` at the back, waiting for room if the queue is full. Returns false
+  /// (and drops the item) if the queue was closed.
+  bool push(T item) {
+    std::unique_lock lock(_mutex);
+    _notFull.wait(lock, [&] { return _closed || _items.size() < _capacity; });
+    if (_closed) return false;
+
+    _items.push_back(std::move(item));
+    lock.unlock();
+    _notEmpty.notify_one();
+    return true;
+  }
+
+  /// Take the item at the front, waiting for one if the queue is empty. Once it's
+  /// closed, whatever is left can still be taken, after which this returns nothing.
+  std::optional<T> pop() {
+    std::unique_lock lock(_mutex);
+    _notEmpty.wait(lock, [&] { return _closed || !_items.empty(); });
+    if (_items.empty()) return std::nullopt;
+
+    std::optional<T> item(std::move(_items.front()));
+    _items.pop_front();
+    lock.unlock();
+    _notFull.notify_one();
+    return item;
+  }
+
+  /// Stop taking new items, and wake up everyone who's waiting.
+  void close() {
+    {
+      std::lock_guard lock(_mutex);
+      _closed = true;
+    }
+    _notEmpty.notify_all();
+    _notFull.notify_all();
+  }
+
+private:
+  const size_t _capacity;
+
+  std::mutex _mutex;
+  std::condition_variable _notEmpty;
+  std::condition_variable _notFull;
+  std::deque<T> _items;
+  bool _closed = false;
+};
@@ -1,262 +1,592 @@
 #include "compile.hpp"
 
+#include "asm.hpp"
 #include "ast.hpp"
+#include "elf.hpp"
+#include "encode.hpp"
+#include "frame.hpp"
+#include "ir.hpp"
+#include "peephole.hpp"
+#include "regalloc.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
-#include <iomanip>
-#include <ostream>
-#include <sstream>
-#include <stack>
+#include <vector>
 
 namespace compile {
-using std::stringstream;
-
-std::ostream &operator<<(std::ostream &os, ast::Expression expr) {
-  switch (expr.type) {
-  case ast::Expr_IntConstant   : os << expr.integer; break;
-  case ast::Expr_StringConstant: os << std::quoted(expr.string); break;
-  case ast::Expr_VarAccess     : os << expr.identifier; break;
-  case ast::Expr_UnaryOp       : os << expr.unaryOpType << " " << *expr.lhs; break;
-  case ast::Expr_BinaryOp:
-    os << *expr.lhs;
-    switch (expr.binOpType) {
-    case ast::BinOp_Add               : os << " + "; break;
-    case ast::BinOp_Sub               : os << " - "; break;
-    case ast::BinOp_Divide            : os << " / "; break;
-    case ast::BinOp_Mult              : os << " * "; break;
-    case ast::BinOp_Modulo            : os << " % "; break;
-    case ast::BinOp_Equal             : os << " == "; break;
-    case ast::BinOp_NotEqual          : os << " != "; break;
-    case ast::BinOp_LessThan          : os << " < "; break;
-    case ast::BinOp_GreaterThan       : os << " > "; break;
-    case ast::BinOp_LessThanOrEqual   : os << " <= "; break;
-    case ast::BinOp_GreaterThanOrEqual: os << " >="; break;
-    }
-    os << *expr.rhs;
-    break;
-  }
-  return os;
+/// Where a value is, as an operand: its register, its stack slot, or the constant
+/// itself.
+static Operand operand(const Context &context, ir::ValueId id) {
+  const ValueInfo &value = context.values[id];
+  if (value.immediate.has_value()) return Operand::imm(*value.immediate);
+  if (value.allocatedReg.has_value()) return Operand::r(*value.allocatedReg);
+  return Operand::mem(context.frame.base, value.slot, value.size);
 }
 
-enum class reg {
-  eax,
-  ebx,
-  esi,
-  edi,
-
-  rax,
-  rbx,
-  rsi,
-  rdi,
-};
-
-static std::ostream &operator<<(std::ostream &os, reg reg) {
-  switch (reg) {
-  case reg::eax: os << "eax"; break;
-  case reg::ebx: os << "ebx"; break;
-  case reg::esi: os << "esi"; break;
-  case reg::edi: os << "edi"; break;
-
-  case reg::rax: os << "rax"; break;
-  case reg::rbx: os << "rbx"; break;
-  case reg::rsi: os << "rsi"; break;
-  case reg::rdi: os << "rdi"; break;
-  }
-  return os;
+/// Whether writing to `a` changes `b`. Constants aren't anywhere, so they never are.
+static bool isSameLocation(const Operand &a, const Operand &b) {
+  if (a.kind != b.kind || a.kind == Operand::Immediate) return false;
+  if (a.kind == Operand::Register) return regNumber(a.base) == regNumber(b.base);
+  return a == b;
 }
 
-/// Produce an assembly instruction that sets `destination` to the value (at) `source`.
-template<typename Dest, typename Src>
-string set(Dest destination, Src source);
-
-/// Produce an assembly instruction that essentially does `destination += source`.
-template<typename Dest, typename Src>
-string addTo(Dest destination, Src source);
+/// Set `destination` to the value (at) `source`, if it isn't there already. Going
+/// from memory to memory takes a detour through r11.
+static void set(Assembly &out, const Operand &destination, const Operand &source) {
+  if (isSameLocation(destination, source)) return;
+  if (destination.kind == Operand::Memory && source.kind == Operand::Memory) {
+    set(out, Operand::r(reg::r11d), source);
+    set(out, destination, Operand::r(reg::r11d));
+    return;
+  }
 
-template<>
-string addTo(reg dest, int src) {
-  stringstream ss;
-  ss << "  add " << dest << ", " << src << "\n";
-  return ss.str();
+  // An I8 only takes up a byte in its slot, but it's sign-extended anywhere else.
+  if (source.kind == Operand::Memory && source.size == 1) {
+    out.emit(Mnemonic::movsx, destination, source);
+  } else if (destination.kind == Operand::Memory && destination.size == 1) {
+    out.emit(Mnemonic::mov, destination,
+             source.kind == Operand::Register ? Operand::lowByte(source.base)
+                                              : Operand::imm(int8_t(source.value)));
+  } else {
+    out.emit(Mnemonic::mov, destination, source);
+  }
 }
 
-template<>
-string addTo(reg dest, reg src) {
-  stringstream ss;
-  ss << "  add " << dest << ", " << src << "\n";
-  return ss.str();
+/// `value`, or r11 with it in it if it's an I8 in memory, which instructions other than
+/// mov can't use as a 32-bit operand.
+static Operand loadIfByte(Assembly &out, const Operand &value) {
+  if (value.kind != Operand::Memory || value.size != 1) return value;
+  set(out, Operand::r(reg::r11d), value);
+  return Operand::r(reg::r11d);
 }
 
-template<>
-string addTo(reg dest, VariableInfo src) {
-  stringstream ss;
-  ss << "  add " << dest << ", [rsp-" << src.size + src.stackPos << "]\n";
-  return ss.str();
-}
+/// Set each destination to its source as if it all happened at once, e.g. swapping
+/// two registers if that's what it takes.
+static void parallelMove(Assembly &out, vector<std::pair<Operand, Operand>> moves) {
+  moves.erase(std::remove_if(moves.begin(), moves.end(),
+                             [](const auto &move) {
+                               return isSameLocation(move.first, move.second);
+                             }),
+              moves.end());
+
+  while (!moves.empty()) {
+    // Do whatever doesn't overwrite the source of another move.
+    auto isFree = [&](const auto &move) {
+      return std::none_of(moves.begin(), moves.end(), [&](const auto &other) {
+        return &other != &move && isSameLocation(move.first, other.second);
+      });
+    };
+    auto it = std::find_if(moves.begin(), moves.end(), isFree);
+    if (it != moves.end()) {
+      set(out, it->first, it->second);
+      moves.erase(it);
+      continue;
+    }
 
-template<>
-string set(reg dest, int src) {
-  stringstream ss;
-  ss << "  mov " << dest << ", " << src << "\n";
-  return ss.str();
+    // What's left goes around in circles, so take one of the sources out of the way
+    // into rax, which lets the move into it go ahead.
+    Operand source = moves[0].second;
+    set(out, Operand::r(reg::eax), source);
+    for (auto &move : moves) {
+      if (isSameLocation(move.second, source)) move.second = Operand::r(reg::eax);
+    }
+  }
 }
 
-template<>
-string set(reg dest, reg src) {
-  stringstream ss;
-  ss << "  mov " << dest << ", " << src << "\n";
-  return ss.str();
+/// Whether an instruction has to be there even if nothing uses its value.
+static bool hasSideEffects(const ir::Instruction &instruction) {
+  return instruction.op == ir::Opcode::Call ||
+         instruction.op == ir::Opcode::InlineAsm || instruction.isTerminator();
 }
 
-template<>
-string set(reg dest, VariableInfo src) {
-  stringstream ss;
-  ss << "  mov " << dest << ", [rsp-" << src.size + src.stackPos << "]" << "\n";
-  return ss.str();
-}
+/// Work out where each value of `function` is live, and give it a register for all of
+/// that (see allocateRegisters()), or a stack slot (see layOutFrame()) where there
+/// aren't enough. `layout` is the order the blocks are emitted in.
+static Context allocateValues(const ir::Function &function,
+                              const vector<ir::BlockId> &layout) {
+  using ir::Opcode, ir::ValueId, ir::BlockId;
+
+  Context context;
+  context.values.resize(function.values.size());
+
+  // What instructions with side effects use is used, and then whatever that uses, etc.
+  vector<ValueId> worklist;
+  for (ValueInfo &info : context.values) info.isUsed = false;
+  for (BlockId b : layout) {
+    for (ValueId id : function.blocks[b].instructions) {
+      if (!hasSideEffects(function[id])) continue;
+      for (ValueId operand : function[id].operands) worklist.push_back(operand);
+    }
+  }
+  while (!worklist.empty()) {
+    ValueId id = worklist.back();
+    worklist.pop_back();
+    if (context.values[id].isUsed) continue;
+    context.values[id].isUsed = true;
+    for (ValueId operand : function[id].operands) worklist.push_back(operand);
+  }
 
-template<>
-string set(VariableInfo dest, int src) {
-  stringstream ss;
-  ss << "  mov dword [rsp-" << dest.size + dest.stackPos << "], " << src << "\n";
-  return ss.str();
-}
+  // Constants go right into the instructions that use them, and leftover garbage
+  // might as well be 0.
+  auto needsPlace = [&](ValueId id) {
+    const ir::Instruction &instruction = function[id];
+    return context.values[id].isUsed && instruction.type != ir::Type::Void &&
+           instruction.op != Opcode::Const && instruction.op != Opcode::Undef;
+  };
+  for (ValueId id = 0; id < function.values.size(); id++) {
+    switch (function[id].op) {
+    case Opcode::Const: context.values[id].immediate = function[id].imm; break;
+    case Opcode::Undef: context.values[id].immediate = 0; break;
+    default           : break;
+    }
+    if (function[id].type == ir::Type::I8) context.values[id].size = 1;
+  }
+
+  // Number the instructions in the order they're emitted in.
+  vector<uint32_t> position(function.values.size(), ir::NONE);
+  vector<uint32_t> blockFrom(function.blocks.size()), blockTo(function.blocks.size());
+  uint32_t nextPosition = 0;
+  for (BlockId b : layout) {
+    blockFrom[b] = nextPosition;
+    for (ValueId id : function.blocks[b].instructions) position[id] = nextPosition++;
+    blockTo[b] = nextPosition - 1;
+  }
+
+  // Which values are live going into each block, until nothing changes anymore. The
+  // operands of phis are live at the end of the predecessor they come from rather
+  // than at the start of the phi's block.
+  vector<vector<bool>> liveIn(function.blocks.size(),
+                              vector<bool>(function.values.size()));
+  vector<vector<bool>> liveOut = liveIn;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto b = layout.rbegin(); b != layout.rend(); ++b) {
+      const ir::Block &block = function.blocks[*b];
+
+      vector<bool> live(function.values.size());
+      for (BlockId succ : block.succs) {
+        for (ValueId id = 0; id < live.size(); id++) {
+          if (liveIn[succ][id]) live[id] = true;
+        }
+        for (ValueId id : function.blocks[succ].instructions) {
+          const ir::Instruction &phi = function[id];
+          if (phi.op != Opcode::Phi) break;
+          for (size_t k = 0; k < phi.operands.size(); k++) {
+            if (phi.targets[k] == *b && needsPlace(phi.operands[k])) {
+              live[phi.operands[k]] = true;
+            }
+          }
+        }
+      }
+      liveOut[*b] = live;
+
+      const auto &instructions = block.instructions;
+      for (auto it = instructions.rbegin(); it != instructions.rend(); ++it) {
+        const ir::Instruction &instruction = function[*it];
+        live[*it] = false;
+        if (instruction.op == Opcode::Phi) continue;
+        for (ValueId operand : instruction.operands) {
+          if (needsPlace(operand)) live[operand] = true;
+        }
+      }
+
+      if (live != liveIn[*b]) {
+        liveIn[*b] = std::move(live);
+        changed = true;
+      }
+    }
+  }
+
+  // Each value is live from the first position it's needed at to the last, which
+  // might include some that it isn't needed at when there are several blocks.
+  vector<LiveInterval> intervals(function.values.size());
+  for (ValueId id = 0; id < function.values.size(); id++) {
+    intervals[id] = {.value = id, .start = UINT32_MAX, .end = 0};
+  }
+  auto extend = [&](ValueId id, uint32_t pos) {
+    intervals[id].start = std::min(intervals[id].start, pos);
+    intervals[id].end = std::max(intervals[id].end, pos);
+  };
+  for (BlockId b : layout) {
+    for (ValueId id = 0; id < function.values.size(); id++) {
+      if (liveIn[b][id]) extend(id, blockFrom[b]);
+      if (liveOut[b][id]) extend(id, blockTo[b]);
+    }
+
+    for (ValueId id : function.blocks[b].instructions) {
+      const ir::Instruction &instruction = function[id];
+      if (needsPlace(id)) extend(id, position[id]);
+
+      for (size_t k = 0; k < instruction.operands.size(); k++) {
+        ValueId operand = instruction.operands[k];
+        if (!needsPlace(operand)) continue;
+
+        // A phi gets its value at the end of the predecessor.
+        if (instruction.op == Opcode::Phi) {
+          extend(operand, blockTo[instruction.targets[k]]);
+          if (needsPlace(id)) extend(id, blockTo[instruction.targets[k]]);
+        } else {
+          extend(operand, position[id]);
+        }
+      }
+    }
+  }
+
+  // Whatever is live while something overwrites registers can't be in those.
+  vector<std::pair<uint32_t, uint32_t>> clobbers;
+  bool makesCalls = false, hasInlineAsm = false;
+  for (BlockId b : layout) {
+    for (ValueId id : function.blocks[b].instructions) {
+      uint32_t mask;
+      switch (function[id].op) {
+      case Opcode::Call:
+        mask = callerSavedRegs();
+        makesCalls = true;
+        break;
+      case Opcode::InlineAsm:
+        mask = UINT32_MAX;
+        hasInlineAsm = true;
+        break;
+      case Opcode::Div:
+      case Opcode::Mod      : mask = regBit(reg::edx); break;
+      default               : continue;
+      }
+      clobbers.push_back({position[id], mask});
+    }
+  }
 
-template<>
-string set(VariableInfo dest, reg src) {
-  stringstream ss;
-  ss << "  mov dword [rsp-" << dest.size + dest.stackPos << "], " << src << "\n";
-  return ss.str();
+  vector<LiveInterval> usedIntervals;
+  for (ValueId id = 0; id < function.values.size(); id++) {
+    if (!needsPlace(id)) continue;
+
+    LiveInterval &interval = intervals[id];
+    auto it = std::upper_bound(clobbers.begin(), clobbers.end(),
+                               std::pair(interval.start, UINT32_MAX));
+    for (; it != clobbers.end() && it->first < interval.end; ++it) {
+      interval.clobbered |= it->second;
+    }
+    // rbp is only free for values if there's no frame pointer (see layOutFrame()).
+    if (hasInlineAsm) interval.clobbered |= regBit(reg::rbp);
+    usedIntervals.push_back(interval);
+  }
+
+  Allocation allocation = allocateRegisters(usedIntervals, function.values.size());
+  context.savedRegs = allocation.savedRegs;
+
+  vector<ValueId> spilled;
+  for (ValueId id = 0; id < function.values.size(); id++) {
+    if (!needsPlace(id)) continue;
+
+    context.values[id].allocatedReg = allocation.registers[id];
+    if (!allocation.registers[id].has_value()) spilled.push_back(id);
+  }
+  layOutFrame(context, spilled, makesCalls, hasInlineAsm);
+
+  return context;
 }
 
-string compileProgram(ast::Program program) {
-  assert(!program.funcDefs.empty());
+/// Produce the code for `function`, which has to have its critical edges split, and
+/// run it through the peephole optimizer.
+static void compileFunction(const ir::Function &function, Assembly &out,
+                            PeepholeStats &stats) {
+  using ir::Opcode, ir::ValueId, ir::BlockId;
+
+  const size_t start = out.records.size();
+
+  const vector<BlockId> layout = ir::reversePostorder(function);
+  const Context context = allocateValues(function, layout);
+  const Frame &frame = context.frame;
+
+  vector<uint32_t> labels(function.blocks.size());
+  for (BlockId b : layout) {
+    labels[b] = b == 0 ? out.label(function.name)
+                       : out.label(function.name + "__bb" + std::to_string(b));
+  }
+  const uint32_t returnLabel = out.label(function.name + "__return");
+
+  out.bind(labels[0]);
+  if (frame.hasFramePointer) {
+    out.emit(Mnemonic::push, Operand::r(reg::rbp));
+    out.emit(Mnemonic::mov, Operand::r(reg::rbp), Operand::r(reg::rsp));
+  }
+  for (reg saved : context.savedRegs) {
+    out.emit(Mnemonic::push, Operand::r(reg64(saved)));
+  }
+  if (frame.size != 0) {
+    out.emit(Mnemonic::sub, Operand::r(reg::rsp), Operand::imm(frame.size));
+  }
 
-  stringstream result;
-
-  result << "format ELF64 executable\n\n";
-  result << "_start:\n"
-         << "  ;; Initialize globals\n"
-         << "  ;; ...\n\n"
-         << "  ;; Call main\n"
-         << "  call main\n\n"
-         << "  ;; Exit with status code = result from main.\n"
-         << "  mov rdi, rax                ; return code: whatever main returned\n"
-         << "  mov rax, 60                 ; sys_exit(fd)\n"
-         << "  syscall\n\n";
-
-  Context currContext;
-
-  for (const auto &funcDef : program.funcDefs) {
-    result << funcDef.name << ":\n"
-           << "  push rbp\n"
-           << "  mov rbp, rsp\n\n";
-
-    for (const auto &statement : funcDef.body) {
-      std::visit(
-          Overloaded{
-              [&result, &currContext](ast::VarDefStmt def) {
-                assert(def.type.kind != ast::Void);
-
-                size_t totalSize = 0;
-
-                for (const auto &name : def.names) {
-                  VariableInfo varInfo{
-                      .stackPos = currContext.currStackPos,
-                      .size = 4,
-                  };
-
-                  // Allocate the variable.
-                  currContext.variables[name] = varInfo;
-
-                  // Record how much space it took up.
-                  currContext.currStackPos += varInfo.size;
-                  totalSize += varInfo.size;
-                }
-
-                result << "  sub rsp, " << totalSize << "   ; ";
-
-                for (size_t i = 0; i < def.names.size(); i++) {
-                  if (i > 0) result << ", ";
-                  result << def.names[i];
-                }
-                result << "\n";
-              },
-              [&result, &currContext](ast::VarAssignStmt assignment) {
-                const auto &expr = assignment.expression;
-                const auto &varInfo = currContext.variables.at(assignment.varName);
-
-                result << "  ;; " << assignment.varName << " = "
-                       << assignment.expression << ";\n";
-
-                switch (expr.type) {
-                case ast::Expr_IntConstant:
-                  result << set(varInfo, expr.integer) << "\n";
-                  break;
-                case ast::Expr_BinaryOp: {
-                  auto lhs = assignment.expression.lhs;
-                  auto rhs = assignment.expression.rhs;
-
-                  // FIXME(Mario, 2025-09-17):
-                  //   Support something other than addition...
-                  assert(expr.binOpType == ast::BinOp_Add);
-
-                  if (lhs->type == ast::Expr_IntConstant)
-                    result << set(reg::eax, lhs->integer);
-                  else
-                    result << set(reg::eax, currContext.variables.at(lhs->identifier));
-
-                  if (lhs->type == ast::Expr_IntConstant)
-                    result << addTo(reg::eax, rhs->integer);
-                  else
-                    result << addTo(reg::eax,
-                                    currContext.variables.at(rhs->identifier));
-
-                  result << set(varInfo, reg::eax) << "\n";
-
-                } break;
-
-                  // default: abort();
-                }
-              },
-              [&result](ast::FuncCallStatement funcCall) {
-                result << "  call " << funcCall.functionName << "\n";
-              },
-              [&result](ast::InlineAssemblyStatement inlineAsm) {
-                result << inlineAsm.content << "\n";
-              },
-              [&result, &currContext, &funcDef](ast::ReturnStatement ret) {
-                if (ret.returnValue.has_value()) {
-                  auto expr = ret.returnValue.value();
-                  switch (expr.type) {
-                  case ast::Expr_IntConstant:
-                    result << set(reg::rax, expr.integer);
-                    break;
-                  case ast::Expr_VarAccess: {
-                    auto varInfo = currContext.variables.at(expr.identifier);
-
-                    result << "  ;; return " << expr.identifier << ";\n";
-                    result << "  mov rax, [rsp-" << varInfo.stackPos + varInfo.size
-                           << "]" << "\n";
-                  } break;
-                  default: abort();
-                  }
-                }
-                result << "  jmp " << funcDef.name << "__return\n";
-              },
-              [](auto node) {},
-          },
-          statement);
+  // The parameters come in registers (System V ABI), which might be where other
+  // parameters want to be.
+  static constexpr reg PARAMETER_REGS[] = {reg::edi, reg::esi, reg::edx,
+                                           reg::ecx, reg::r8d, reg::r9d};
+  vector<std::pair<Operand, Operand>> parameterMoves;
+  for (ValueId id : function.blocks[0].instructions) {
+    const ir::Instruction &param = function[id];
+    if (param.op == Opcode::Param && context.values[id].isUsed) {
+      parameterMoves.push_back(
+          {operand(context, id), Operand::r(PARAMETER_REGS[param.imm])});
+    }
+  }
+  parallelMove(out, parameterMoves);
+  out.blank();
+
+  for (size_t i = 0; i < layout.size(); i++) {
+    const BlockId b = layout[i];
+    const BlockId next = i + 1 < layout.size() ? layout[i + 1] : ir::NONE;
+    if (b != 0) out.bind(labels[b]);
+
+    for (ValueId id : function.blocks[b].instructions) {
+      const ir::Instruction &instruction = function[id];
+      const ValueInfo &destInfo = context.values[id];
+      if ((!destInfo.isUsed && !hasSideEffects(instruction)) ||
+          instruction.op == Opcode::Const || instruction.op == Opcode::Undef ||
+          instruction.op == Opcode::Param || instruction.op == Opcode::Phi) {
+        continue;
+      }
+
+      if (instruction.op != Opcode::InlineAsm) out.comment(function, id);
+
+      auto source = [&](size_t k) {
+        return operand(context, instruction.operands[k]);
+      };
+      const Operand dest = operand(context, id);
+
+      // Compute the value right in its register if it has one.
+      const Operand target = Operand::r(destInfo.allocatedReg.value_or(reg::eax));
+
+      switch (instruction.op) {
+      case Opcode::Add:
+      case Opcode::Mul: {
+        Operand lhs = source(0), rhs = source(1);
+
+        // The target might be where the right hand side is, but then neither minds
+        // going the other way around.
+        if ((isSameLocation(rhs, target) && !isSameLocation(lhs, target)) ||
+            lhs.kind == Operand::Immediate) {
+          std::swap(lhs, rhs);
+        }
+
+        if (instruction.op == Opcode::Add) {
+          set(out, target, lhs);
+          out.emit(Mnemonic::add, target, loadIfByte(out, rhs));
+        } else if (rhs.kind == Operand::Immediate) {
+          // Multiplying by a constant takes one more operand instead.
+          if (lhs.kind == Operand::Immediate) {
+            set(out, target, lhs);
+            lhs = target;
+          }
+          out.emit(Mnemonic::imul, target, loadIfByte(out, lhs), rhs);
+        } else {
+          set(out, target, lhs);
+          out.emit(Mnemonic::imul, target, loadIfByte(out, rhs));
+        }
+      } break;
+
+      case Opcode::Sub:
+        if (isSameLocation(source(1), target) && !isSameLocation(source(0), target)) {
+          out.emit(Mnemonic::neg, target);
+          out.emit(Mnemonic::add, target, loadIfByte(out, source(0)));
+        } else {
+          set(out, target, source(0));
+          out.emit(Mnemonic::sub, target, loadIfByte(out, source(1)));
+        }
+        break;
+
+      case Opcode::Div:
+      case Opcode::Mod: {
+        // idiv divides edx:eax by its operand, which can't be a constant, nor in the
+        // way of edx being overwritten, nor just a byte.
+        Operand divisor = source(1);
+        if (divisor.kind == Operand::Immediate ||
+            isSameLocation(divisor, Operand::r(reg::edx)) ||
+            (divisor.kind == Operand::Memory && divisor.size == 1)) {
+          set(out, Operand::r(reg::r11d), divisor);
+          divisor = Operand::r(reg::r11d);
+        }
+        set(out, Operand::r(reg::eax), source(0));
+        out.emit(Mnemonic::cdq);
+        out.emit(Mnemonic::idiv, divisor);
+        set(out, dest,
+            Operand::r(instruction.op == Opcode::Div ? reg::eax : reg::edx));
+        out.blank();
+        continue;
+      }
+
+      case Opcode::Equal:
+      case Opcode::NotEqual:
+      case Opcode::LessThan:
+      case Opcode::GreaterThan:
+      case Opcode::LessThanOrEqual:
+      case Opcode::GreaterThanOrEqual:
+      case Opcode::Not: {
+        Operand lhs = source(0);
+        Operand rhs = instruction.op == Opcode::Not ? Operand::imm(0) : source(1);
+        if (lhs.kind != Operand::Register) {
+          set(out, Operand::r(reg::eax), lhs);
+          lhs = Operand::r(reg::eax);
+        }
+
+        Mnemonic setcc = Mnemonic::sete;
+        switch (instruction.op) {
+        case Opcode::NotEqual          : setcc = Mnemonic::setne; break;
+        case Opcode::LessThan          : setcc = Mnemonic::setl; break;
+        case Opcode::GreaterThan       : setcc = Mnemonic::setg; break;
+        case Opcode::LessThanOrEqual   : setcc = Mnemonic::setle; break;
+        case Opcode::GreaterThanOrEqual: setcc = Mnemonic::setge; break;
+        default                        : break;
+        }
+        out.emit(Mnemonic::cmp, lhs, loadIfByte(out, rhs));
+        out.emit(setcc, Operand::lowByte(reg::eax));
+        out.emit(Mnemonic::movzx, target, Operand::lowByte(reg::eax));
+      } break;
+
+      case Opcode::Negate:
+        set(out, target, source(0));
+        out.emit(Mnemonic::neg, target);
+        break;
+
+      case Opcode::Trunc: {
+        // Sign-extend the lowest byte back to the whole register (see ir::Type::I8).
+        Operand value = source(0);
+        if (value.kind == Operand::Immediate) {
+          set(out, target, Operand::imm(int8_t(value.value)));
+        } else {
+          if (value.kind == Operand::Register) {
+            value = Operand::lowByte(value.base);
+          } else {
+            value.size = 1;
+          }
+          out.emit(Mnemonic::movsx, target, value);
+        }
+      } break;
+
+      case Opcode::SExt: set(out, target, source(0)); break;
+
+      case Opcode::Call:
+        out.emit(Mnemonic::call, Operand::label(out.label(instruction.text)));
+        if (destInfo.isUsed) set(out, dest, Operand::r(reg::eax));
+        out.blank();
+        continue;
+
+      case Opcode::InlineAsm:
+        out.text(instruction.text);
+        out.blank();
+        continue;
+
+      case Opcode::Jump: {
+        // The phis of the block it goes to get their values on the way there.
+        BlockId succ = instruction.targets[0];
+        vector<std::pair<Operand, Operand>> phiMoves;
+        for (ValueId phiId : function.blocks[succ].instructions) {
+          const ir::Instruction &phi = function[phiId];
+          if (phi.op != Opcode::Phi) break;
+          if (!context.values[phiId].isUsed) continue;
+
+          size_t k = std::find(phi.targets.begin(), phi.targets.end(), b) -
+                     phi.targets.begin();
+          phiMoves.push_back(
+              {operand(context, phiId), operand(context, phi.operands[k])});
+        }
+        parallelMove(out, phiMoves);
+        if (succ != next) out.emit(Mnemonic::jmp, Operand::label(labels[succ]));
+        out.blank();
+        continue;
+      }
+
+      case Opcode::Branch: {
+        // Critical edges are split, so the targets don't have phis.
+        const Operand condition = source(0);
+        if (condition.kind == Operand::Immediate) {
+          BlockId succ = instruction.targets[condition.value != 0 ? 0 : 1];
+          if (succ != next) out.emit(Mnemonic::jmp, Operand::label(labels[succ]));
+        } else {
+          out.emit(Mnemonic::cmp, condition, Operand::imm(0));
+          out.emit(Mnemonic::jne, Operand::label(labels[instruction.targets[0]]));
+          if (instruction.targets[1] != next) {
+            out.emit(Mnemonic::jmp, Operand::label(labels[instruction.targets[1]]));
+          }
+        }
+        out.blank();
+        continue;
+      }
+
+      case Opcode::Return:
+        // Writing eax clears the upper half of rax too.
+        if (!instruction.operands.empty()) set(out, Operand::r(reg::eax), source(0));
+        if (next != ir::NONE) out.emit(Mnemonic::jmp, Operand::label(returnLabel));
+        out.blank();
+        continue;
+
+      default: abort();
+      }
+
+      set(out, dest, target);
+      out.blank();
     }
+  }
+
+  out.bind(returnLabel);
+  if (frame.size != 0) {
+    out.emit(Mnemonic::add, Operand::r(reg::rsp), Operand::imm(frame.size));
+  }
+  for (auto it = context.savedRegs.rbegin(); it != context.savedRegs.rend(); ++it) {
+    out.emit(Mnemonic::pop, Operand::r(reg64(*it)));
+  }
+  if (frame.hasFramePointer) out.emit(Mnemonic::pop, Operand::r(reg::rbp));
+  out.emit(Mnemonic::ret);
+  out.blank();
 
-    result << funcDef.name << "__return:\n"
-           << "  add rsp, " << currContext.currStackPos << "\n"
-           << "  pop rbp\n"
-           << "  ret\n\n";
+  for (const string &text : function.unreachableAsm) {
+    out.text(text);
+    out.blank();
   }
 
-  return result.str();
+  optimizePeephole(out, start, stats);
+}
+
+string compileProgram(ast::Program program, OutputFormat format,
+                      PeepholeStats *peepholeStats) {
+  assert(!program.funcDefs.empty());
+
+  Assembly out;
+  PeepholeStats stats;
+
+  if (format == OutputFormat::Fasm) out.text("format ELF64 executable\n");
+  const uint32_t entry = out.label("_start");
+  out.bind(entry);
+  out.text("  ;; Initialize globals\n"
+           "  ;; ...\n\n"
+           "  ;; Call main");
+  out.emit(Mnemonic::call, Operand::label(out.label("main")));
+  out.blank();
+  out.text("  ;; Exit with status code = result from main.\n"
+           "  ;; return code: whatever main returned, sys_exit(fd)");
+  out.emit(Mnemonic::mov, Operand::r(reg::rdi), Operand::r(reg::rax));
+  out.emit(Mnemonic::mov, Operand::r(reg::rax), Operand::imm(60));
+  out.emit(Mnemonic::syscall);
+  out.blank();
+
+  // The IR has to stay around for the comments in the assembly.
+  vector<ir::Function> functions = ir::lowerProgram(program);
+  for (ir::Function &function : functions) {
+    ir::computeCfg(function);
+    ir::propagateConstants(function);
+    ir::splitCriticalEdges(function);
+    ir::computeDominators(function);
+    assert(ir::verify(function));
+
+    compileFunction(function, out, stats);
+  }
+
+  if (peepholeStats != nullptr) *peepholeStats += stats;
+
+  if (format == OutputFormat::Fasm) return out.toText();
+  MachineCode code = encode(out);
+  return elfExecutable(code.bytes, code.labelOffsets[entry]);
 }
 } // namespace compile
@@ -3,21 +3,132 @@
 #include "ast.hpp"
 
 #include <cstddef>
+#include <cstdint>
 #include <map>
+#include <optional>
 #include <string>
+#include <vector>
 
 namespace compile {
 using std::string, std::map;
 
-struct VariableInfo {
-  size_t stackPos;
-  size_t size;
+/// The general purpose registers, 32-bit names first, in the order x86 numbers them.
+enum class reg : uint8_t {
+  eax,
+  ecx,
+  edx,
+  ebx,
+  esp,
+  ebp,
+  esi,
+  edi,
+  r8d,
+  r9d,
+  r10d,
+  r11d,
+  r12d,
+  r13d,
+  r14d,
+  r15d,
+
+  rax,
+  rcx,
+  rdx,
+  rbx,
+  rsp,
+  rbp,
+  rsi,
+  rdi,
+  r8,
+  r9,
+  r10,
+  r11,
+  r12,
+  r13,
+  r14,
+  r15,
+};
+
+constexpr size_t NUM_REGISTERS = 16;
+
+/// The number x86 encodes `r` with, the same for its 32-bit and 64-bit names.
+inline unsigned regNumber(reg r) { return unsigned(r) % NUM_REGISTERS; }
+inline reg reg32(reg r) { return reg(regNumber(r)); }
+inline reg reg64(reg r) { return reg(regNumber(r) + NUM_REGISTERS); }
+
+inline const char *regName(reg r) {
+  static const char *const NAMES[] = {
+      "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d",
+      "r11d", "r12d", "r13d", "r14d", "r15d", "rax", "rcx", "rdx", "rbx", "rsp", "rbp",
+      "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+  };
+  return NAMES[size_t(r)];
+}
+
+/// Whether a function has to put `r` back the way it found it before returning
+/// (System V ABI).
+inline bool isCalleeSaved(reg r) {
+  switch (reg64(r)) {
+  case reg::rbx:
+  case reg::rsp:
+  case reg::rbp:
+  case reg::r12:
+  case reg::r13:
+  case reg::r14:
+  case reg::r15: return true;
+  default      : return false;
+  }
+}
+
+/// Where a value of the IR (see ir.hpp) is.
+struct ValueInfo {
+  /// Where its stack slot is, relative to Frame::base.
+  int32_t slot = 0;
+  /// How big its stack slot is: 1 for an I8, which is sign-extended whenever it's
+  /// loaded, and 4 for an I32.
+  size_t size = 4;
+  /// The register the value lives in, unless it had to be spilled to its stack slot.
+  std::optional<reg> allocatedReg = {};
+  /// The value itself, for constants, which don't need to be anywhere.
+  std::optional<int32_t> immediate = {};
+  /// Whether anything that matters needs the value. If not, it gets neither a register
+  /// nor a slot, and computing it is skipped.
+  bool isUsed = true;
+};
+
+/// A function's stack frame (see layOutFrame()). On entry, the function pushes rbp if
+/// it has a frame pointer, then the callee-saved registers it uses, and then moves rsp
+/// down by `size` for the stack slots.
+struct Frame {
+  /// Whether rbp points to where the old one was saved, for addressing the slots
+  /// from. That's only needed when something else might move rsp in the meantime.
+  bool hasFramePointer = false;
+  int32_t size = 0;
+  /// rbp or rsp, which the slots are addressed relative to.
+  reg base = reg::rsp;
 };
 
 struct Context {
-  size_t currStackPos = 0;
-  std::map<string, VariableInfo> variables;
+  /// By ir::ValueId.
+  std::vector<ValueInfo> values;
+  /// The callee-saved registers the function uses, which it saves on entry.
+  std::vector<reg> savedRegs;
+  Frame frame;
+};
+
+struct PeepholeStats;
+
+/// What compileProgram() produces.
+enum class OutputFormat {
+  /// An ELF64 executable (see elf.hpp), ready to run.
+  Executable,
+  /// FASM source for the same thing, for seeing what's going on. Inline assembly only
+  /// works with this, since it's FASM's to assemble.
+  Fasm,
 };
 
-string compileProgram(ast::Program);
+/// Compile `program` into `format`. If `peepholeStats` isn't null, the peephole
+/// optimizer's stats are added to it.
+string compileProgram(ast::Program, OutputFormat format = OutputFormat::Executable,
+                      PeepholeStats *peepholeStats = nullptr);
 } // namespace compile
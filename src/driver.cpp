@@ -0,0 +1,378 @@
+#include "driver.hpp"
+
+#include "bounded_queue.hpp"
+#include "color.hpp"
+#include "file.hpp"
+#include "lex.hpp"
+#include "table.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+using std::cerr, std::endl, std::string;
+
+int compileFile(const grammar::Grammar *grammar, const string &filename, bool useGlr,
+                unsigned numLexThreads, std::ostream &output) {
+  auto source = FileContents::read(filename);
+  if (!source.has_value()) {
+    diagnostics() << "ERROR: Failed to read or open '" << filename << "'!" << endl;
+    return 1;
+  }
+
+  try {
+    lex::Lexer lexer(filename, source->text().data(), source->text().size());
+    grammar::Tree tree = useGlr ? grammar::parseGLR(grammar, lexer, numLexThreads)
+                                : grammar::parse(grammar, lexer, numLexThreads);
+    grammar::printNodeTree(tree, output);
+  } catch (const FatalError &error) {
+    return error.exitCode;
+  }
+
+  return 0;
+}
+
+int generateCode(const grammar::Grammar *grammar, const string &filename, bool useGlr,
+                 compile::OutputFormat format, const string &outputPath,
+                 compile::PeepholeStats *peepholeStats) {
+  auto source = FileContents::read(filename);
+  if (!source.has_value()) {
+    diagnostics() << "ERROR: Failed to read or open '" << filename << "'!" << endl;
+    return 1;
+  }
+
+  string code;
+  try {
+    lex::Lexer lexer(filename, source->text().data(), source->text().size());
+    grammar::Tree tree = useGlr ? grammar::parseGLR(grammar, lexer)
+                                : grammar::parse(grammar, lexer);
+    code = compile::compileProgram(ast::buildProgram(tree), format, peepholeStats);
+  } catch (const FatalError &error) {
+    return error.exitCode;
+  }
+
+  std::ofstream output(outputPath, std::ios::binary | std::ios::trunc);
+  if (!output.write(code.data(), code.size())) {
+    diagnostics() << "ERROR: Failed to write '" << outputPath << "'!" << endl;
+    return 1;
+  }
+  output.close();
+  if (format == compile::OutputFormat::Executable) chmod(outputPath.c_str(), 0755);
+  return 0;
+}
+
+int compileFileStreaming(const grammar::Grammar *grammar, const string &filename,
+                         std::ostream &output) {
+  // How many parsed declarations can be waiting to be printed at most.
+  constexpr size_t MAX_PENDING_ITEMS = 64;
+
+  auto source = FileContents::read(filename);
+  if (!source.has_value()) {
+    diagnostics() << "ERROR: Failed to read or open '" << filename << "'!" << endl;
+    return 1;
+  }
+
+  const char *text = source->text().data();
+  grammar::TreePrinter printer(grammar, output);
+  BoundedQueue<grammar::Tree> items(MAX_PENDING_ITEMS);
+
+  // The lexer and the parser are always ahead of what's been printed, so once an item
+  // is, nothing needs the source code before it anymore.
+  std::thread printing([&] {
+    while (auto item = items.pop()) {
+      // The spans are in the order the tokens were in.
+      size_t end = 0;
+      if (!item->spans.empty()) {
+        end = item->spans.back().data() + item->spans.back().size() - text;
+      }
+
+      printer.print(std::move(item.value()));
+      source->discardBefore(end);
+    }
+  });
+
+  int exitCode = 0;
+  try {
+    lex::Lexer lexer(filename, text, source->text().size());
+    grammar::Tree rest = grammar::parseStreaming(
+        grammar, lexer, [&](grammar::Tree item) { items.push(std::move(item)); });
+
+    items.close();
+    printing.join();
+    printer.finish(rest);
+  } catch (const FatalError &error) {
+    exitCode = error.exitCode;
+  }
+
+  // Whatever the printing thread uses has to outlive it, error or not.
+  if (printing.joinable()) {
+    items.close();
+    printing.join();
+    output.flush();
+  }
+  return exitCode;
+}
+
+// Requests and responses are a few fields, each either a single integer or a string
+// prefixed with its length:
+//
+//   request:  uint8 useGlr, uint8 format, string sourcePath, string outputPath
+//   response: int32 exitCode, string diagnostics
+//
+// A format of 0 asks for the parse tree, anything else for the compile::OutputFormat
+// one less than it.
+
+namespace {
+constexpr const char *GRAMMAR_FILE = "grammar.rule";
+
+/// Nothing sent over the socket is bigger than this.
+constexpr uint32_t MAX_MESSAGE_SIZE = 1 << 30;
+
+bool writeAll(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool readAll(int fd, void *data, size_t size) {
+  char *p = static_cast<char *>(data);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+template<typename T>
+bool writePod(int fd, T value) {
+  return writeAll(fd, &value, sizeof(value));
+}
+
+template<typename T>
+bool readPod(int fd, T &value) {
+  return readAll(fd, &value, sizeof(value));
+}
+
+bool writeString(int fd, const string &s) {
+  return s.size() <= MAX_MESSAGE_SIZE && writePod<uint32_t>(fd, s.size()) &&
+         writeAll(fd, s.data(), s.size());
+}
+
+bool readString(int fd, string &s) {
+  uint32_t size;
+  if (!readPod(fd, size) || size > MAX_MESSAGE_SIZE) return false;
+  s.resize(size);
+  return readAll(fd, s.data(), size);
+}
+
+/// Make `path` absolute, so the server finds it no matter where it was started.
+string absolutePath(const string &path) {
+  if (!path.empty() && path[0] == '/') return path;
+
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd))) return path;
+  return string(cwd) + "/" + path;
+}
+
+bool fillAddress(const string &socketPath, sockaddr_un &address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    cerr << color::boldred("ERROR") << ": Socket path '" << socketPath
+         << "' is too long!" << endl;
+    return false;
+  }
+  memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+  return true;
+}
+
+void serveClient(int fd, GrammarWatcher &watcher) {
+  uint8_t useGlr, format;
+  string sourcePath, outputPath;
+  if (!readPod(fd, useGlr) || !readPod(fd, format) || !readString(fd, sourcePath) ||
+      !readString(fd, outputPath) ||
+      format > 1 + static_cast<uint8_t>(compile::OutputFormat::Fasm)) {
+    return;
+  }
+
+  std::ostringstream messages;
+  diagnosticStream = &messages;
+
+  int exitCode;
+  auto grammar = watcher.get();
+  if (format != 0) {
+    exitCode = generateCode(grammar.get(), sourcePath, useGlr,
+                            static_cast<compile::OutputFormat>(format - 1), outputPath);
+  } else if (std::ofstream output(outputPath, std::ios::trunc); !output) {
+    messages << "ERROR: Failed to open '" << outputPath << "' for writing!" << endl;
+    exitCode = 1;
+  } else {
+    exitCode = compileFile(grammar.get(), sourcePath, useGlr, 1, output);
+  }
+
+  diagnosticStream = &cerr;
+  if (writePod<int32_t>(fd, exitCode)) writeString(fd, messages.str());
+}
+} // namespace
+
+bool GrammarWatcher::load() {
+  struct stat info;
+  if (stat(GRAMMAR_FILE, &info) != 0) {
+    std::lock_guard lock(_mutex);
+    _grammar.reset(grammar::defaultGrammar());
+    return true;
+  }
+
+  return reloadIfChanged();
+}
+
+std::shared_ptr<const grammar::Grammar> GrammarWatcher::get() {
+  reloadIfChanged();
+  std::lock_guard lock(_mutex);
+  return _grammar;
+}
+
+bool GrammarWatcher::reloadIfChanged() {
+  // Looked at every time, so a grammar.rule created after the server started gets
+  // picked up too. If it goes away, the last grammar stays.
+  struct stat info;
+  if (stat(GRAMMAR_FILE, &info) != 0) {
+    std::lock_guard lock(_mutex);
+    return _grammar != nullptr;
+  }
+
+  auto modified = std::make_pair(info.st_mtim.tv_sec, info.st_mtim.tv_nsec);
+  {
+    std::lock_guard lock(_mutex);
+    bool unchanged = modified == _modified && info.st_size == _size;
+    if (_reloading || (_grammar && unchanged)) return _grammar != nullptr;
+    _reloading = true;
+  }
+
+  // Building the table can take a while, and requests keep using the old grammar
+  // until it's done.
+  std::shared_ptr<const grammar::Grammar> loaded;
+  try {
+    loaded.reset(grammar::parseGrammarFile(GRAMMAR_FILE));
+    cerr << color::bold("INFO") << ": Loaded " << GRAMMAR_FILE << " ("
+         << loaded->table.numStates << " states)" << endl;
+  } catch (const FatalError &) {
+  }
+
+  std::lock_guard lock(_mutex);
+  if (loaded) {
+    _grammar = std::move(loaded);
+  } else if (_grammar) {
+    diagnostics() << color::yellow("WARN") << ": Keeping the last good grammar." << endl;
+  }
+
+  // Don't retry a broken grammar until it changes again.
+  _modified = modified;
+  _size = info.st_size;
+  _reloading = false;
+  return _grammar != nullptr;
+}
+
+int runServer(const string &socketPath) {
+  // Never freed, since the thread watching the grammar never stops.
+  GrammarWatcher &watcher = *new GrammarWatcher;
+  try {
+    if (!watcher.load()) return 1;
+  } catch (const FatalError &error) {
+    return error.exitCode;
+  }
+
+  sockaddr_un address;
+  if (!fillAddress(socketPath, address)) return 1;
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(socketPath.c_str());
+  if (listener < 0 || bind(listener, (sockaddr *) &address, sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    cerr << color::boldred("ERROR") << ": Failed to listen on '" << socketPath
+         << "': " << strerror(errno) << endl;
+    return 1;
+  }
+
+  // A client that goes away mid-response shouldn't take the server with it.
+  signal(SIGPIPE, SIG_IGN);
+  cerr << color::bold("INFO") << ": Listening on " << socketPath << endl;
+
+  // Keep the table up to date even while nobody's asking, so the first compile after
+  // editing the grammar doesn't have to wait for it.
+  std::thread([&watcher] {
+    while (true) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      watcher.get();
+    }
+  }).detach();
+
+  ThreadPool pool(std::thread::hardware_concurrency());
+  while (true) {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0 && errno == EINTR) continue;
+    if (fd < 0) {
+      cerr << color::boldred("ERROR") << ": accept() failed: " << strerror(errno)
+           << endl;
+      return 1;
+    }
+
+    pool.submit([fd, &watcher] {
+      serveClient(fd, watcher);
+      close(fd);
+    });
+  }
+}
+
+int runClient(const string &socketPath, const string &sourcePath,
+              const string &outputPath, bool useGlr,
+              std::optional<compile::OutputFormat> format) {
+  sockaddr_un address;
+  if (!fillAddress(socketPath, address)) return 1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (sockaddr *) &address, sizeof(address)) != 0) {
+    cerr << color::boldred("ERROR") << ": Failed to connect to '" << socketPath
+         << "': " << strerror(errno) << endl;
+    return 1;
+  }
+
+  int32_t exitCode;
+  string messages;
+  uint8_t formatByte = format ? 1 + static_cast<uint8_t>(*format) : 0;
+  if (!writePod<uint8_t>(fd, useGlr) || !writePod(fd, formatByte) ||
+      !writeString(fd, absolutePath(sourcePath)) ||
+      !writeString(fd, absolutePath(outputPath)) || !readPod(fd, exitCode) ||
+      !readString(fd, messages)) {
+    cerr << color::boldred("ERROR") << ": Lost the connection to the server!" << endl;
+    close(fd);
+    return 1;
+  }
+
+  close(fd);
+  cerr << messages << std::flush;
+  return exitCode;
+}
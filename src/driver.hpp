@@ -0,0 +1,73 @@
+#pragma once
+
+#include "compile.hpp"
+#include "grammar.hpp"
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+#include <utility>
+
+// Compiling files, either directly or for clients of a compile server.
+
+/// Lex, parse and print the tree of `filename` to `output`, and return the exit code
+/// for it. Diagnostics go to diagnostics().
+int compileFile(const grammar::Grammar *grammar, const std::string &filename,
+                bool useGlr, unsigned numLexThreads, std::ostream &output);
+
+/// Lex, parse and compile `filename` into the file at `outputPath`: an executable, or
+/// FASM source for one, depending on `format`. If `peepholeStats` isn't null, the
+/// peephole optimizer's stats are added to it. Returns the exit code for it, and
+/// diagnostics go to diagnostics().
+int generateCode(const grammar::Grammar *grammar, const std::string &filename,
+                 bool useGlr, compile::OutputFormat format,
+                 const std::string &outputPath,
+                 compile::PeepholeStats *peepholeStats = nullptr);
+
+/// Like compileFile() with the LR parser, but as a pipeline: the lexer, the parser and
+/// the printing each run on a thread of their own, and each top-level declaration gets
+/// printed as soon as it's been parsed (see grammar::parseStreaming()). Memory use
+/// stays about the same however long the file is, and output starts right away.
+int compileFileStreaming(const grammar::Grammar *grammar, const std::string &filename,
+                         std::ostream &output);
+
+/// The grammar the server compiles with, reloaded whenever grammar.rule in the current
+/// directory appears or changes.
+class GrammarWatcher {
+public:
+  /// Load the grammar for the first time, from grammar.rule if there is one and the
+  /// default grammar if not. False if that fails.
+  bool load();
+
+  /// The current grammar, after reloading it if grammar.rule appeared or changed. If
+  /// the new grammar is broken, the errors go to diagnostics() and the old one stays.
+  /// While another thread is reloading it, this doesn't wait and returns the old one.
+  std::shared_ptr<const grammar::Grammar> get();
+
+private:
+  bool reloadIfChanged();
+
+  /// Guards everything below. Only held to look at them or swap in a new grammar, never
+  /// while one is being built.
+  std::mutex _mutex;
+  std::shared_ptr<const grammar::Grammar> _grammar;
+  std::pair<time_t, long> _modified{0, 0};
+  off_t _size = 0;
+  /// Whether a thread is building a new grammar, so no other one starts on it too.
+  bool _reloading = false;
+};
+
+/// Listen on the Unix socket at `socketPath` and compile whatever clients ask for,
+/// keeping the grammar loaded in between. If there's a grammar.rule in the current
+/// directory, it's reloaded whenever it changes. Only returns if something goes wrong.
+int runServer(const std::string &socketPath);
+
+/// Ask the server at `socketPath` to compile `sourcePath` into `outputPath`, print the
+/// diagnostics it sends back and return its exit code. Without a `format`, the server
+/// writes the parse tree like compileFile(); with one, it's generateCode().
+int runClient(const std::string &socketPath, const std::string &sourcePath,
+              const std::string &outputPath, bool useGlr,
+              std::optional<compile::OutputFormat> format = std::nullopt);
@@ -0,0 +1,44 @@
+#include "elf.hpp"
+
+#include <cstring>
+#include <elf.h>
+
+namespace compile {
+std::string elfExecutable(const std::vector<uint8_t> &code, uint32_t entryOffset) {
+  // The headers and the code all go in one segment, loaded from the start of the file.
+  constexpr size_t HEADERS_SIZE = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr);
+  const uint64_t fileSize = HEADERS_SIZE + code.size();
+
+  Elf64_Ehdr header = {};
+  std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+  header.e_ident[EI_CLASS] = ELFCLASS64;
+  header.e_ident[EI_DATA] = ELFDATA2LSB;
+  header.e_ident[EI_VERSION] = EV_CURRENT;
+  header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  header.e_type = ET_EXEC;
+  header.e_machine = EM_X86_64;
+  header.e_version = EV_CURRENT;
+  header.e_entry = LOAD_ADDRESS + HEADERS_SIZE + entryOffset;
+  header.e_phoff = sizeof(Elf64_Ehdr);
+  header.e_ehsize = sizeof(Elf64_Ehdr);
+  header.e_phentsize = sizeof(Elf64_Phdr);
+  header.e_phnum = 1;
+
+  Elf64_Phdr segment = {};
+  segment.p_type = PT_LOAD;
+  segment.p_flags = PF_R | PF_X;
+  segment.p_offset = 0;
+  segment.p_vaddr = LOAD_ADDRESS;
+  segment.p_paddr = LOAD_ADDRESS;
+  segment.p_filesz = fileSize;
+  segment.p_memsz = fileSize;
+  segment.p_align = 0x1000;
+
+  std::string file;
+  file.reserve(fileSize);
+  file.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.append(reinterpret_cast<const char *>(&segment), sizeof(segment));
+  file.append(code.begin(), code.end());
+  return file;
+}
+} // namespace compile
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Writing machine code out as an executable, in the format Linux runs.
+
+namespace compile {
+/// Where executables get loaded, same as with FASM's `format ELF64 executable`.
+constexpr uint64_t LOAD_ADDRESS = 0x400000;
+
+/// An ELF64 executable for x86-64 made of `code`, which starts running at
+/// `entryOffset` into it. The code is loaded (readable and executable, not
+/// writable) right after the headers, so it can't rely on being anywhere in
+/// particular, but it doesn't need to either.
+std::string elfExecutable(const std::vector<uint8_t> &code, uint32_t entryOffset);
+} // namespace compile
@@ -0,0 +1,297 @@
+#include "encode.hpp"
+
+#include "color.hpp"
+#include "utils.hpp"
+
+#include <cstdlib>
+#include <initializer_list>
+
+namespace compile {
+namespace {
+bool fitsInt8(int64_t value) { return value >= INT8_MIN && value <= INT8_MAX; }
+
+void appendInt32(vector<uint8_t> &out, int32_t value) {
+  for (int i = 0; i < 4; i++) out.push_back(uint8_t(uint32_t(value) >> (8 * i)));
+}
+
+/// Whether `operand` is one of spl, bpl, sil and dil, which without a REX prefix
+/// would be ah, ch, dh and bh instead.
+bool needsRexForByte(const Operand &operand) {
+  return operand.kind == Operand::Register && operand.size == 1 &&
+         regNumber(operand.base) >= 4 && regNumber(operand.base) < 8;
+}
+
+/// Append `opcode` followed by a ModRM byte for `rm` (a register or memory), which
+/// has `regField` in its reg field - a register, or an extension of the opcode. That
+/// includes the REX prefix if there needs to be one: for 8-byte operands (`wide`),
+/// registers past the first 8, and the low bytes of rsp, rbp, rsi and rdi.
+/// `immediateSize` bytes of `immediate` go at the end.
+void appendModRM(vector<uint8_t> &out, std::initializer_list<uint8_t> opcode,
+                 bool wide, unsigned regField, const Operand &rm,
+                 bool forceRex = false, unsigned immediateSize = 0,
+                 int32_t immediate = 0) {
+  const unsigned base = regNumber(rm.base);
+  const unsigned index = rm.hasIndex ? regNumber(rm.index) : 4;
+
+  uint8_t rex = 0x40 | (wide ? 8 : 0) | (regField >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0);
+  if (rm.kind == Operand::Memory && index >= 8) rex |= 2;
+  if (rex != 0x40 || forceRex || needsRexForByte(rm)) out.push_back(rex);
+  out.insert(out.end(), opcode);
+
+  if (rm.kind == Operand::Register) {
+    out.push_back(0xC0 | (regField & 7) << 3 | (base & 7));
+  } else {
+    // [rbp] and [r13] without a displacement mean something else, so they get a
+    // displacement of 0. [rsp] and [r12] need a SIB byte, like anything with an
+    // index does.
+    const int32_t displacement = rm.value;
+    unsigned mod = displacement == 0 && (base & 7) != 5 ? 0
+                 : fitsInt8(displacement)               ? 1
+                                                        : 2;
+    const bool hasSib = rm.hasIndex || (base & 7) == 4;
+    out.push_back(mod << 6 | (regField & 7) << 3 | (hasSib ? 4 : base & 7));
+    if (hasSib) out.push_back((index & 7) << 3 | (base & 7));
+    if (mod == 1) out.push_back(uint8_t(displacement));
+    if (mod == 2) appendInt32(out, displacement);
+  }
+
+  if (immediateSize == 1) out.push_back(uint8_t(immediate));
+  if (immediateSize == 4) appendInt32(out, immediate);
+}
+
+/// add, sub or cmp, which are all encoded the same way apart from `extension`.
+void appendArithmetic(vector<uint8_t> &out, unsigned extension, const Operand &a,
+                      const Operand &b) {
+  const bool wide = a.size == 8, isByte = a.size == 1;
+  if (b.kind == Operand::Immediate) {
+    if (isByte) {
+      appendModRM(out, {0x80}, wide, extension, a, false, 1, b.value);
+    } else if (fitsInt8(b.value)) {
+      appendModRM(out, {0x83}, wide, extension, a, false, 1, b.value);
+    } else if (a.kind == Operand::Register && regNumber(a.base) == 0) {
+      // eax and rax have a shorter encoding all to themselves.
+      if (wide) out.push_back(0x48);
+      out.push_back(extension << 3 | 5);
+      appendInt32(out, b.value);
+    } else {
+      appendModRM(out, {0x81}, wide, extension, a, false, 4, b.value);
+    }
+  } else if (b.kind == Operand::Register) {
+    appendModRM(out, {uint8_t(extension << 3 | (isByte ? 0 : 1))}, wide,
+                regNumber(b.base), a, needsRexForByte(b));
+  } else {
+    appendModRM(out, {uint8_t(extension << 3 | (isByte ? 2 : 3))}, wide,
+                regNumber(a.base), b, needsRexForByte(a));
+  }
+}
+
+/// Append the machine code for `record`, apart from jumps and calls, which are up to
+/// encode() since they depend on where everything is.
+void appendInstruction(vector<uint8_t> &out, const Record &record) {
+  const Operand &a = record.operands[0], &b = record.operands[1];
+  const bool wide = a.size == 8;
+
+  switch (record.mnemonic) {
+  case Mnemonic::mov:
+    if (b.kind == Operand::Immediate) {
+      if (a.kind == Operand::Register && a.size == 4) {
+        if (regNumber(a.base) >= 8) out.push_back(0x41);
+        out.push_back(0xB8 + (regNumber(a.base) & 7));
+        appendInt32(out, b.value);
+      } else if (a.size == 1) {
+        appendModRM(out, {0xC6}, false, 0, a, false, 1, b.value);
+      } else {
+        // Sign-extended to 64 bits if it's a 64-bit register.
+        appendModRM(out, {0xC7}, wide, 0, a, false, 4, b.value);
+      }
+    } else if (b.kind == Operand::Register) {
+      appendModRM(out, {uint8_t(a.size == 1 ? 0x88 : 0x89)}, wide, regNumber(b.base),
+                  a, needsRexForByte(b));
+    } else {
+      appendModRM(out, {uint8_t(a.size == 1 ? 0x8A : 0x8B)}, wide, regNumber(a.base),
+                  b, needsRexForByte(a));
+    }
+    return;
+
+  case Mnemonic::movzx:
+  case Mnemonic::movsx:
+    appendModRM(out, {0x0F, uint8_t(record.mnemonic == Mnemonic::movzx ? 0xB6 : 0xBE)},
+                wide, regNumber(a.base), b);
+    return;
+
+  case Mnemonic::lea: appendModRM(out, {0x8D}, wide, regNumber(a.base), b); return;
+
+  case Mnemonic::add: appendArithmetic(out, 0, a, b); return;
+  case Mnemonic::sub: appendArithmetic(out, 5, a, b); return;
+  case Mnemonic::cmp: appendArithmetic(out, 7, a, b); return;
+
+  case Mnemonic::imul:
+    if (record.numOperands == 2) {
+      appendModRM(out, {0x0F, 0xAF}, wide, regNumber(a.base), b);
+    } else {
+      const int32_t factor = record.operands[2].value;
+      if (fitsInt8(factor)) {
+        appendModRM(out, {0x6B}, wide, regNumber(a.base), b, false, 1, factor);
+      } else {
+        appendModRM(out, {0x69}, wide, regNumber(a.base), b, false, 4, factor);
+      }
+    }
+    return;
+
+  case Mnemonic::idiv:
+  case Mnemonic::neg:
+    appendModRM(out, {uint8_t(a.size == 1 ? 0xF6 : 0xF7)}, wide,
+                record.mnemonic == Mnemonic::idiv ? 7 : 3, a);
+    return;
+
+  case Mnemonic::cdq: out.push_back(0x99); return;
+
+  case Mnemonic::sete : appendModRM(out, {0x0F, 0x94}, false, 0, a); return;
+  case Mnemonic::setne: appendModRM(out, {0x0F, 0x95}, false, 0, a); return;
+  case Mnemonic::setl : appendModRM(out, {0x0F, 0x9C}, false, 0, a); return;
+  case Mnemonic::setg : appendModRM(out, {0x0F, 0x9F}, false, 0, a); return;
+  case Mnemonic::setle: appendModRM(out, {0x0F, 0x9E}, false, 0, a); return;
+  case Mnemonic::setge: appendModRM(out, {0x0F, 0x9D}, false, 0, a); return;
+
+  case Mnemonic::push:
+  case Mnemonic::pop:
+    if (regNumber(a.base) >= 8) out.push_back(0x41);
+    out.push_back((record.mnemonic == Mnemonic::push ? 0x50 : 0x58) +
+                  (regNumber(a.base) & 7));
+    return;
+
+  case Mnemonic::ret: out.push_back(0xC3); return;
+  case Mnemonic::syscall:
+    out.push_back(0x0F);
+    out.push_back(0x05);
+    return;
+
+  case Mnemonic::jmp:
+  case Mnemonic::jne:
+  case Mnemonic::call: break;
+  }
+  abort();
+}
+
+bool isJump(const Record &record) {
+  return record.kind == Record::Instruction &&
+         (record.mnemonic == Mnemonic::jmp || record.mnemonic == Mnemonic::jne);
+}
+
+/// Whether `text` is nothing but comments and empty lines.
+bool isOnlyComments(string_view text) {
+  size_t lineStart = 0;
+  while (lineStart < text.size()) {
+    size_t lineEnd = text.find('\n', lineStart);
+    if (lineEnd == string_view::npos) lineEnd = text.size();
+    string_view line = text.substr(lineStart, lineEnd - lineStart);
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first != string_view::npos && line[first] != ';') return false;
+    lineStart = lineEnd + 1;
+  }
+  return true;
+}
+} // namespace
+
+MachineCode encode(const Assembly &assembly) {
+  using std::endl;
+
+  const vector<Record> &records = assembly.records;
+
+  // Everything but jumps and calls can be encoded right away, into `fixed`, which
+  // the code is then put together from once it's clear where everything goes.
+  vector<uint8_t> fixed;
+  fixed.reserve(4 * records.size());
+  vector<uint32_t> fixedStart(records.size() + 1);
+  for (size_t i = 0; i < records.size(); i++) {
+    fixedStart[i] = fixed.size();
+    const Record &record = records[i];
+    if (record.kind == Record::Text && !isOnlyComments(assembly.textOf(record))) {
+      diagnostics() << color::boldred("ERROR")
+                    << ": Inline assembly can only be assembled by FASM, so it needs "
+                       "FASM output!"
+                    << endl;
+      fatalError(1);
+    }
+    if (record.kind != Record::Instruction) continue;
+    if (record.operands[0].kind != Operand::Label) appendInstruction(fixed, record);
+  }
+  fixedStart[records.size()] = fixed.size();
+
+  // Lay the code out with every jump as short as it could possibly be, and make the
+  // ones that don't reach that far long, until they all fit. Jumps only ever get
+  // longer, so that's bound to happen at some point.
+  vector<uint32_t> offsets(records.size() + 1);
+  vector<uint32_t> labelOffsets(assembly.numLabels(), UINT32_MAX);
+  vector<bool> isLong(records.size());
+  auto target = [&](const Record &record) {
+    return labelOffsets[record.operands[0].value];
+  };
+  bool changed = true;
+  while (changed) {
+    uint32_t offset = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+      offsets[i] = offset;
+      const Record &record = records[i];
+      if (record.kind == Record::Label) {
+        labelOffsets[record.index] = offset;
+      } else if (record.is(Mnemonic::call, 1)) {
+        offset += 5;
+      } else if (isJump(record)) {
+        offset += !isLong[i] ? 2 : record.mnemonic == Mnemonic::jmp ? 5 : 6;
+      } else {
+        offset += fixedStart[i + 1] - fixedStart[i];
+      }
+    }
+    offsets[records.size()] = offset;
+
+    changed = false;
+    for (size_t i = 0; i < records.size(); i++) {
+      const Record &record = records[i];
+      if (!isJump(record) || isLong[i] || target(record) == UINT32_MAX) continue;
+      if (!fitsInt8(int64_t(target(record)) - (offsets[i] + 2))) {
+        isLong[i] = true;
+        changed = true;
+      }
+    }
+  }
+
+  MachineCode code;
+  code.bytes.reserve(offsets[records.size()]);
+  for (size_t i = 0; i < records.size(); i++) {
+    const Record &record = records[i];
+    if (record.kind != Record::Instruction) continue;
+    if (record.operands[0].kind != Operand::Label) {
+      code.bytes.insert(code.bytes.end(), fixed.begin() + fixedStart[i],
+                        fixed.begin() + fixedStart[i + 1]);
+      continue;
+    }
+
+    if (target(record) == UINT32_MAX) {
+      diagnostics() << color::boldred("ERROR") << ": '"
+                    << assembly.labelName(record.operands[0].value)
+                    << "' isn't defined anywhere!" << endl;
+      fatalError(1);
+    }
+
+    // Relative to the end of the instruction.
+    const int64_t distance = int64_t(target(record)) - offsets[i + 1];
+    if (record.mnemonic == Mnemonic::call) {
+      code.bytes.push_back(0xE8);
+    } else if (!isLong[i]) {
+      code.bytes.push_back(record.mnemonic == Mnemonic::jmp ? 0xEB : 0x75);
+      code.bytes.push_back(uint8_t(distance));
+      continue;
+    } else if (record.mnemonic == Mnemonic::jmp) {
+      code.bytes.push_back(0xE9);
+    } else {
+      code.bytes.push_back(0x0F);
+      code.bytes.push_back(0x85);
+    }
+    appendInt32(code.bytes, int32_t(distance));
+  }
+
+  code.labelOffsets = std::move(labelOffsets);
+  return code;
+}
+} // namespace compile
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "asm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// An x86-64 assembler for the records of an Assembly (see asm.hpp), so that code
+// doesn't have to go through FASM to become machine code.
+
+namespace compile {
+using std::vector;
+
+struct MachineCode {
+  vector<uint8_t> bytes;
+  /// By label, where it ended up in `bytes`.
+  vector<uint32_t> labelOffsets;
+};
+
+/// Encode `assembly`. Jumps start out short, and only get the longer encoding if
+/// their target turns out to be too far away. Everything it refers to has to be
+/// defined somewhere in it, and text can't be anything but comments - it reports an
+/// error and gives up on the file otherwise (see fatalError()).
+MachineCode encode(const Assembly &assembly);
+} // namespace compile
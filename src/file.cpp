@@ -0,0 +1,109 @@
+#include "file.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+size_t pageSize() {
+  static const size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+size_t roundUpToPage(size_t size) {
+  return (size + pageSize() - 1) / pageSize() * pageSize();
+}
+} // namespace
+
+std::optional<FileContents> FileContents::read(const std::string &filename) {
+  const bool isStdin = filename == "-";
+  int fd = isStdin ? STDIN_FILENO : open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return std::nullopt;
+
+  FileContents contents;
+  struct stat info;
+  bool isRegular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+
+  // Empty files can't be mapped, and neither can pipes and the like.
+  bool ok = isRegular && info.st_size > 0 && contents.map(fd, info.st_size);
+  if (!ok) ok = contents.readAll(fd, isRegular ? info.st_size : 0);
+
+  if (!isStdin) close(fd);
+  if (!ok) return std::nullopt;
+  return contents;
+}
+
+bool FileContents::map(int fd, size_t size) {
+  // The rest of the file's last page reads as zeroes, but the page after it might
+  // not be mapped at all. So reserve enough address space for the padding first, then
+  // map the file over the start of it.
+  const size_t fileSize = roundUpToPage(size);
+  const size_t totalSize = roundUpToPage(size + PADDING);
+
+  void *base = mmap(nullptr, totalSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) return false;
+
+  if (mmap(base, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(base, totalSize);
+    return false;
+  }
+  madvise(base, fileSize, MADV_SEQUENTIAL);
+
+  _mapping = base;
+  _mappingSize = totalSize;
+  _text = std::string_view(static_cast<const char *>(base), size);
+  return true;
+}
+
+bool FileContents::readAll(int fd, size_t sizeHint) {
+  constexpr size_t CHUNK_SIZE = 1 << 16;
+
+  size_t size = 0;
+  _buffer.resize(std::max(sizeHint, CHUNK_SIZE) + PADDING);
+  while (true) {
+    if (_buffer.size() - size < CHUNK_SIZE + PADDING) {
+      _buffer.resize(_buffer.size() * 2);
+    }
+
+    ssize_t n = ::read(fd, _buffer.data() + size, _buffer.size() - size - PADDING);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return false;
+    if (n == 0) break;
+    size += n;
+  }
+
+  // Everything past what was read is still zero from resizing.
+  _buffer.resize(size + PADDING);
+  _text = std::string_view(_buffer.data(), size);
+  return true;
+}
+
+void FileContents::discardBefore(size_t offset) {
+  if (!_mapping) return;
+
+  // Only whole pages can go, so keep the one `offset` is on.
+  size_t size = std::min(offset, _text.size()) / pageSize() * pageSize();
+  if (size > 0) madvise(_mapping, size, MADV_DONTNEED);
+}
+
+FileContents::FileContents(FileContents &&other) noexcept { *this = std::move(other); }
+
+FileContents &FileContents::operator=(FileContents &&other) noexcept {
+  if (this == &other) return *this;
+  if (_mapping) munmap(_mapping, _mappingSize);
+
+  // Moving the buffer keeps its data where it is, so `_text` stays valid.
+  _text = std::exchange(other._text, {});
+  _mapping = std::exchange(other._mapping, nullptr);
+  _mappingSize = std::exchange(other._mappingSize, 0);
+  _buffer = std::move(other._buffer);
+  return *this;
+}
+
+FileContents::~FileContents() {
+  if (_mapping) munmap(_mapping, _mappingSize);
+}
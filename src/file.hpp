@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// The contents of a file, read-only. Regular files are mapped into memory, so
+/// nothing gets copied and the pages are shared with the page cache. Anything that
+/// can't be mapped, like a pipe or stdin, is read into a buffer instead.
+class FileContents {
+public:
+  /// At least this many zero bytes follow text(), so scanning code can read a bit
+  /// past the end (or stop at a '\0') without checking every byte.
+  static constexpr size_t PADDING = 64;
+
+  /// Read `filename`, or stdin if it's "-". Empty if it couldn't be opened or read.
+  static std::optional<FileContents> read(const std::string &filename);
+
+  FileContents(const FileContents &) = delete;
+  FileContents(FileContents &&other) noexcept;
+  FileContents &operator=(FileContents &&other) noexcept;
+  ~FileContents();
+
+  inline std::string_view text() const { return _text; }
+
+  /// Whether the contents are mapped rather than in a buffer of their own.
+  inline bool isMapped() const { return _mapping != nullptr; }
+
+  /// Let the OS take the pages of the text before `offset` out of memory, for when
+  /// nothing is going to look at them for a while. They get read back from the file if
+  /// anything does. Only mapped files have pages to drop like that.
+  void discardBefore(size_t offset);
+
+private:
+  FileContents() = default;
+
+  bool map(int fd, size_t size);
+  bool readAll(int fd, size_t sizeHint);
+
+  std::string_view _text;
+
+  void *_mapping = nullptr;
+  size_t _mappingSize = 0;
+
+  std::vector<char> _buffer;
+};
@@ -0,0 +1,275 @@
+#include "ir.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <set>
+
+// Sparse conditional constant propagation, from "Constant Propagation with Conditional
+// Branches" by Wegman and Zadeck: every value starts out as possibly anything
+// (unknown), and blocks as unreachable. Evaluating the instructions of the blocks that
+// are found to be reachable then makes values constant, or not constant after all
+// (overdefined) - only ever in that order, which is what makes it finish. A branch on
+// a constant only makes the side it takes reachable, so whatever is only defined on
+// the other side doesn't get in the way.
+
+namespace ir {
+using std::optional;
+
+namespace {
+struct Lattice {
+  enum Kind : uint8_t { Unknown, Constant, Overdefined } kind = Unknown;
+  int32_t value = 0;
+
+  bool operator==(const Lattice &other) const {
+    return kind == other.kind && (kind != Constant || value == other.value);
+  }
+  bool operator!=(const Lattice &other) const { return !(*this == other); }
+};
+
+constexpr Lattice OVERDEFINED{Lattice::Overdefined};
+
+Lattice constant(int32_t value) { return {Lattice::Constant, value}; }
+
+/// The most that's known about something that's either `a` or `b`.
+Lattice meet(Lattice a, Lattice b) {
+  if (a.kind == Lattice::Unknown) return b;
+  if (b.kind == Lattice::Unknown) return a;
+  return a == b ? a : OVERDEFINED;
+}
+
+/// `op` applied to constants, if it's something that can be done at compile time.
+/// Arithmetic wraps around, which is what the generated code does too.
+optional<int32_t> evaluate(Opcode op, int32_t a, int32_t b) {
+  auto wrap = [](uint32_t value) { return int32_t(value); };
+  switch (op) {
+  case Opcode::Add: return wrap(uint32_t(a) + uint32_t(b));
+  case Opcode::Sub: return wrap(uint32_t(a) - uint32_t(b));
+  case Opcode::Mul: return wrap(uint32_t(a) * uint32_t(b));
+  case Opcode::Div:
+  case Opcode::Mod:
+    // Leave what traps to run time.
+    if (b == 0 || (a == std::numeric_limits<int32_t>::min() && b == -1)) return {};
+    return op == Opcode::Div ? a / b : a % b;
+  case Opcode::Equal             : return a == b;
+  case Opcode::NotEqual          : return a != b;
+  case Opcode::LessThan          : return a < b;
+  case Opcode::GreaterThan       : return a > b;
+  case Opcode::LessThanOrEqual   : return a <= b;
+  case Opcode::GreaterThanOrEqual: return a >= b;
+  case Opcode::Negate            : return wrap(-uint32_t(a));
+  case Opcode::Not               : return a == 0;
+  case Opcode::Trunc             : return int8_t(a);
+  case Opcode::SExt              : return a;
+  default                        : return {};
+  }
+}
+
+class Propagation {
+public:
+  explicit Propagation(Function &function)
+      : function(function), lattice(function.values.size()),
+        isReachable(function.blocks.size()), users(function.values.size()) {
+    for (const Block &block : function.blocks) {
+      for (ValueId id : block.instructions) {
+        for (ValueId operand : function[id].operands) users[operand].push_back(id);
+      }
+    }
+  }
+
+  void run() {
+    edgeWorklist.push_back({NONE, 0});
+    while (!edgeWorklist.empty() || !valueWorklist.empty()) {
+      while (!edgeWorklist.empty()) {
+        auto [from, to] = edgeWorklist.back();
+        edgeWorklist.pop_back();
+        if (!reachableEdges.insert({from, to}).second) continue;
+
+        // The phis have another operand to look at now. The rest of the block only
+        // needs looking at the first time it's reached.
+        const bool isNew = !isReachable[to];
+        isReachable[to] = true;
+        for (ValueId id : function.blocks[to].instructions) {
+          if (isNew || function[id].op == Opcode::Phi) visit(id);
+        }
+      }
+
+      while (!valueWorklist.empty()) {
+        ValueId id = valueWorklist.back();
+        valueWorklist.pop_back();
+        if (isReachable[function[id].block]) visit(id);
+      }
+    }
+
+    rewrite();
+  }
+
+private:
+  void visit(ValueId id) {
+    const Instruction &instruction = function[id];
+    auto operand = [&](size_t k) { return lattice[instruction.operands[k]]; };
+
+    switch (instruction.op) {
+    case Opcode::Const: update(id, constant(instruction.imm)); return;
+
+    case Opcode::Phi: {
+      // Only what comes from the predecessors that can get here counts.
+      Lattice result;
+      for (size_t k = 0; k < instruction.operands.size(); k++) {
+        if (reachableEdges.count({instruction.targets[k], instruction.block})) {
+          result = meet(result, operand(k));
+        }
+      }
+      update(id, result);
+      return;
+    }
+
+    case Opcode::Jump:
+      edgeWorklist.push_back({instruction.block, instruction.targets[0]});
+      return;
+
+    case Opcode::Branch: {
+      // Until the condition is known, neither side is reachable from here.
+      Lattice condition = operand(0);
+      if (condition.kind == Lattice::Constant) {
+        BlockId taken = instruction.targets[condition.value != 0 ? 0 : 1];
+        edgeWorklist.push_back({instruction.block, taken});
+      } else if (condition.kind == Lattice::Overdefined) {
+        for (BlockId target : instruction.targets) {
+          edgeWorklist.push_back({instruction.block, target});
+        }
+      }
+      return;
+    }
+
+    case Opcode::Return:
+    case Opcode::InlineAsm: return;
+
+    default: break;
+    }
+
+    // Undef could be anything, and so could whatever comes from outside.
+    if (instruction.operands.empty()) {
+      update(id, OVERDEFINED);
+      return;
+    }
+
+    Lattice result = constant(0);
+    for (size_t k = 0; k < instruction.operands.size(); k++) {
+      if (operand(k).kind == Lattice::Overdefined) {
+        update(id, OVERDEFINED);
+        return;
+      }
+      if (operand(k).kind == Lattice::Unknown) result = Lattice{};
+    }
+    if (result.kind == Lattice::Unknown) return;
+
+    int32_t b = instruction.operands.size() > 1 ? operand(1).value : 0;
+    optional<int32_t> value = evaluate(instruction.op, operand(0).value, b);
+    update(id, value.has_value() ? constant(*value) : OVERDEFINED);
+  }
+
+  void update(ValueId id, Lattice value) {
+    // Going back to being less sure would mean this never ends.
+    if (lattice[id].kind == Lattice::Constant && value != lattice[id]) {
+      value = OVERDEFINED;
+    }
+    if (value == lattice[id]) return;
+
+    lattice[id] = value;
+    valueWorklist.insert(valueWorklist.end(), users[id].begin(), users[id].end());
+  }
+
+  /// Turn whatever turned out to be constant into constants, and take out the edges
+  /// that are never taken.
+  void rewrite() {
+    for (BlockId b = 0; b < function.blocks.size(); b++) {
+      if (!isReachable[b]) {
+        // Nothing's going to get here, so it doesn't need anything either.
+        for (ValueId id : function.blocks[b].instructions) function[id].block = NONE;
+        function.blocks[b].instructions.clear();
+        continue;
+      }
+
+      for (ValueId id : function.blocks[b].instructions) {
+        Instruction &instruction = function[id];
+        if (instruction.op == Opcode::Branch &&
+            lattice[instruction.operands[0]].kind == Lattice::Constant) {
+          BlockId taken =
+              instruction.targets[lattice[instruction.operands[0]].value != 0 ? 0 : 1];
+          instruction = Instruction{.op = Opcode::Jump, .block = b, .targets = {taken}};
+        } else if (instruction.op == Opcode::Phi) {
+          // Drop what comes from the predecessors that can't get here.
+          size_t kept = 0;
+          for (size_t k = 0; k < instruction.operands.size(); k++) {
+            if (reachableEdges.count({instruction.targets[k], b})) {
+              instruction.operands[kept] = instruction.operands[k];
+              instruction.targets[kept] = instruction.targets[k];
+              kept++;
+            }
+          }
+          instruction.operands.resize(kept);
+          instruction.targets.resize(kept);
+        }
+
+        if (lattice[id].kind == Lattice::Constant && instruction.op != Opcode::Const) {
+          instruction = Instruction{.op = Opcode::Const,
+                                    .type = instruction.type,
+                                    .block = b,
+                                    .imm = lattice[id].value};
+        }
+      }
+
+      // Phis that became constants don't have to be at the start anymore, but the
+      // ones that didn't still do.
+      auto &instructions = function.blocks[b].instructions;
+      std::stable_partition(instructions.begin(), instructions.end(),
+                            [&](ValueId id) { return function[id].op == Opcode::Phi; });
+    }
+
+    // A phi with one operand left is just that operand.
+    vector<ValueId> replacement(function.values.size(), NONE);
+    auto resolve = [&](ValueId id) {
+      while (replacement[id] != NONE) id = replacement[id];
+      return id;
+    };
+    for (ValueId id = 0; id < function.values.size(); id++) {
+      const Instruction &phi = function[id];
+      if (phi.op == Opcode::Phi && phi.block != NONE && phi.operands.size() == 1) {
+        replacement[id] = phi.operands[0];
+      }
+    }
+    for (Instruction &instruction : function.values) {
+      for (ValueId &operand : instruction.operands) operand = resolve(operand);
+    }
+    for (Block &block : function.blocks) {
+      auto &instructions = block.instructions;
+      instructions.erase(std::remove_if(instructions.begin(), instructions.end(),
+                                        [&](ValueId id) {
+                                          if (replacement[id] == NONE) return false;
+                                          function[id].block = NONE;
+                                          return true;
+                                        }),
+                         instructions.end());
+    }
+
+    computeCfg(function);
+  }
+
+  Function &function;
+  vector<Lattice> lattice;
+  vector<bool> isReachable;
+  /// By value, the instructions that use it.
+  vector<vector<ValueId>> users;
+  /// The edges between blocks that can be taken, the entry block being reached from
+  /// NONE.
+  std::set<std::pair<BlockId, BlockId>> reachableEdges;
+
+  vector<std::pair<BlockId, BlockId>> edgeWorklist;
+  vector<ValueId> valueWorklist;
+};
+} // namespace
+
+void propagateConstants(Function &function) { Propagation(function).run(); }
+} // namespace ir
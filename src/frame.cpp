@@ -0,0 +1,51 @@
+#include "frame.hpp"
+
+#include <algorithm>
+
+namespace compile {
+namespace {
+/// How much the System V ABI promises that signal handlers leave alone below rsp.
+constexpr int32_t RED_ZONE_SIZE = 128;
+
+int32_t alignUp(int32_t value, int32_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+} // namespace
+
+void layOutFrame(Context &context, const std::vector<ir::ValueId> &spilled,
+                 bool makesCalls, bool hasInlineAsm) {
+  Frame &frame = context.frame;
+  frame.hasFramePointer = hasInlineAsm;
+  frame.base = hasInlineAsm ? reg::rbp : reg::rsp;
+
+  std::vector<ir::ValueId> slots = spilled;
+  std::stable_sort(slots.begin(), slots.end(), [&](ir::ValueId a, ir::ValueId b) {
+    return context.values[a].size > context.values[b].size;
+  });
+  int32_t slotsSize = 0;
+  for (ir::ValueId id : slots) {
+    context.values[id].slot = slotsSize;
+    slotsSize += context.values[id].size;
+  }
+  // rsp stays 8-byte aligned, as it is after pushing anything.
+  slotsSize = alignUp(slotsSize, 8);
+
+  // Whatever's on the stack already: the return address, and what gets pushed.
+  const int32_t pushed =
+      8 * (1 + frame.hasFramePointer + int32_t(context.savedRegs.size()));
+
+  // Where the slots start, relative to the base.
+  int32_t start;
+  if (!makesCalls && !hasInlineAsm && slotsSize <= RED_ZONE_SIZE) {
+    frame.size = 0;
+    start = -slotsSize;
+  } else {
+    frame.size = makesCalls || hasInlineAsm ? alignUp(pushed + slotsSize, 16) - pushed
+                                            : slotsSize;
+    start = frame.hasFramePointer
+                ? -(8 * int32_t(context.savedRegs.size()) + frame.size)
+                : 0;
+  }
+  for (ir::ValueId id : slots) context.values[id].slot += start;
+}
+} // namespace compile
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "compile.hpp"
+#include "ir.hpp"
+
+#include <vector>
+
+// Stack frame layout, once the register allocator (see regalloc.hpp) has decided what
+// doesn't fit in registers.
+
+namespace compile {
+/// Give each of the `spilled` values of `context` a stack slot, and work out the rest
+/// of `context.frame` around them and `context.savedRegs`. The slots are sorted by
+/// size, biggest first, so each is aligned to its size without any padding in between.
+/// If the function `makesCalls`, rsp is kept 16-byte aligned for them (System V ABI).
+/// If it doesn't, and its slots fit into the red zone below rsp, it doesn't move rsp at
+/// all. Only `hasInlineAsm` gets a frame pointer, since that might push and pop
+/// whatever it likes.
+void layOutFrame(Context &context, const std::vector<ir::ValueId> &spilled,
+                 bool makesCalls, bool hasInlineAsm);
+} // namespace compile
@@ -0,0 +1,423 @@
+#include "grammar.hpp"
+
+#include "lex.hpp"
+#include "table.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <utility>
+#include <vector>
+
+// A right-nulled GLR (RNGLR) parser, after Scott & Johnstone's "Right Nulled GLR
+// Parsers". Instead of resolving the conflicts in the parse table, it follows every
+// alternative at once on a graph-structured stack (GSS), and records every way of
+// deriving the input in a shared packed parse forest (SPPF). Right-nulled reductions
+// let it reduce a production before the nullable symbols at its end have been seen,
+// which is what keeps it correct for grammars with ε-rules.
+
+namespace grammar {
+namespace {
+constexpr uint32_t NONE = UINT32_MAX;
+
+/// A node of the shared packed parse forest: a symbol derived from some stretch of
+/// the input, in every way it can be.
+struct ForestNode {
+  int32_t symbol;
+
+  /// The tokens [start, end) the node covers. Nodes deriving ε are shared between
+  /// every place they're used, so they have no position - both are NONE.
+  uint32_t start, end;
+
+  /// The token this node was shifted from, for terminals.
+  uint32_t token = NONE;
+
+  /// Every sequence of children the node can be derived from. More than one means the
+  /// input is ambiguous there.
+  vector<vector<uint32_t>> families;
+};
+
+struct GssEdge {
+  uint32_t target;
+  /// The forest node for what's been derived between the two GSS nodes.
+  uint32_t label;
+};
+
+struct GssNode {
+  uint32_t state;
+  uint32_t level;
+  vector<GssEdge> edges;
+};
+
+/// A reduction by `production` of `length` symbols, the last of which is `label`,
+/// found on the edge leading into `node`. For length 0 reductions `label` is unused.
+struct PendingReduction {
+  uint32_t node;
+  uint32_t production;
+  uint32_t length;
+  uint32_t label;
+};
+
+struct PendingShift {
+  uint32_t node;
+  uint32_t state;
+};
+
+class GlrParser {
+public:
+  GlrParser(const ParseTable &table, lex::Lexer &lexer)
+      : table(table), lexer(lexer), epsilonNodes(table.symbols.size(), NONE) {}
+
+  Tree parse(const Grammar *grammar) {
+    levels.push_back({newGssNode(0, 0)});
+    queueActions(0, 0, NONE, lookahead(0).symbol, true);
+
+    // The accepting state is the one reached from the start state on `program`.
+    const int32_t programSymbol = table.rhsSymbols[table.productions[0].firstSymbol];
+    const uint32_t acceptState = shiftTarget(table.action(0, programSymbol));
+
+    for (uint32_t i = 0;; i++) {
+      levelForestNodes.clear();
+      while (!reductions.empty()) {
+        PendingReduction reduction = reductions.back();
+        reductions.pop_back();
+        reduce(i, reduction);
+      }
+
+      // The grammar can shift Eof itself (the lexer keeps returning it), so the end
+      // of the input doesn't end the parse - only accepting does.
+      if (lookahead(i).type == lex::Eof) {
+        for (uint32_t node : levels[i]) {
+          if (gss[node].state != acceptState) continue;
+
+          for (const auto &edge : gss[node].edges) {
+            if (edge.target != 0) continue;
+
+            Tree tree;
+            tree.grammar = grammar;
+            tree.root = buildTree(tree, edge.label);
+            return tree;
+          }
+        }
+      }
+
+      shift(i);
+      if (levels[i + 1].empty()) reportError(i);
+    }
+  }
+
+private:
+  /// The token at level `i`. The whole file is lexed up front, so this is O(1).
+  inline lex::Token lookahead(size_t i) { return lexer.peek(i); }
+
+  /// Everything the GLR table says to do in `state` with `symbol` as the lookahead.
+  std::pair<const GlrAction *, const GlrAction *> actionsFor(uint32_t state,
+                                                            int32_t symbol) {
+    if (symbol < 0) return {nullptr, nullptr};
+
+    size_t cell = state * table.symbols.size() + symbol;
+    return {table.glrActions.begin() + table.glrCells[cell],
+            table.glrActions.begin() + table.glrCells[cell + 1]};
+  }
+
+  uint32_t newGssNode(uint32_t state, uint32_t level) {
+    gss.push_back(GssNode{.state = state, .level = level, .edges = {}});
+    return gss.size() - 1;
+  }
+
+  uint32_t findGssNode(uint32_t level, uint32_t state) const {
+    for (uint32_t node : levels[level]) {
+      if (gss[node].state == state) return node;
+    }
+    return NONE;
+  }
+
+  bool hasEdge(uint32_t from, uint32_t to) const {
+    return std::any_of(gss[from].edges.begin(), gss[from].edges.end(),
+                       [&](const GssEdge &edge) { return edge.target == to; });
+  }
+
+  /// Queue up what to do with the new GSS node `node` (in `state`), which has just
+  /// got an edge labelled `label` to `target`. For a node that's just been created,
+  /// `isNew` also queues its shifts and length 0 reductions - those don't depend on
+  /// its edges, so they only need doing once.
+  void queueActions(uint32_t node, uint32_t target, uint32_t label, int32_t symbol,
+                    bool isNew) {
+    auto [begin, end] = actionsFor(gss[node].state, symbol);
+
+    for (auto it = begin; it != end; it++) {
+      if (isShift(it->action)) {
+        if (isNew) shifts.push_back({node, uint32_t(shiftTarget(it->action))});
+        continue;
+      }
+
+      const uint32_t production = reduceProduction(it->action);
+      if (production == 0) continue; // Accepting is checked for separately.
+
+      if (it->length == 0) {
+        if (isNew) reductions.push_back({node, production, 0, NONE});
+      } else if (label != NONE) {
+        reductions.push_back({target, production, it->length, label});
+      }
+    }
+  }
+
+  /// The forest node for `symbol` deriving ε.
+  uint32_t epsilonNode(int32_t symbol) {
+    if (epsilonNodes[symbol] != NONE) return epsilonNodes[symbol];
+
+    // epsilonProductions only ever refers to symbols that derive ε in fewer steps, so
+    // this always terminates.
+    const auto &production = table.productions[table.epsilonProductions[symbol]];
+    vector<uint32_t> children;
+    for (uint32_t i = 0; i < production.numPop; i++) {
+      children.push_back(epsilonNode(table.rhsSymbols[production.firstSymbol + i]));
+    }
+
+    forest.push_back(ForestNode{
+        .symbol = symbol,
+        .start = NONE,
+        .end = NONE,
+        .token = NONE,
+        .families = {std::move(children)},
+    });
+    return epsilonNodes[symbol] = forest.size() - 1;
+  }
+
+  void reduce(uint32_t level, const PendingReduction &reduction) {
+    const auto &production = table.productions[reduction.production];
+    const int32_t lookaheadSymbol = lookahead(level).symbol;
+
+    // Find every path of `length - 1` more edges back from the node, along with the
+    // forest nodes on the way, right to left.
+    vector<std::pair<uint32_t, vector<uint32_t>>> paths;
+    if (reduction.length == 0) {
+      paths.push_back({reduction.node, {}});
+    } else {
+      vector<std::pair<uint32_t, vector<uint32_t>>> stack{
+          {reduction.node, {reduction.label}}};
+
+      while (!stack.empty()) {
+        auto [node, labels] = std::move(stack.back());
+        stack.pop_back();
+
+        if (labels.size() == reduction.length) {
+          paths.push_back({node, std::move(labels)});
+          continue;
+        }
+
+        for (const auto &edge : gss[node].edges) {
+          auto next = labels;
+          next.push_back(edge.label);
+          stack.push_back({edge.target, std::move(next)});
+        }
+      }
+    }
+
+    for (auto &[start, labels] : paths) {
+      uint32_t label;
+
+      if (reduction.length == 0) {
+        label = epsilonNode(production.lhs);
+      } else {
+        label = forestNodeFor(production.lhs, gss[start].level, level);
+
+        // The labels were collected right to left, and any symbols the reduction
+        // didn't pop derive ε.
+        std::reverse(labels.begin(), labels.end());
+        for (uint32_t i = reduction.length; i < production.numPop; i++) {
+          labels.push_back(
+              epsilonNode(table.rhsSymbols[production.firstSymbol + i]));
+        }
+        addFamily(label, std::move(labels));
+      }
+
+      const uint32_t state =
+          shiftTarget(table.action(gss[start].state, production.lhs));
+      uint32_t node = findGssNode(level, state);
+
+      if (node == NONE) {
+        node = newGssNode(state, level);
+        levels[level].push_back(node);
+        gss[node].edges.push_back({start, label});
+        queueActions(node, start, reduction.length == 0 ? NONE : label,
+                     lookaheadSymbol, true);
+      } else if (!hasEdge(node, start)) {
+        gss[node].edges.push_back({start, label});
+        // Length 0 reductions through an ε edge are already covered by right-nulled
+        // reductions further down, so only longer ones are queued.
+        if (reduction.length != 0) {
+          queueActions(node, start, label, lookaheadSymbol, false);
+        }
+      }
+    }
+  }
+
+  /// The forest node for `symbol` covering tokens [start, end), which must be the
+  /// level currently being reduced.
+  uint32_t forestNodeFor(int32_t symbol, uint32_t start, uint32_t end) {
+    auto [it, inserted] = levelForestNodes.emplace(std::pair(symbol, start), 0);
+    if (inserted) {
+      forest.push_back(ForestNode{
+          .symbol = symbol,
+          .start = start,
+          .end = end,
+          .token = NONE,
+          .families = {},
+      });
+      it->second = forest.size() - 1;
+    }
+    return it->second;
+  }
+
+  void addFamily(uint32_t node, vector<uint32_t> children) {
+    auto &families = forest[node].families;
+    if (std::find(families.begin(), families.end(), children) == families.end()) {
+      families.push_back(std::move(children));
+    }
+  }
+
+  void shift(uint32_t level) {
+    levels.push_back({});
+
+    forest.push_back(ForestNode{
+        .symbol = lookahead(level).symbol,
+        .start = level,
+        .end = level + 1,
+        .token = level,
+        .families = {},
+    });
+    const uint32_t label = forest.size() - 1;
+    const int32_t nextSymbol = lookahead(level + 1).symbol;
+
+    vector<PendingShift> current;
+    std::swap(current, shifts);
+
+    for (const auto &[from, state] : current) {
+      uint32_t node = findGssNode(level + 1, state);
+      const bool isNew = node == NONE;
+
+      if (isNew) {
+        node = newGssNode(state, level + 1);
+        levels[level + 1].push_back(node);
+      }
+
+      gss[node].edges.push_back({from, label});
+      queueActions(node, from, label, nextSymbol, isNew);
+    }
+  }
+
+  [[noreturn]] void reportError(uint32_t level) {
+    const lex::Token token = lookahead(level);
+
+    vector<Rule::Target> targets;
+    for (size_t symbol = 0; symbol < table.symbols.size(); symbol++) {
+      if (table.symbols[symbol].isNonTerminal()) continue;
+
+      for (uint32_t node : levels[level]) {
+        auto [begin, end] = actionsFor(gss[node].state, symbol);
+        if (begin != end) {
+          targets.push_back(table.symbols[symbol]);
+          break;
+        }
+      }
+    }
+
+    reportWithContext(ERROR, token.location(), "Unexpected {} - expected {}!", token,
+                      targets);
+    fatalError(4);
+  }
+
+  /// Where each of `family`'s children starts. Nodes deriving ε start (and end) where
+  /// the child before them ends.
+  vector<uint32_t> childStarts(uint32_t start, const vector<uint32_t> &family) const {
+    vector<uint32_t> starts;
+    for (uint32_t child : family) {
+      starts.push_back(start);
+      if (forest[child].end != NONE) start = forest[child].end;
+    }
+    return starts;
+  }
+
+  /// Pick which of an ambiguous node's families to build the tree from. To agree with
+  /// the LR parser, which shifts wherever precedence doesn't decide, prefer the family
+  /// whose last children start earliest - i.e. the one that reduced latest.
+  const vector<uint32_t> &chooseFamily(const ForestNode &node) const {
+    const vector<uint32_t> *best = &node.families[0];
+
+    for (size_t i = 1; i < node.families.size(); i++) {
+      auto a = childStarts(node.start, node.families[i]);
+      auto b = childStarts(node.start, *best);
+      if (std::lexicographical_compare(a.rbegin(), a.rend(), b.rbegin(), b.rend())) {
+        best = &node.families[i];
+      }
+    }
+
+    return *best;
+  }
+
+  /// Turn the forest below `root` into a tree, resolving any ambiguities with
+  /// chooseFamily(). Iterative, since long lists make for very deep forests.
+  NodeId buildTree(Tree &tree, uint32_t root) {
+    struct Frame {
+      uint32_t node;
+      const vector<uint32_t> *family;
+      vector<PendingNode> children;
+    };
+
+    auto enter = [&](uint32_t id) -> Frame {
+      const auto &node = forest[id];
+      return {id, node.families.empty() ? nullptr : &chooseFamily(node), {}};
+    };
+
+    vector<Frame> stack{enter(root)};
+
+    while (true) {
+      Frame &frame = stack.back();
+      const size_t numChildren = frame.family ? frame.family->size() : 0;
+
+      if (frame.children.size() < numChildren) {
+        stack.push_back(enter((*frame.family)[frame.children.size()]));
+        continue;
+      }
+
+      const auto &node = forest[frame.node];
+      PendingNode built;
+      if (node.token != NONE) {
+        built = shiftNode(tree, lookahead(node.token));
+      } else {
+        built = reduceNodes(tree, table, node.symbol, frame.children.data(),
+                            frame.children.size());
+      }
+
+      stack.pop_back();
+      if (stack.empty()) return built.node;
+      stack.back().children.push_back(built);
+    }
+  }
+
+  const ParseTable &table;
+  lex::Lexer &lexer;
+
+  vector<GssNode> gss;
+  /// The GSS nodes created at each position of the input.
+  vector<vector<uint32_t>> levels;
+
+  vector<ForestNode> forest;
+  vector<uint32_t> epsilonNodes;
+  /// The forest nodes ending at the level being reduced, by (symbol, start).
+  std::map<std::pair<int32_t, uint32_t>, uint32_t> levelForestNodes;
+
+  vector<PendingReduction> reductions;
+  vector<PendingShift> shifts;
+};
+} // namespace
+
+Tree parseGLR(const Grammar *grammar, lex::Lexer &lexer, unsigned numLexThreads) {
+  lexer.setTerminals(&grammar->table.terminals);
+  lexer.lexAll(numLexThreads);
+  return GlrParser(grammar->table, lexer).parse(grammar);
+}
+} // namespace grammar
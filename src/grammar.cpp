@@ -1,453 +1,1274 @@
 #include "grammar.hpp"
 
+#include "bounded_queue.hpp"
 #include "color.hpp"
+#include "file.hpp"
 #include "lex.hpp"
+#include "table.hpp"
 #include "utils.hpp"
 
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <memory>
 #include <optional>
 #include <ostream>
 #include <set>
+#include <sstream>
 #include <stack>
 #include <string_view>
+#include <thread>
 #include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 using std::string, std::vector, std::set, std::map, std::optional;
 
 namespace grammar {
 
-struct DottedRule;
-
 template<typename T>
 std::ostream &operator<<(std::ostream &os, const set<T> &set);
-template<typename T>
-std::ostream &operator<<(std::ostream &os, const vector<T> &vector);
 template<typename K, typename V>
 std::ostream &operator<<(std::ostream &os, const map<K, V> &map);
 
-enum TerminalToken {
-  TT_Invalid,
-  TT_Empty,
-  TT_Identifier,
-  TT_IntegerLiteral,
-  TT_FloatLiteral,
-  TT_DoubleLiteral,
-  TT_CharLiteral,
-  TT_StringLiteral,
-  TT_Eof,
-};
+bool operator<(const Rule::Target &lhs, const Rule::Target &rhs) {
+  if (lhs.type != rhs.type) {
+    return lhs.type < rhs.type;
+  }
 
-enum RuleTargetType { RT_TerminalToken, RT_String, RT_Rule };
+  switch (lhs.type) {
+  case RT_TerminalToken: return lhs.token < rhs.token;
+  case RT_String       :
+  case RT_Rule         : return lhs.str < rhs.str;
+  }
 
-struct Rule {
-  struct Target {
-  private:
-    Target() {}
+  assert(false);
+}
 
-  public:
-    Target(TerminalToken token) : type(RT_TerminalToken), token(token) {}
-    Target(string string) : type(RT_String), str(string) {}
-    Target(const Rule &rule) : type(RT_Rule), str(rule.name) {}
+/// The type of token a terminal token target matches, if any.
+static optional<lex::TokenType> tokenTypeOf(TerminalToken token) {
+  switch (token) {
+  case TT_IntegerLiteral:
+  case TT_FloatLiteral:
+  case TT_DoubleLiteral : return lex::NumberLiteral;
 
-    inline bool isTerminal() const { return !isNonTerminal(); }
-    inline bool isNonTerminal() const { return type == RT_Rule; }
+  case TT_Identifier   : return lex::Identifier;
+  case TT_CharLiteral  : return lex::CharLiteral;
+  case TT_StringLiteral: return lex::StringLiteral;
+  case TT_Eof          : return lex::Eof;
 
-    bool matches(const Node &node) const { return type == RT_Rule && str == node.name; }
-    bool matches(const lex::Token &token) const {
-      switch (type) {
-        // Tokens can't match entire rules.
-      case RT_Rule: return false;
+  default: return {};
+  }
+}
 
-      case RT_TerminalToken:
-        switch (this->token) {
-        case TT_IntegerLiteral:
-        case TT_FloatLiteral:
-        case TT_DoubleLiteral : return token.type == lex::NumberLiteral;
+/// A single `ruleName -> alternative` pair. LR items refer to productions by index.
+struct Production {
+  string ruleName;
+  const Rule::AlternativeT *alternative;
+  /// How tightly the production binds, if its `%prec` or last operator says.
+  const Precedence *precedence;
+};
 
-        case TT_Identifier   : return token.type == lex::Identifier;
-        case TT_CharLiteral  : return token.type == lex::CharLiteral;
-        case TT_StringLiteral: return token.type == lex::StringLiteral;
-        case TT_Eof          : return token.type == lex::Eof;
+/// An LR(0) item - a production with a dot somewhere in its alternative.
+struct Item {
+  uint32_t production;
+  uint32_t dot;
 
-        default: return false;
-        }
+  inline bool operator==(const Item &other) const {
+    return production == other.production && dot == other.dot;
+  }
+  inline bool operator<(const Item &other) const {
+    return production < other.production ||
+           (production == other.production && dot < other.dot);
+  }
+};
 
-      case RT_String: return token.span == str;
-      }
-      return false;
+/// Hash for the sorted kernel of an item set.
+struct KernelHash {
+  size_t operator()(const vector<Item> &kernel) const {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const auto &item : kernel) {
+      hash = (hash ^ item.production) * 0x100000001b3ull;
+      hash = (hash ^ item.dot) * 0x100000001b3ull;
     }
+    return hash;
+  }
+};
+
+void ParseTable::indexTerminals() {
+  terminals = lex::TerminalIds();
 
-    static Target RuleByName(string ruleName) {
-      Target t;
-      t.type = RT_Rule;
-      t.str = ruleName;
-      return t;
+  for (size_t i = 0; i < symbols.size(); i++) {
+    const auto &symbol = symbols[i];
+
+    if (symbol.type == RT_String) {
+      terminals.bySpelling[symbol.str] = i;
+    } else if (symbol.type == RT_TerminalToken) {
+      // NOTE: IntegerLiteral, FloatLiteral and DoubleLiteral all match a
+      //       NumberLiteral, so whichever of them comes first wins.
+      auto tokenType = tokenTypeOf(symbol.token);
+      if (tokenType.has_value() && terminals.byType[*tokenType] < 0) {
+        terminals.byType[*tokenType] = i;
+      }
     }
+  }
+}
 
-    inline bool operator==(const Target &other) const {
-      if (type != other.type) return false;
+/// A set of symbol IDs, stored as a bitset.
+struct SymbolSet {
+  SymbolSet(size_t numSymbols = 0) : words((numSymbols + 63) / 64) {}
 
-      switch (type) {
-      case RT_TerminalToken:
-        if (token == TT_Identifier && other.token == TT_Identifier) {
-          return str == other.str;
-        } else {
-          return token == other.token;
-        }
+  inline bool contains(size_t symbol) const {
+    return words[symbol / 64] & (uint64_t(1) << (symbol % 64));
+  }
 
-      case RT_Rule:
-      case RT_String: return str == other.str;
-      }
-      return false;
+  /// Returns true if `symbol` wasn't in the set yet.
+  inline bool insert(size_t symbol) {
+    uint64_t bit = uint64_t(1) << (symbol % 64);
+    bool isNew = !(words[symbol / 64] & bit);
+    words[symbol / 64] |= bit;
+    return isNew;
+  }
+
+  /// Add all symbols from `other`. Returns true if anything new was added.
+  inline bool merge(const SymbolSet &other) {
+    bool changed = false;
+    for (size_t i = 0; i < words.size(); i++) {
+      changed |= (other.words[i] & ~words[i]) != 0;
+      words[i] |= other.words[i];
     }
+    return changed;
+  }
 
-    RuleTargetType type;
-    string str;
-    TerminalToken token = TT_Invalid;
-  };
+  inline bool operator==(const SymbolSet &other) const { return words == other.words; }
 
-  using AlternativeT = vector<Target>;
+  vector<uint64_t> words;
+};
 
-  string name;
-  vector<vector<Target>> alternatives;
+/// The nullable, FIRST and FOLLOW sets of every symbol in a grammar.
+struct SymbolSets {
+  vector<bool> nullable;
+  vector<SymbolSet> first;
+  vector<SymbolSet> follow;
 };
 
-std::ostream &operator<<(std::ostream &os, const Rule::Target &target);
-std::ostream &operator<<(std::ostream &os, const DottedRule &rule);
-std::ostream &operator<<(std::ostream &os, TerminalToken token);
+static SymbolSets computeSymbolSets(const vector<Rule::Target> &symbols,
+                                    const vector<TableProduction> &productions,
+                                    const vector<vector<uint32_t>> &productionSymbols,
+                                    uint32_t eofSymbol) {
+  const size_t numSymbols = symbols.size();
+  SymbolSets sets{
+      .nullable = vector<bool>(numSymbols, false),
+      .first = vector<SymbolSet>(numSymbols, SymbolSet(numSymbols)),
+      .follow = vector<SymbolSet>(numSymbols, SymbolSet(numSymbols)),
+  };
 
-struct Grammar {
-  map<string, Rule> rules;
-};
+  for (size_t symbol = 0; symbol < numSymbols; symbol++) {
+    if (symbols[symbol].isTerminal()) sets.first[symbol].insert(symbol);
+  }
 
-bool operator<(const Rule::Target &lhs, const Rule::Target &rhs) {
-  if (lhs.type != rhs.type) {
-    return lhs.type < rhs.type;
+  // Nullable and FIRST feed into each other, so iterate both until nothing changes.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    for (size_t p = 0; p < productions.size(); p++) {
+      const auto lhs = productions[p].lhs;
+      bool allNullable = true;
+
+      for (uint32_t symbol : productionSymbols[p]) {
+        changed |= sets.first[lhs].merge(sets.first[symbol]);
+        if (!sets.nullable[symbol]) {
+          allNullable = false;
+          break;
+        }
+      }
+
+      if (allNullable && !sets.nullable[lhs]) {
+        sets.nullable[lhs] = true;
+        changed = true;
+      }
+    }
   }
 
-  switch (lhs.type) {
-  case RT_TerminalToken: return lhs.token < rhs.token;
-  case RT_String       :
-  case RT_Rule         : return lhs.str < rhs.str;
+  // Production 0 is the augmented start rule, which is followed by the end of input.
+  sets.follow[productions[0].lhs].insert(eofSymbol);
+
+  changed = true;
+  while (changed) {
+    changed = false;
+
+    for (size_t p = 0; p < productions.size(); p++) {
+      const auto &rhs = productionSymbols[p];
+
+      // Walk right to left, tracking what can follow the current symbol.
+      SymbolSet trailer = sets.follow[productions[p].lhs];
+      for (size_t i = rhs.size(); i-- > 0;) {
+        changed |= sets.follow[rhs[i]].merge(trailer);
+
+        if (sets.nullable[rhs[i]]) {
+          trailer.merge(sets.first[rhs[i]]);
+        } else {
+          trailer = sets.first[rhs[i]];
+        }
+      }
+    }
   }
 
-  assert(false);
+  return sets;
 }
 
-struct DottedRule {
-  unsigned int dotPosition;
-  string ruleName;
-  const Rule::AlternativeT *alternative;
-
-  bool operator==(const DottedRule &other) const {
-    return ruleName == other.ruleName && dotPosition == other.dotPosition &&
-           *alternative == *other.alternative;
+static void printProduction(std::ostream &os, const ParseTable &table,
+                            const vector<uint32_t> &rhs, size_t production) {
+  os << table.ruleName(production) << " ->";
+  if (rhs.empty()) os << " ε";
+  for (uint32_t symbol : rhs) {
+    os << " " << table.symbols[symbol];
   }
+}
+
+ParseTable buildParseTable(const Grammar &grammar, TableKind kind) {
+  using std::endl;
+  const auto &rules = grammar.rules;
 
-  bool operator<(const DottedRule &other) const {
-    return dotPosition < other.dotPosition || ruleName < other.ruleName;
+  auto program = rules.find("program");
+  if (program == rules.end()) {
+    diagnostics() << color::boldred("ERROR")
+                  << ": The grammar has no 'program' rule to start from!" << endl;
+    fatalError(1);
   }
 
-  optional<Rule::Target> beforeDot() const {
-    if (dotPosition < 1)
-      return {};
-    else
-      return {(*alternative)[dotPosition - 1]};
+  // Number every production, with the augmented T/S' rule (which will just resolve to
+  // "program") as production 0.
+  Rule::AlternativeT programRule{Rule::Target(program->second)};
+  vector<Production> productions{
+      {.ruleName = "T", .alternative = &programRule, .precedence = nullptr}};
+
+  // Intern every symbol that appears in an alternative, so that items can be grouped
+  // by an integer instead of comparing Rule::Targets.
+  map<Rule::Target, uint32_t> symbolIds;
+  vector<Rule::Target> symbols;
+  vector<vector<uint32_t>> productionSymbols;
+
+  // For each non-terminal symbol, the productions it expands to.
+  vector<vector<uint32_t>> expansions;
+
+  auto internSymbol = [&](const Rule::Target &target) {
+    auto [it, inserted] = symbolIds.emplace(target, symbols.size());
+    if (inserted) {
+      symbols.push_back(target);
+      expansions.push_back({});
+    }
+    return it->second;
+  };
+
+  // The lexer keeps returning Eof at the end of the input, so it doubles as the
+  // lookahead for accepting.
+  const uint32_t eofSymbol = internSymbol(TT_Eof);
+
+  auto precedenceOf = [&](const string &name) -> const Precedence * {
+    auto it = grammar.precedences.find(name);
+    return it == grammar.precedences.end() ? nullptr : &it->second;
+  };
+
+  for (const auto &[name, rule] : rules) {
+    for (size_t a = 0; a < rule.alternatives.size(); a++) {
+      const auto &alternative = rule.alternatives[a];
+      const Precedence *precedence = nullptr;
+      if (!rule.precedences[a].empty()) {
+        precedence = precedenceOf(rule.precedences[a]);
+      } else {
+        auto last = std::find_if(alternative.rbegin(), alternative.rend(),
+                                 [](const auto &t) { return t.type == RT_String; });
+        if (last != alternative.rend()) precedence = precedenceOf(last->str);
+      }
+      productions.push_back(
+          {.ruleName = name, .alternative = &alternative, .precedence = precedence});
+    }
   }
-  optional<Rule::Target> afterDot() const {
-    if (dotPosition >= alternative->size())
-      return {};
-    else
-      return {(*alternative)[dotPosition]};
+
+  for (size_t p = 0; p < productions.size(); p++) {
+    vector<uint32_t> ids;
+    for (const auto &target : *productions[p].alternative) {
+      ids.push_back(internSymbol(target));
+    }
+    productionSymbols.push_back(ids);
   }
-};
 
-struct Reduction {
-  /// The number of items to pop off the stack when reducing.
-  size_t numPop;
-  /// The name of the rule to reduce by.
-  string ruleName;
+  vector<TableProduction> tableProductions;
+  vector<int32_t> rhsSymbols;
+  for (size_t p = 0; p < productions.size(); p++) {
+    uint32_t lhs = internSymbol(Rule::Target::RuleByName(productions[p].ruleName));
+    expansions[lhs].push_back(p);
 
-  inline bool operator==(const Reduction &other) const {
-    return ruleName == other.ruleName && numPop == other.numPop;
+    tableProductions.push_back({
+        .lhs = int32_t(lhs),
+        .numPop = uint32_t(productionSymbols[p].size()),
+        .firstSymbol = uint32_t(rhsSymbols.size()),
+    });
+    rhsSymbols.insert(rhsSymbols.end(), productionSymbols[p].begin(),
+                      productionSymbols[p].end());
   }
-};
 
-struct ParseRules {
-  size_t state;
-  map<Rule::Target, size_t> shifts;
-  StupidSet<Reduction> reductions;
-};
+  const size_t numSymbols = symbols.size();
+  const SymbolSets sets =
+      computeSymbolSets(symbols, tableProductions, productionSymbols, eofSymbol);
+  const bool trackLookaheads = kind != Table_SLR1;
+
+  // For each production, where the part of it that can derive nothing starts. Items
+  // with their dot past that point can be reduced early by the GLR parser.
+  vector<uint32_t> nullableTails;
+  for (const auto &rhs : productionSymbols) {
+    size_t tail = rhs.size();
+    while (tail > 0 && sets.nullable[rhs[tail - 1]])
+      tail--;
+    nullableTails.push_back(tail);
+  }
 
-vector<ParseRules> buildParseTable(const Grammar &grammar) {
-  using std::cout, std::endl;
-  const auto &rules = grammar.rules;
+  // Pick a way for each nullable symbol to derive nothing, going from the symbols that
+  // do so directly upwards so the derivations can't loop.
+  vector<int32_t> epsilonProductions(numSymbols, -1);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t p = 0; p < productions.size(); p++) {
+      auto lhs = tableProductions[p].lhs;
+      if (epsilonProductions[lhs] >= 0) continue;
+
+      const auto &rhs = productionSymbols[p];
+      if (std::all_of(rhs.begin(), rhs.end(), [&](uint32_t symbol) {
+            return epsilonProductions[symbol] >= 0;
+          })) {
+        epsilonProductions[lhs] = p;
+        changed = true;
+      }
+    }
+  }
 
-  vector<StupidSet<DottedRule>> states;
+  struct Reduction {
+    uint32_t production;
+    /// The number of symbols before the dot - less than the production's length for
+    /// right-nulled reductions.
+    uint32_t length;
+    SymbolSet lookahead;
+  };
 
-  // For each state, which non-terminal leads to what next state.
-  vector<map<Rule::Target, size_t>> shifts;
-  vector<StupidSet<Reduction>> reductions;
+  struct State {
+    /// The items that were shifted into the state, kept sorted so equal item sets
+    /// hash and compare equal, and the lookaheads of each one.
+    vector<Item> kernel;
+    vector<SymbolSet> lookaheads;
 
-  // Push the initial T/S' rule, which will just resolve to "program".
-  Rule::AlternativeT programRule{Rule::Target(rules.at("program"))};
-  states.push_back({{.dotPosition = 0, .ruleName = "T", .alternative = &programRule}});
+    vector<std::pair<uint32_t, size_t>> shifts;
+    vector<Reduction> reductions;
 
-  // Generate all states.
-  for (size_t i = 0; i < states.size(); i++) {
-    reductions.push_back({});
+    bool queued = true;
+  };
 
-    StupidSet<DottedRule> seenRules;
-    StupidSet<DottedRule> &currSet = states[i];
-    StupidSet<Reduction> &currReductions = reductions[i];
-    StupidSet<Rule::Target> terminals;
+  // States are looked up by kernel. For LALR(1) (and SLR(1)) there's only one state
+  // per kernel and lookaheads get merged into it, canonical LR(1) keeps every
+  // distinct set of lookaheads as a separate state.
+  std::unordered_map<vector<Item>, vector<size_t>, KernelHash> statesByKernel;
+  vector<State> states;
+  std::deque<size_t> queue;
+
+  {
+    SymbolSet acceptLookahead(numSymbols);
+    acceptLookahead.insert(eofSymbol);
+
+    states.push_back(State{
+        .kernel = {{.production = 0, .dot = 0}},
+        .lookaheads = {acceptLookahead},
+        .shifts = {},
+        .reductions = {},
+    });
+    statesByKernel[states[0].kernel].push_back(0);
+    queue.push_back(0);
+  }
 
-    // In the current set, try to expand all non-terminals to the right of the dot.
-    for (size_t j = 0; j < currSet.size(); j++) {
-      const auto &rule = currSet[j];
+  vector<int32_t> closureIndex(productions.size(), -1);
+  vector<vector<std::pair<Item, SymbolSet>>> kernelsBySymbol(numSymbols);
+  vector<uint32_t> shiftedSymbols;
+
+  while (!queue.empty()) {
+    const size_t i = queue.front();
+    queue.pop_front();
+    states[i].queued = false;
+
+    // Close the kernel by expanding every non-terminal to the right of a dot. Closure
+    // items whose lookaheads grow have to be expanded again.
+    vector<Item> items = states[i].kernel;
+    vector<SymbolSet> lookaheads = states[i].lookaheads;
+    std::deque<size_t> pending;
+    vector<bool> isPending(items.size(), true);
+    for (size_t j = 0; j < items.size(); j++)
+      pending.push_back(j);
+
+    while (!pending.empty()) {
+      const size_t j = pending.front();
+      pending.pop_front();
+      isPending[j] = false;
+
+      const Item item = items[j];
+      const auto &rhs = productionSymbols[item.production];
+      if (item.dot >= rhs.size() || symbols[rhs[item.dot]].isTerminal()) continue;
+
+      // Whatever can come after the non-terminal is a lookahead for its expansions.
+      SymbolSet expansionLookahead(numSymbols);
+      if (trackLookaheads) {
+        size_t k = item.dot + 1;
+        for (; k < rhs.size(); k++) {
+          expansionLookahead.merge(sets.first[rhs[k]]);
+          if (!sets.nullable[rhs[k]]) break;
+        }
+        if (k == rhs.size()) expansionLookahead.merge(lookaheads[j]);
+      }
 
-      auto maybeTarget = rule.afterDot();
-      if (!maybeTarget.has_value()) {
-        // If the dot is at the end of the rule, this is a REDUCE step.
-        currReductions.insert(Reduction{
-            .numPop = rule.alternative->size(),
-            .ruleName = rule.ruleName,
-        });
-      } else {
-        // This is a SHIFT step.
-        auto target = maybeTarget.value();
-        terminals.insert(target);
-
-        if (target.isNonTerminal()) {
-          auto nonTerminalName = string(target.str);
-
-          for (const auto &alternative : rules.at(nonTerminalName).alternatives) {
-            auto newRule = DottedRule{
-                .dotPosition = 0,
-                .ruleName = nonTerminalName,
-                .alternative = &alternative,
-            };
-
-            if (!seenRules.contains(newRule)) {
-              currSet.insert(newRule);
-              seenRules.insert(newRule);
-            }
-          }
+      for (uint32_t production : expansions[rhs[item.dot]]) {
+        int32_t k = closureIndex[production];
+
+        if (k < 0) {
+          k = closureIndex[production] = items.size();
+          items.push_back({.production = production, .dot = 0});
+          lookaheads.push_back(expansionLookahead);
+          isPending.push_back(true);
+          pending.push_back(k);
+        } else if (lookaheads[k].merge(expansionLookahead) && !isPending[k]) {
+          isPending[k] = true;
+          pending.push_back(k);
         }
       }
     }
 
-    // Check whether the currSet already exists in another state.
-    bool alreadyExists = false;
-    size_t matchIndex = 0;
-    for (; matchIndex < i; matchIndex++) {
-      if (states.at(matchIndex) == currSet) {
-        alreadyExists = true;
-        break;
+    for (const auto &item : items) {
+      if (item.dot == 0) closureIndex[item.production] = -1;
+    }
+
+    // Record the reductions and group the remaining items by the symbol after the dot.
+    states[i].reductions.clear();
+    for (size_t j = 0; j < items.size(); j++) {
+      const auto &item = items[j];
+      const auto &rhs = productionSymbols[item.production];
+
+      if (item.dot >= nullableTails[item.production]) {
+        // SLR(1) reduces on anything that can follow the rule at all.
+        const auto lhs = tableProductions[item.production].lhs;
+        states[i].reductions.push_back({
+            .production = item.production,
+            .length = item.dot,
+            .lookahead = trackLookaheads ? lookaheads[j] : sets.follow[lhs],
+        });
       }
+
+      if (item.dot >= rhs.size()) continue;
+
+      uint32_t symbol = rhs[item.dot];
+      if (kernelsBySymbol[symbol].empty()) shiftedSymbols.push_back(symbol);
+      kernelsBySymbol[symbol].push_back(
+          {{.production = item.production, .dot = item.dot + 1}, lookaheads[j]});
     }
 
-    if (alreadyExists) {
-      shifts.push_back({});
+    // Find, create or update the state reached by shifting each symbol.
+    states[i].shifts.clear();
+    for (uint32_t symbol : shiftedSymbols) {
+      auto &successor = kernelsBySymbol[symbol];
+      std::sort(successor.begin(), successor.end(),
+                [](const auto &a, const auto &b) { return a.first < b.first; });
+
+      vector<Item> kernel;
+      vector<SymbolSet> kernelLookaheads;
+      for (auto &[item, lookahead] : successor) {
+        kernel.push_back(item);
+        kernelLookaheads.push_back(std::move(lookahead));
+      }
+      successor.clear();
 
-      for (size_t k = 0; k < i; k++) {
-        for (auto kv : shifts[k]) {
-          if (kv.second == i) {
-            shifts[k][kv.first] = matchIndex;
-          }
+      auto &candidates = statesByKernel[kernel];
+      size_t next = states.size();
+
+      if (kind == Table_CanonicalLR1) {
+        for (size_t candidate : candidates) {
+          if (states[candidate].lookaheads == kernelLookaheads) next = candidate;
+        }
+      } else if (!candidates.empty()) {
+        next = candidates[0];
+
+        bool changed = false;
+        for (size_t k = 0; k < kernel.size(); k++) {
+          changed |= states[next].lookaheads[k].merge(kernelLookaheads[k]);
+        }
+
+        if (changed && !states[next].queued) {
+          states[next].queued = true;
+          queue.push_back(next);
         }
       }
-      continue;
+
+      if (next == states.size()) {
+        candidates.push_back(next);
+        states.push_back(State{
+            .kernel = kernel,
+            .lookaheads = kernelLookaheads,
+            .shifts = {},
+            .reductions = {},
+        });
+        queue.push_back(next);
+      }
+
+      states[i].shifts.push_back({symbol, next});
     }
+    shiftedSymbols.clear();
+  }
 
-    // Create new sets of states.
-    map<Rule::Target, size_t> currShifts;
-    for (const auto &target : terminals) {
-      StupidSet<DottedRule> rulesForTarget;
+  // Flatten everything into the action matrix. Conflicts between shifting an operator
+  // and reducing by a production that both have a precedence go whichever way binds
+  // tighter. Any other conflicts get reported, and resolved in favour of shifting, or
+  // otherwise the production that comes first in the grammar.
+  ParseTable table;
+  table.numStates = states.size();
+  table.symbols = symbols;
+  table.productions.assign(tableProductions);
+
+  vector<Action> actions(table.numStates * numSymbols, ACTION_ERROR);
+  vector<Action> defaultActions(table.numStates, ACTION_ERROR);
+  vector<uint32_t> glrCells;
+  vector<GlrAction> glrActions;
+
+  // Whether to reduce by `production` rather than shift `symbol`, if precedence says.
+  auto prefersReducing = [&](uint32_t symbol, size_t production) -> optional<bool> {
+    const Precedence *shifted =
+        symbols[symbol].type == RT_String ? precedenceOf(symbols[symbol].str) : nullptr;
+    const Precedence *reduced = productions[production].precedence;
+    if (shifted == nullptr || reduced == nullptr) return {};
+
+    if (shifted->level != reduced->level) return reduced->level > shifted->level;
+    return shifted->isLeftAssociative;
+  };
 
-      for (const auto &dottedRule : states[i]) {
-        if (dottedRule.afterDot() == target) {
-          DottedRule newRule = dottedRule;
-          newRule.dotPosition++;
-          rulesForTarget.insert(newRule);
+  size_t numShiftReduce = 0, numReduceReduce = 0;
+  vector<GlrAction> glrReductions;
+
+  for (size_t i = 0; i < table.numStates; i++) {
+    Action *row = &actions[i * numSymbols];
+    const auto &state = states[i];
+
+    bool canShiftTerminal = false;
+    for (auto [symbol, nextState] : state.shifts) {
+      row[symbol] = shiftAction(nextState);
+      canShiftTerminal |= symbols[symbol].isTerminal();
+    }
+
+    // The GLR parser gets to try everything that precedence doesn't rule out.
+    for (size_t symbol = 0; symbol < numSymbols; symbol++) {
+      glrCells.push_back(glrActions.size());
+      if (symbols[symbol].isNonTerminal()) continue;
+
+      const bool canShift = isShift(row[symbol]);
+      bool shiftLoses = false;
+      glrReductions.clear();
+      for (const auto &reduction : state.reductions) {
+        if (!reduction.lookahead.contains(symbol)) continue;
+
+        auto reduce = canShift ? prefersReducing(symbol, reduction.production)
+                               : optional<bool>();
+        shiftLoses |= reduce == true;
+        if (reduce != false) {
+          glrReductions.push_back(
+              {reduceAction(reduction.production), reduction.length});
         }
       }
 
-      if (rulesForTarget.size() > 0) {
-        // Check whether a state like rulesForTarget already exists.
-        auto it = states.begin();
-        for (; it != states.end(); it++) {
-          if (rulesForTarget == *it) break;
-        }
+      if (canShift && !shiftLoses) glrActions.push_back({row[symbol], 0});
+      glrActions.insert(glrActions.end(), glrReductions.begin(), glrReductions.end());
+    }
 
-        if (it != states.end()) {
-          currShifts[target] = std::distance(states.begin(), it);
-        } else {
-          currShifts[target] = states.size();
-          states.push_back(rulesForTarget);
+    // Reducing by either of two equally long alternatives of the same rule builds the
+    // same node, so that's not a conflict.
+    auto sameNode = [&](size_t a, size_t b) {
+      return tableProductions[a].lhs == tableProductions[b].lhs &&
+             tableProductions[a].numPop == tableProductions[b].numPop;
+    };
+
+    vector<size_t> distinctReductions;
+    for (const auto &reduction : state.reductions) {
+      const size_t production = reduction.production;
+      if (reduction.length < tableProductions[production].numPop) continue;
+
+      if (std::none_of(distinctReductions.begin(), distinctReductions.end(),
+                       [&](size_t other) { return sameNode(other, production); }))
+        distinctReductions.push_back(production);
+
+      for (size_t symbol = 0; symbol < numSymbols; symbol++) {
+        if (!reduction.lookahead.contains(symbol)) continue;
+
+        Action &cell = row[symbol];
+
+        if (cell == ACTION_ERROR) {
+          cell = reduceAction(production);
+        } else if (isShift(cell)) {
+          if (auto reduce = prefersReducing(symbol, production); reduce.has_value()) {
+            if (*reduce) cell = reduceAction(production);
+            continue;
+          }
+
+          numShiftReduce++;
+          diagnostics() << color::yellow("WARN") << ": shift/reduce conflict in state "
+                        << i << " on " << symbols[symbol] << " - not reducing ";
+          printProduction(diagnostics(), table, productionSymbols[production],
+                          production);
+          diagnostics() << endl;
+        } else if (!sameNode(reduceProduction(cell), production)) {
+          numReduceReduce++;
+          size_t kept = std::min<size_t>(reduceProduction(cell), production);
+          size_t dropped = std::max<size_t>(reduceProduction(cell), production);
+          cell = reduceAction(kept);
+
+          diagnostics() << color::yellow("WARN") << ": reduce/reduce conflict in state "
+                        << i << " on " << symbols[symbol] << " - not reducing ";
+          printProduction(diagnostics(), table, productionSymbols[dropped], dropped);
+          diagnostics() << endl;
         }
       }
     }
-    shifts.push_back(currShifts);
+
+    if (!canShiftTerminal && distinctReductions.size() == 1) {
+      defaultActions[i] = reduceAction(distinctReductions[0]);
+    }
   }
 
-  vector<ParseRules> result;
-  for (size_t i = 0; i < states.size(); i++) {
-    result.push_back(ParseRules{
-        .state = i,
-        .shifts = shifts[i],
-        .reductions = reductions[i],
-    });
+  if (numShiftReduce + numReduceReduce > 0) {
+    diagnostics() << color::yellow("WARN") << ": " << numShiftReduce
+                  << " shift/reduce and " << numReduceReduce
+                  << " reduce/reduce conflict(s) in the grammar." << endl;
+  }
+
+  glrCells.push_back(glrActions.size());
+
+  table.rhsSymbols.assign(rhsSymbols);
+  table.epsilonProductions.assign(epsilonProductions);
+  table.actions.assign(actions);
+  table.defaultActions.assign(defaultActions);
+  table.glrCells.assign(glrCells);
+  table.glrActions.assign(glrActions);
+  table.indexTerminals();
+  return table;
+}
+
+/// Bump whenever the cache layout or the output of buildParseTable() changes.
+constexpr uint32_t PARSE_TABLE_CACHE_VERSION = 5;
+constexpr char PARSE_TABLE_CACHE_MAGIC[4] = {'T', 'C', 'P', 'T'};
+
+/// 64-bit FNV-1a, used to key the parse table cache by the grammar's contents.
+uint64_t hashGrammarSource(std::string_view text) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (unsigned char c : text) {
+    hash ^= c;
+    hash *= 0x100000001b3ull;
   }
+  return hash;
+}
+
+template<typename T>
+static void writePod(std::ostream &os, T value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template<typename T>
+static bool readPod(std::istream &is, T &value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  return bool(is.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+static void writeString(std::ostream &os, const string &str) {
+  writePod<uint32_t>(os, str.size());
+  os.write(str.data(), str.size());
+}
+
+static bool readString(std::istream &is, string &str) {
+  uint32_t size;
+  if (!readPod(is, size)) return false;
+  str.resize(size);
+  return bool(is.read(str.data(), size));
+}
+
+template<typename T>
+static void writeArray(std::ostream &os, const TableArray<T> &array) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  writePod<uint64_t>(os, array.size());
+  os.write(reinterpret_cast<const char *>(array.data()), array.size() * sizeof(T));
+}
+
+template<typename T>
+static bool readArray(std::istream &is, TableArray<T> &array, uint64_t maxSize) {
+  uint64_t size;
+  if (!readPod(is, size) || size > maxSize) return false;
+
+  vector<T> data(size);
+  if (!is.read(reinterpret_cast<char *>(data.data()), size * sizeof(T))) return false;
+
+  array.assign(std::move(data));
+  return true;
+}
+
+/// Write the parse table to `cachePath`, tagged with the hash of the grammar it was
+/// built from. Failures are silently ignored - the cache is only an optimization.
+void saveParseTable(const string &cachePath, uint64_t grammarHash,
+                    const ParseTable &table) {
+  // Write to a temporary file first and rename it into place, so that concurrent
+  // toycpp processes never observe a half-written cache.
+  string tmpPath = cachePath + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream os(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!os.is_open()) return;
+
+    os.write(PARSE_TABLE_CACHE_MAGIC, sizeof(PARSE_TABLE_CACHE_MAGIC));
+    writePod(os, PARSE_TABLE_CACHE_VERSION);
+    writePod(os, grammarHash);
+    writePod<uint64_t>(os, table.numStates);
+    writePod<uint64_t>(os, table.symbols.size());
+
+    for (const auto &symbol : table.symbols) {
+      writePod<uint8_t>(os, symbol.type);
+      writePod<uint8_t>(os, symbol.token);
+      writeString(os, symbol.str);
+    }
+
+    writeArray(os, table.productions);
+    writeArray(os, table.rhsSymbols);
+    writeArray(os, table.epsilonProductions);
+    writeArray(os, table.actions);
+    writeArray(os, table.defaultActions);
+    writeArray(os, table.glrCells);
+    writeArray(os, table.glrActions);
+
+    if (!os.good()) {
+      os.close();
+      std::remove(tmpPath.c_str());
+      return;
+    }
+  }
+
+  if (std::rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+    std::remove(tmpPath.c_str());
+  }
+}
+
+/// Check that every array in `table` has the right size, and that every action,
+/// production and symbol in them refers to something that exists.
+static bool isConsistent(const ParseTable &table) {
+  const size_t numSymbols = table.symbols.size();
+  const size_t numCells = table.numStates * numSymbols;
+
+  auto isValidAction = [&](Action action) {
+    return action == ACTION_ERROR ||
+           (isShift(action) && shiftTarget(action) < table.numStates) ||
+           (isReduce(action) && reduceProduction(action) < table.productions.size());
+  };
+  auto isValidSymbol = [&](int32_t symbol) {
+    return symbol >= 0 && size_t(symbol) < numSymbols;
+  };
+  auto isValidProduction = [&](int32_t production) {
+    return production >= -1 && production < int32_t(table.productions.size());
+  };
+
+  if (table.productions.size() == 0 || table.actions.size() != numCells ||
+      table.defaultActions.size() != table.numStates ||
+      table.epsilonProductions.size() != numSymbols ||
+      table.glrCells.size() != numCells + 1 ||
+      table.glrCells[numCells] != table.glrActions.size()) {
+    return false;
+  }
+
+  for (const auto &production : table.productions) {
+    if (!isValidSymbol(production.lhs) ||
+        production.firstSymbol + production.numPop > table.rhsSymbols.size())
+      return false;
+  }
+
+  for (size_t cell = 0; cell < numCells; cell++) {
+    if (table.glrCells[cell] > table.glrCells[cell + 1]) return false;
+  }
+
+  for (const auto &action : table.glrActions) {
+    if (!isValidAction(action.action) ||
+        (isReduce(action.action) &&
+         action.length > table.productions[reduceProduction(action.action)].numPop))
+      return false;
+  }
+
+  return std::all_of(table.rhsSymbols.begin(), table.rhsSymbols.end(),
+                     isValidSymbol) &&
+         std::all_of(table.epsilonProductions.begin(), table.epsilonProductions.end(),
+                     isValidProduction) &&
+         std::all_of(table.actions.begin(), table.actions.end(), isValidAction) &&
+         std::all_of(table.defaultActions.begin(), table.defaultActions.end(),
+                     isValidAction);
+}
+
+/// Try to load a parse table from `cachePath`. Returns an empty optional if the cache
+/// is missing, corrupt, from another version of toycpp or from a different grammar.
+optional<ParseTable> loadParseTable(const string &cachePath, uint64_t grammarHash) {
+  std::ifstream is(cachePath, std::ios::binary | std::ios::ate);
+  if (!is.is_open()) return {};
+
+  // No array can be bigger than the file itself.
+  const uint64_t fileSize = is.tellg();
+  is.seekg(0);
+
+  char magic[sizeof(PARSE_TABLE_CACHE_MAGIC)];
+  uint32_t version;
+  uint64_t hash, numStates, numSymbols;
+
+  if (!is.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), PARSE_TABLE_CACHE_MAGIC) ||
+      !readPod(is, version) || version != PARSE_TABLE_CACHE_VERSION ||
+      !readPod(is, hash) || hash != grammarHash || !readPod(is, numStates) ||
+      !readPod(is, numSymbols) || numSymbols > fileSize) {
+    return {};
+  }
+
+  ParseTable table;
+  table.numStates = numStates;
+
+  for (uint64_t i = 0; i < numSymbols; i++) {
+    uint8_t type, token;
+    string str;
+
+    if (!readPod(is, type) || !readPod(is, token) || !readString(is, str) ||
+        type > RT_Rule || token > TT_Eof) {
+      return {};
+    }
+
+    Rule::Target symbol = Rule::Target::RuleByName(str);
+    symbol.type = RuleTargetType(type);
+    symbol.token = TerminalToken(token);
+    table.symbols.push_back(symbol);
+  }
+
+  if (!readArray(is, table.productions, fileSize) ||
+      !readArray(is, table.rhsSymbols, fileSize) ||
+      !readArray(is, table.epsilonProductions, fileSize) ||
+      !readArray(is, table.actions, fileSize) ||
+      !readArray(is, table.defaultActions, fileSize) ||
+      !readArray(is, table.glrCells, fileSize) ||
+      !readArray(is, table.glrActions, fileSize) || !isConsistent(table)) {
+    return {};
+  }
+
+  table.indexTerminals();
+  return table;
+}
+
+// The symbols of the parse table as they're baked into the binary by
+// emitParseTableHeader(). The actions are stored as-is.
+struct EmbeddedSymbol {
+  RuleTargetType type;
+  TerminalToken token;
+  const char *str;
+};
+} // namespace grammar
+
+#ifdef TOYCPP_EMBEDDED_PARSE_TABLE
+#include "parse_table.gen.hpp"
+#endif
+
+namespace grammar {
+
+static string cppStringLiteral(const string &str) {
+  string result = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') result += '\\';
+    result += c;
+  }
+  return result + "\"";
+}
+
+static const char *ruleTargetTypeName(RuleTargetType type) {
+  switch (type) {
+  case RT_TerminalToken: return "RT_TerminalToken";
+  case RT_String       : return "RT_String";
+  case RT_Rule         : return "RT_Rule";
+  }
+  return "";
+}
+
+static const char *terminalTokenName(TerminalToken token) {
+  switch (token) {
+  case TT_Invalid       : return "TT_Invalid";
+  case TT_Empty         : return "TT_Empty";
+  case TT_Identifier    : return "TT_Identifier";
+  case TT_IntegerLiteral: return "TT_IntegerLiteral";
+  case TT_FloatLiteral  : return "TT_FloatLiteral";
+  case TT_DoubleLiteral : return "TT_DoubleLiteral";
+  case TT_CharLiteral   : return "TT_CharLiteral";
+  case TT_StringLiteral : return "TT_StringLiteral";
+  case TT_Eof           : return "TT_Eof";
+  }
+  return "";
+}
+
+/// Write `array` out as `constexpr std::array<type, N> name`, `perLine` elements per
+/// line. std::array rather than a plain array, since some of them can be empty.
+template<typename T, typename EmitElement>
+static void emitArray(std::ostream &os, const char *type, const char *name,
+                      const TableArray<T> &array, size_t perLine,
+                      EmitElement emitElement) {
+  os << "constexpr std::array<" << type << ", " << array.size() << "> " << name
+     << " = {{";
+  for (size_t i = 0; i < array.size(); i++) {
+    os << (i % perLine == 0 ? "\n   " : "") << " ";
+    emitElement(array[i]);
+    os << ",";
+  }
+  os << "\n}};\n\n";
+}
+
+/// Write `table` out as a C++ header of constexpr arrays, to be compiled into toycpp
+/// with TOYCPP_EMBEDDED_PARSE_TABLE defined.
+void emitParseTableHeader(std::ostream &os, const string &grammarFilename,
+                          uint64_t grammarHash, const ParseTable &table) {
+  const size_t numSymbols = table.symbols.size();
+
+  os << "// Generated by `toycpp --emit-parse-table " << grammarFilename << "`.\n"
+     << "// Do not edit - change the grammar and rebuild instead.\n"
+     << "#pragma once\n\n"
+     << "#include <array>\n"
+     << "#include <cstdint>\n\n"
+     << "namespace grammar {\n"
+     << "constexpr uint64_t EMBEDDED_GRAMMAR_HASH = 0x" << std::hex << grammarHash
+     << std::dec << "ull;\n"
+     << "constexpr size_t EMBEDDED_NUM_STATES = " << table.numStates << ";\n\n";
+
+  os << "constexpr EmbeddedSymbol EMBEDDED_SYMBOLS[] = {\n";
+  for (const auto &symbol : table.symbols) {
+    os << "    {" << ruleTargetTypeName(symbol.type) << ", "
+       << terminalTokenName(symbol.token) << ", " << cppStringLiteral(symbol.str)
+       << "},\n";
+  }
+  os << "};\n\n";
+
+  auto emitInt = [&](auto value) { os << value; };
+
+  emitArray(os, "TableProduction", "EMBEDDED_PRODUCTIONS", table.productions, 1,
+            [&](const TableProduction &production) {
+              os << "{" << production.lhs << ", " << production.numPop << ", "
+                 << production.firstSymbol << "}";
+            });
+  emitArray(os, "int32_t", "EMBEDDED_RHS_SYMBOLS", table.rhsSymbols, 16, emitInt);
+  emitArray(os, "int32_t", "EMBEDDED_EPSILON_PRODUCTIONS", table.epsilonProductions,
+            16, emitInt);
+  // One row of the matrix per line.
+  emitArray(os, "Action", "EMBEDDED_ACTIONS", table.actions, numSymbols, emitInt);
+  emitArray(os, "Action", "EMBEDDED_DEFAULT_ACTIONS", table.defaultActions, 1,
+            emitInt);
+  emitArray(os, "uint32_t", "EMBEDDED_GLR_CELLS", table.glrCells, numSymbols,
+            emitInt);
+  emitArray(os, "GlrAction", "EMBEDDED_GLR_ACTIONS", table.glrActions, 8,
+            [&](const GlrAction &action) {
+              os << "{" << action.action << ", " << action.length << "}";
+            });
+
+  os << "} // namespace grammar\n";
+}
+
+#ifdef TOYCPP_EMBEDDED_PARSE_TABLE
+/// Wrap the parse table that was compiled into the binary. The arrays are used in
+/// place, only the symbols are copied out.
+ParseTable embeddedParseTable() {
+  ParseTable table;
+  table.numStates = EMBEDDED_NUM_STATES;
+
+  for (const auto &embeddedSymbol : EMBEDDED_SYMBOLS) {
+    Rule::Target symbol = Rule::Target::RuleByName(embeddedSymbol.str);
+    symbol.type = embeddedSymbol.type;
+    symbol.token = embeddedSymbol.token;
+    table.symbols.push_back(symbol);
+  }
+
+  static_assert(std::size(EMBEDDED_ACTIONS) ==
+                EMBEDDED_NUM_STATES * std::size(EMBEDDED_SYMBOLS));
+  static_assert(std::size(EMBEDDED_GLR_CELLS) == std::size(EMBEDDED_ACTIONS) + 1);
+
+  table.productions.borrow(EMBEDDED_PRODUCTIONS.data(), EMBEDDED_PRODUCTIONS.size());
+  table.rhsSymbols.borrow(EMBEDDED_RHS_SYMBOLS.data(), EMBEDDED_RHS_SYMBOLS.size());
+  table.epsilonProductions.borrow(EMBEDDED_EPSILON_PRODUCTIONS.data(),
+                                  EMBEDDED_EPSILON_PRODUCTIONS.size());
+  table.actions.borrow(EMBEDDED_ACTIONS.data(), EMBEDDED_ACTIONS.size());
+  table.defaultActions.borrow(EMBEDDED_DEFAULT_ACTIONS.data(),
+                              EMBEDDED_DEFAULT_ACTIONS.size());
+  table.glrCells.borrow(EMBEDDED_GLR_CELLS.data(), EMBEDDED_GLR_CELLS.size());
+  table.glrActions.borrow(EMBEDDED_GLR_ACTIONS.data(), EMBEDDED_GLR_ACTIONS.size());
+
+  table.indexTerminals();
+  return table;
+}
+#endif
+
+std::string_view Tree::name(NodeId id) const {
+  const Node &node = nodes[id];
+  if (node.isTerminal()) return spans[node.token];
+  return grammar->table.symbols[node.symbol].str;
+}
+
+PendingNode shiftNode(Tree &tree, const lex::Token &token) {
+  tree.nodes.push_back(
+      Node{.symbol = token.symbol, .token = uint32_t(tree.spans.size())});
+  tree.spans.push_back(token.span());
+  return {NodeId(tree.nodes.size() - 1)};
+}
+
+PendingNode reduceNodes(Tree &tree, const ParseTable &table, int32_t symbol,
+                        const PendingNode *children, size_t numChildren) {
+  PendingNode result;
+  size_t i = 0;
+
+  // A left-recursive list (`list -> list item`) keeps appending to the node it already
+  // has, so a list of N items takes O(N) to build rather than O(N²) copies.
+  if (numChildren > 0 && !tree[children[0].node].isTerminal() &&
+      tree[children[0].node].symbol == symbol) {
+    result = children[0];
+    i++;
+  } else {
+    tree.nodes.push_back(Node{.symbol = symbol});
+    result.node = tree.nodes.size() - 1;
+  }
+
+  // Append the nodes from `first` to `last` (linked as siblings) to the children.
+  auto append = [&](NodeId first, NodeId last) {
+    if (first == NO_NODE) return;
+
+    if (result.lastChild == NO_NODE) {
+      tree.nodes[result.node].firstChild = first;
+    } else {
+      tree.nodes[result.lastChild].nextSibling = first;
+    }
+    result.lastChild = last;
+  };
+
+  for (; i < numChildren; i++) {
+    const Node &child = tree[children[i].node];
+    if (!child.isTerminal() && table.symbols[child.symbol].str[0] == '_') {
+      append(child.firstChild, children[i].lastChild);
+    } else {
+      append(children[i].node, children[i].node);
+    }
+  }
+
   return result;
 }
 
 class Parser {
 public:
-  Parser(vector<ParseRules> rules) : rules(rules) {}
+  Parser(const ParseTable &table, Tree &tree) : table(table), tree(tree) {}
 
   bool done() const { return isDone; }
 
-  bool advance(lex::Token lookahead) {
-    bool consumedLookahead = false;
-
-    while (!states.empty()) {
-      // Try shifting.
-      auto [_, matchingShift] =
-          findBest(currShifts().begin(), currShifts().end(), [&](auto kv) {
-            const auto &target = kv.first;
-
-            if (latestReduction.has_value() &&
-                target.matches(latestReduction.value())) {
-              return 30;
-            } else if (!consumedLookahead && target.matches(lookahead)) {
-              return target.type == RT_String ? 20 : 10;
-            } else {
-              return -1;
-            }
-          });
-
-      if (matchingShift != currShifts().end()) {
-        // Decide whether to consume the lookahead or the latest reduction.
-        if (matchingShift->first.matches(lookahead)) {
-          assert(!consumedLookahead);
-          nodes.push_back(Node{
-              .name = string(lookahead.span),
-              .children = vector<Node>(),
-              .isTerminal = true,
-          });
-          consumedLookahead = true;
-        } else {
-          nodes.push_back(latestReduction.value());
-          latestReduction.reset();
-        }
+  bool advance(const lex::Token &lookahead) {
+    if (!reduceBefore(lookahead)) return false;
+    if (isDone) return true;
 
-        states.push(matchingShift->second);
-        continue;
+    NodeHistory history{uint32_t(currState()), numShifted, numShifted + 1};
+    PendingNode leaf = shiftNode(tree, lookahead);
+    record(leaf.node, history);
+    push(leaf, lookahead.symbol, 1);
+    return true;
+  }
+
+  /// Do whatever reductions are due before `lookahead` can be shifted. Returns false
+  /// (after reporting it) if it can't be.
+  bool reduceBefore(const lex::Token &lookahead) {
+    while (true) {
+      Action action = table.defaultActions[currState()];
+      if (action == ACTION_ERROR && lookahead.symbol >= 0) {
+        action = table.action(currState(), lookahead.symbol);
       }
 
-      // Try reducing.
-      if (currReductions().size() == 0) {
-      } else if (currReductions().size() > 1) {
-        std::cerr << "ERROR: Reduce/Reduce conflict in state " << currState() << "!"
-                  << std::endl;
-        exit(3);
-      } else if (consumedLookahead &&
-                 std::any_of(currShifts().begin(), currShifts().end(),
-                             [](const auto &kv) { return kv.first.isTerminal(); })) {
-        return true;
-      } else {
-        const auto &reduction = currReductions()[0];
+      if (isShift(action)) return true;
 
-        if (reduction.ruleName == "T") {
-          isDone = true;
-          return true;
+      if (isReduce(action)) {
+        if (!reduce(reduceProduction(action))) return true;
+        continue;
+      }
+
+      vector<Rule::Target> targets;
+      for (size_t symbol = 0; symbol < table.symbols.size(); symbol++) {
+        if (table.symbols[symbol].isTerminal() &&
+            table.action(currState(), symbol) != ACTION_ERROR) {
+          targets.push_back(table.symbols[symbol]);
         }
+      }
+
+      reportWithContext(ERROR, lookahead.location(), "Unexpected {} - expected {}!",
+                        lookahead, targets);
+      return false;
+    }
+  }
 
-        size_t i = nodes.size() - reduction.numPop;
-        Node node{.name = reduction.ruleName, .children = {}};
+  /// Append `first` up to its sibling `last` to the left-recursive list on top of the
+  /// stack, as if the next `numTokens` tokens had been parsed into another item.
+  void appendItem(NodeId first, NodeId last, uint32_t numTokens) {
+    PendingNode &list = nodes.back();
+    if (list.lastChild == NO_NODE) {
+      tree.nodes[list.node].firstChild = first;
+    } else {
+      tree.nodes[list.lastChild].nextSibling = first;
+    }
+    tree.nodes[last].nextSibling = NO_NODE;
+    list.lastChild = last;
 
-        if (reduction.numPop > 0 && nodes.at(i).name == reduction.ruleName) {
-          node.children = nodes.at(i).children;
-          i++;
-        }
+    numShifted += numTokens;
+    tree.history[list.node].endToken = numShifted;
+  }
 
-        for (; i < nodes.size(); i++) {
-          const auto &n = nodes.at(i);
-          if (!n.isTerminal && n.name[0] == '_') {
-            for (const auto &nchild : n.children)
-              node.children.push_back(nchild);
-          } else {
-            node.children.push_back(n);
-          }
-        }
-        nodes.resize(nodes.size() - reduction.numPop);
-        latestReduction = node;
+  /// Push `node`, which covers the next `numTokens` tokens and is reduced to (or
+  /// shifted as) `symbol`, and go to the next state.
+  void push(PendingNode node, int32_t symbol, uint32_t numTokens) {
+    nodes.push_back(node);
+    states.push_back(shiftTarget(table.action(currState(), symbol)));
+    numShifted += numTokens;
+
+    // Reduce right away if there's nothing else this state could do, so that rules
+    // complete as soon as their last token arrives.
+    while (isReduce(table.defaultActions[currState()])) {
+      if (!reduce(reduceProduction(table.defaultActions[currState()]))) break;
+    }
+  }
 
-        for (size_t i = 0; i < reduction.numPop; i++)
-          states.pop();
+  inline size_t currState() const { return states.back(); }
 
-        continue;
-      }
+  NodeId top() { return nodes.back().node; }
 
-      if (consumedLookahead && !latestReduction.has_value()) {
-        return true;
-      } else {
-        vector<Rule::Target> targets;
+  /// Hand every item of the top-level list to `consume` once it's reduced, and drop it
+  /// from the tree, see parseStreaming().
+  void streamItems(std::function<void(Tree)> consume) {
+    consumeItem = std::move(consume);
 
-        for (auto kv : currShifts()) {
-          targets.push_back(kv.first);
-        }
+    // A `_`-prefixed rule's children get inlined into whatever it's reduced to. If that
+    // can only ever be the start symbol or (for a list) itself, then once its node is
+    // at the bottom of the stack, its children are bound to be the first children of
+    // the root, and nothing that comes after can change them.
+    const int32_t start = table.rhsSymbols[table.productions[0].firstSymbol];
+    streamable.assign(table.symbols.size(), false);
+    for (size_t symbol = 0; symbol < table.symbols.size(); symbol++) {
+      const Rule::Target &target = table.symbols[symbol];
+      streamable[symbol] = target.isNonTerminal() && target.str[0] == '_';
+    }
+    for (size_t p = 1; p < table.productions.size(); p++) {
+      const TableProduction &production = table.productions[p];
+      if (production.numPop == 0) continue;
 
-        reportWithContext(ERROR, lookahead.location, "Unexpected {} - expected {}!",
-                          lookahead, targets);
-        return false;
+      int32_t first = table.rhsSymbols[production.firstSymbol];
+      if (production.lhs != first && production.lhs != start) {
+        streamable[first] = false;
       }
     }
+  }
 
-    std::cerr << "ERROR: We ran out of states to pop!\n";
-    return false;
+private:
+  void record(NodeId id, NodeHistory history) {
+    if (tree.history.size() <= id) tree.history.resize(id + 1);
+    history.itemEnd = tree.history[id].itemEnd;
+    tree.history[id] = history;
   }
 
-  const Node &top() { return nodes.back(); }
+  /// Reduce by `production` and go to the next state. Returns false if that accepted
+  /// the input.
+  bool reduce(size_t production) {
+    if (production == 0) {
+      isDone = true;
+      return false;
+    }
 
-private:
-  int currState() const { return states.top(); }
-  inline const ParseRules &currRules() const { return rules[states.top()]; }
-  inline const map<Rule::Target, size_t> &currShifts() const {
-    return currRules().shifts;
+    const int32_t lhs = table.productions[production].lhs;
+    const size_t numPop = table.productions[production].numPop;
+
+    const PendingNode *children = nodes.data() + nodes.size() - numPop;
+    uint32_t firstToken =
+        numPop > 0 ? tree.history[children[0].node].firstToken : numShifted;
+
+    NodeId lastItemEnd = numPop > 0 ? children[0].lastChild : NO_NODE;
+    PendingNode node = reduceNodes(tree, table, lhs, children, numPop);
+    if (numPop > 0 && node.node == children[0].node && node.lastChild != lastItemEnd) {
+      NodeId itemStart = lastItemEnd == NO_NODE ? tree[node.node].firstChild
+                                                : tree[lastItemEnd].nextSibling;
+      tree.history[itemStart].itemEnd = node.lastChild;
+    }
+    nodes.resize(nodes.size() - numPop);
+    nodes.push_back(node);
+
+    states.resize(states.size() - numPop);
+    record(node.node, {uint32_t(currState()), firstToken, numShifted});
+    states.push_back(shiftTarget(table.action(currState(), lhs)));
+
+    if (consumeItem && nodes.size() == 1 && streamable[lhs]) streamChildren();
+    return true;
   }
-  inline const StupidSet<Reduction> &currReductions() const {
-    return currRules().reductions;
+
+  /// Hand the children of the only node on the stack over to `consumeItem`.
+  void streamChildren() {
+    PendingNode &bottom = nodes.back();
+    NodeId first = tree[bottom.node].firstChild;
+    if (first == NO_NODE) return;
+
+    // Everything in the tree apart from `bottom` itself is either part of the item or
+    // garbage, so rather than copying the item out, it gets the whole tree, and the
+    // parser starts over with just `bottom`.
+    Node bottomNode{.symbol = tree[bottom.node].symbol};
+    NodeHistory bottomHistory = tree.history[bottom.node];
+
+    Tree item;
+    item.grammar = tree.grammar;
+    item.root = first;
+    item.nodes = std::move(tree.nodes);
+    item.spans = std::move(tree.spans);
+
+    tree.nodes.assign(1, bottomNode);
+    tree.spans.clear();
+    tree.history.assign(1, bottomHistory);
+    bottom = {0};
+
+    consumeItem(std::move(item));
   }
-  optional<Node> latestReduction{};
 
   bool isDone = false;
+  /// How many tokens the nodes on the stack cover.
+  uint32_t numShifted = 0;
 
-  std::stack<int> states{{0}};
-  std::vector<Node> nodes;
-  vector<ParseRules> rules;
-};
+  std::function<void(Tree)> consumeItem;
+  /// By symbol, whether the children of its node can be streamed, see streamItems().
+  vector<bool> streamable;
 
-Grammar *parseGrammarFile(const string filename) {
-  using std::ifstream, std::cout, std::cerr, std::endl;
+  vector<size_t> states{0};
+  vector<PendingNode> nodes;
+  const ParseTable &table;
+  Tree &tree;
+};
 
-  ifstream file(filename);
-  if (!file.is_open() || !file.good()) {
-    cerr << "ERROR: Failed to read or open ''" << filename << "'!";
-    exit(1);
+/// The operator or `%prec` name at `token`, i.e. a string or an identifier.
+static string precedenceName(const lex::Token &token) {
+  if (token.type != lex::StringLiteral && token.type != lex::Identifier) {
+    reportWithContext(ERROR, token.location(),
+                      "Expected an operator or a name, but got {}!", token);
+    fatalError(1);
   }
+  return string(token.span());
+}
 
-  auto rulesText = slurp(file);
+/// Parse the rules in `rulesText`, without building the parse table. The operators on
+/// `%left` and `%right` lines go into `precedences`.
+static map<string, Rule> parseRules(const string &filename, std::string_view rulesText,
+                                    map<string, Precedence> &precedences) {
+  using std::endl;
 
-  lex::Lexer ruleLexer(filename, rulesText);
+  lex::Lexer ruleLexer(filename, rulesText.data(), rulesText.size());
   lex::Token nextToken;
 
   bool insideRule = false;
@@ -455,14 +1276,33 @@ Grammar *parseGrammarFile(const string filename) {
   set<string> unresolvedRules;
   map<string, Rule> rules;
   Rule *currRule = nullptr;
+  int numLevels = 0;
+  /// The names after `%prec`s, which have to be declared by the end.
+  vector<lex::Token> precedenceUses;
 
   nextToken = ruleLexer.nextToken();
   while (nextToken.type != lex::Eof) {
-    if (!insideRule) {
-      string newRuleName(nextToken.span);
+    if (!insideRule && nextToken.span() == "%") {
+      // %left|%right operator* ;
+      lex::Token kind = ruleLexer.nextToken();
+      if (kind.span() != "left" && kind.span() != "right") {
+        reportWithContext(ERROR, kind.location(),
+                          "Expected %left or %right, but got %{}!", kind.span());
+        fatalError(1);
+      }
 
-      Rule newRule{.name = newRuleName, .alternatives = {}};
+      Precedence precedence{.level = ++numLevels,
+                            .isLeftAssociative = kind.span() == "left"};
+      for (nextToken = ruleLexer.nextToken(); nextToken.span() != ";";
+           nextToken = ruleLexer.nextToken()) {
+        precedences[precedenceName(nextToken)] = precedence;
+      }
+    } else if (!insideRule) {
+      string newRuleName(nextToken.span());
+
+      Rule newRule{.name = newRuleName, .alternatives = {}, .precedences = {}};
       newRule.alternatives.push_back({});
+      newRule.precedences.push_back("");
 
       rules[newRuleName] = newRule;
       currRule = &rules[newRuleName];
@@ -476,14 +1316,26 @@ Grammar *parseGrammarFile(const string filename) {
       auto &alternative = currRule->alternatives.back();
 
       if (nextToken.type == lex::StringLiteral) {
-        Rule::Target newTarget(string(nextToken.span));
+        Rule::Target newTarget(string(nextToken.span()));
         alternative.push_back(newTarget);
-      } else if (nextToken.span == "|") {
+      } else if (nextToken.span() == "|") {
         currRule->alternatives.push_back({});
-      } else if (nextToken.span == ";") {
+        currRule->precedences.push_back("");
+      } else if (nextToken.span() == "%") {
+        // %prec name
+        lex::Token directive = ruleLexer.nextToken();
+        if (directive.span() != "prec") {
+          reportWithContext(ERROR, directive.location(),
+                            "Expected %prec, but got %{}!", directive.span());
+          fatalError(1);
+        }
+        lex::Token name = ruleLexer.nextToken();
+        currRule->precedences.back() = precedenceName(name);
+        precedenceUses.push_back(name);
+      } else if (nextToken.span() == ";") {
         insideRule = false;
       } else if (nextToken.type == lex::Identifier) {
-        auto span = nextToken.span;
+        auto span = nextToken.span();
 
         if (span == "Identifier") {
           alternative.push_back(TT_Identifier);
@@ -512,10 +1364,10 @@ Grammar *parseGrammarFile(const string filename) {
           alternative.push_back(Rule::Target::RuleByName(ruleName));
         }
       } else {
-        reportWithContext(ERROR, nextToken.location,
+        reportWithContext(ERROR, nextToken.location(),
                           "Expected Identifier, StringLiteral, ; or |, but got {}!",
                           nextToken);
-        exit(1);
+        fatalError(1);
       }
     }
 
@@ -523,61 +1375,622 @@ Grammar *parseGrammarFile(const string filename) {
   }
 
   if (unresolvedRules.size() > 0) {
-    cerr << "ERROR: The following rules are still unresolved!" << endl;
+    diagnostics() << "ERROR: The following rules are still unresolved!" << endl;
     for (const auto &ruleName : unresolvedRules) {
-      cerr << "- " << ruleName << endl;
+      diagnostics() << "- " << ruleName << endl;
     }
-    exit(2);
+    fatalError(2);
   }
 
-  return new Grammar{.rules = rules};
+  for (const auto &use : precedenceUses) {
+    if (precedences.count(string(use.span())) == 0) {
+      reportWithContext(ERROR, use.location(),
+                        "'{}' isn't on any %left or %right line!", use.span());
+      fatalError(2);
+    }
+  }
+
+  return rules;
 }
 
-void printNodeTree(const Node &root) {
-  using std::function, std::cout, std::endl;
+static FileContents readGrammarFile(const string &filename) {
+  using std::endl;
 
-  // Helper function for recursive printing
-  function<void(const Node &, const string &, bool)> printNode =
-      [&](const Node &node, const string &prefix, bool isLast) {
-        // Print the current node
-        cout << prefix;
-        cout << (isLast ? "└─ " : "├─ ");
-        cout << (node.isTerminal ? "'" + node.name + "'" : node.name) << endl;
+  auto file = FileContents::read(filename);
+  if (!file.has_value()) {
+    diagnostics() << "ERROR: Failed to read or open '" << filename << "'!" << endl;
+    fatalError(1);
+  }
 
-        // Print children
-        for (size_t i = 0; i < node.children.size(); ++i) {
-          bool childIsLast = (i == node.children.size() - 1);
-          string childPrefix = prefix + (isLast ? "   " : "│  ");
-          printNode(node.children[i], childPrefix, childIsLast);
-        }
-      };
+  return std::move(file.value());
+}
 
+Grammar *parseGrammarFile(const string filename) {
+  auto file = readGrammarFile(filename);
+  std::string_view rulesText = file.text();
+  uint64_t grammarHash = hashGrammarSource(rulesText);
+
+  // Owned here until the table is built, since that can fail too.
+  std::unique_ptr<Grammar> grammar(
+      new Grammar{.rules = {}, .precedences = {}, .table = {}});
+  grammar->rules = parseRules(filename, rulesText, grammar->precedences);
+
+  // Building the table is by far the most expensive part of loading a grammar, so
+  // reuse the one from the last run if grammar.rule hasn't changed since.
+  string cachePath = filename + ".cache";
+  if (auto cached = loadParseTable(cachePath, grammarHash); cached.has_value()) {
+    grammar->table = std::move(cached.value());
+  } else {
+    grammar->table = buildParseTable(*grammar, Table_LALR1);
+    saveParseTable(cachePath, grammarHash, grammar->table);
+  }
+
+  return grammar.release();
+}
+
+Grammar *defaultGrammar() {
+#ifdef TOYCPP_EMBEDDED_PARSE_TABLE
+  return new Grammar{.rules = {}, .precedences = {}, .table = embeddedParseTable()};
+#else
+  return parseGrammarFile("grammar.rule");
+#endif
+}
+
+void generateParseTableHeader(const string grammarFilename,
+                              const string outputFilename, TableKind kind) {
+  using std::cerr, std::endl;
+
+  auto file = readGrammarFile(grammarFilename);
+  std::string_view rulesText = file.text();
+  Grammar grammar{.rules = {}, .precedences = {}, .table = {}};
+  grammar.rules = parseRules(grammarFilename, rulesText, grammar.precedences);
+  auto table = buildParseTable(grammar, kind);
+
+  std::ofstream os(outputFilename, std::ios::trunc);
+  if (!os.is_open()) {
+    cerr << "ERROR: Failed to open '" << outputFilename << "' for writing!" << endl;
+    exit(1);
+  }
+
+  emitParseTableHeader(os, grammarFilename, hashGrammarSource(rulesText), table);
+}
+
+// Lines end with '\n' rather than std::endl - flushing after every node made printing
+// big trees take longer than parsing them.
+static void printName(const Tree &tree, NodeId id, std::ostream &os) {
+  if (tree[id].isTerminal()) {
+    os << "'" << tree.name(id) << "'\n";
+  } else {
+    os << tree.name(id) << '\n';
+  }
+}
+
+/// Print the node `id` below whatever `prefix` continues, and everything below it.
+static void printNode(const Tree &tree, NodeId id, const string &prefix, bool isLast,
+                      std::ostream &os) {
+  // Print the current node
+  os << prefix;
+  os << (isLast ? "└─ " : "├─ ");
+  printName(tree, id, os);
+
+  // Print children
+  string childPrefix = prefix + (isLast ? "   " : "│  ");
+  for (NodeId child = tree[id].firstChild; child != NO_NODE;
+       child = tree[child].nextSibling) {
+    printNode(tree, child, childPrefix, tree[child].nextSibling == NO_NODE, os);
+  }
+}
+
+void printNodeTree(const Tree &tree, std::ostream &os) {
   // Print the root node (without any prefix or connector)
-  std::cout << root.name << std::endl;
+  printName(tree, tree.root, os);
 
   // Print children of root
-  for (size_t i = 0; i < root.children.size(); ++i) {
-    bool isLast = (i == root.children.size() - 1);
-    printNode(root.children[i], "", isLast);
+  for (NodeId child = tree[tree.root].firstChild; child != NO_NODE;
+       child = tree[child].nextSibling) {
+    printNode(tree, child, "", tree[child].nextSibling == NO_NODE, os);
   }
+
+  os.flush();
 }
 
-Node parse(const Grammar *grammar, lex::Lexer &lexer) {
-  using namespace std;
+void TreePrinter::print(Tree item) {
+  start();
+  printHeld(false);
+  _held = std::move(item);
+}
+
+void TreePrinter::finish(const Tree &rest) {
+  start();
+  printHeld(rest[rest.root].firstChild == NO_NODE);
+  for (NodeId child = rest[rest.root].firstChild; child != NO_NODE;
+       child = rest[child].nextSibling) {
+    printNode(rest, child, "", rest[child].nextSibling == NO_NODE, _os);
+  }
+
+  _os.flush();
+}
+
+void TreePrinter::start() {
+  if (_started) return;
+  _started = true;
+
+  // The root is always the start symbol, i.e. what production 0 reduces from.
+  const ParseTable &table = _grammar->table;
+  _os << table.symbols[table.rhsSymbols[table.productions[0].firstSymbol]].str << '\n';
+}
 
-  auto table = buildParseTable(*grammar);
+void TreePrinter::printHeld(bool endsTree) {
+  if (!_held) return;
+
+  const Tree &item = *_held;
+  for (NodeId id = item.root; id != NO_NODE; id = item[id].nextSibling) {
+    printNode(item, id, "", endsTree && item[id].nextSibling == NO_NODE, _os);
+  }
+  _held.reset();
+}
+
+Tree parse(const Grammar *grammar, lex::Lexer &lexer, unsigned numLexThreads) {
+  using namespace std;
 
   using std::ifstream, std::cout, std::cerr, std::endl;
 
-  Parser parser(table);
+  lexer.setTerminals(&grammar->table.terminals);
+  lexer.lexAll(numLexThreads);
+
+  Tree tree;
+  tree.grammar = grammar;
+  Parser parser(grammar->table, tree);
   while (!parser.done()) {
     lex::Token nextToken = lexer.nextToken();
     bool ok = parser.advance(nextToken);
 
-    if (!ok) exit(4);
+    if (!ok) fatalError(4);
+  }
+
+  tree.root = parser.top();
+  tree.tokens = lexer.takeTokens();
+  return tree;
+}
+
+namespace {
+/// Runs a lexer on a thread of its own, which hands the tokens over in batches.
+class LexerThread {
+public:
+  /// How many tokens go in a batch, and how many batches can be waiting at most.
+  static constexpr size_t BATCH_SIZE = 4096;
+  static constexpr size_t MAX_BATCHES = 16;
+
+  explicit LexerThread(lex::Lexer &lexer) : _thread([this, &lexer] { run(lexer); }) {}
+  LexerThread(const LexerThread &) = delete;
+
+  /// Stops the lexer, if it isn't done yet.
+  ~LexerThread() {
+    _batches.close();
+    _thread.join();
+  }
+
+  /// The next token. If the lexer ran into an error, this reports it and exits.
+  lex::Token next() {
+    if (_next == _batch.size()) {
+      auto batch = _batches.pop();
+      if (!batch.has_value()) {
+        diagnostics() << _messages.str();
+        fatalError(_exitCode);
+      }
+      _batch = std::move(batch.value());
+      _next = 0;
+    }
+    return _batch[_next++];
+  }
+
+private:
+  void run(lex::Lexer &lexer) {
+    // The parser reports its own errors as it gets to them, so only pass the lexer's
+    // on once the parser has gotten up to where the lexer gave up.
+    diagnosticStream = &_messages;
+
+    try {
+      bool atEof = false;
+      while (!atEof) {
+        vector<lex::Token> batch;
+        batch.reserve(BATCH_SIZE);
+        while (batch.size() < BATCH_SIZE && !atEof) {
+          batch.push_back(lexer.nextToken());
+          atEof = batch.back().type == lex::Eof;
+        }
+        if (!_batches.push(std::move(batch))) break;
+      }
+    } catch (const FatalError &error) {
+      _exitCode = error.exitCode;
+    }
+    _batches.close();
+  }
+
+  BoundedQueue<vector<lex::Token>> _batches{MAX_BATCHES};
+  std::ostringstream _messages;
+  int _exitCode = 0;
+
+  /// The batch the parser is taking tokens from.
+  vector<lex::Token> _batch;
+  size_t _next = 0;
+
+  std::thread _thread;
+};
+} // namespace
+
+Tree parseStreaming(const Grammar *grammar, lex::Lexer &lexer,
+                    const std::function<void(Tree)> &consume) {
+  lexer.setTerminals(&grammar->table.terminals);
+
+  Tree tree;
+  tree.grammar = grammar;
+  Parser parser(grammar->table, tree);
+  parser.streamItems(consume);
+
+  LexerThread tokens(lexer);
+  while (!parser.done()) {
+    if (!parser.advance(tokens.next())) fatalError(4);
+  }
+
+  tree.root = parser.top();
+  return tree;
+}
+
+namespace {
+/// A run of tokens that relex() copied over unchanged: old tokens [oldFirst, oldEnd)
+/// are new tokens from newFirst on.
+struct ReusedTokens {
+  uint32_t oldFirst;
+  uint32_t oldEnd;
+  uint32_t newFirst;
+};
+
+/// Work out the tokens of the new source code from `old`, the tokens of the old one.
+/// Tokens far enough from every edit are copied (moved by however much the edits
+/// before them grew or shrank the source), and `lexer` only lexes from the last one
+/// before an edit until it's back in step with the old tokens after it.
+lex::TokenBuffer relex(const lex::TokenBuffer &old, lex::Lexer &lexer,
+                       const vector<Edit> &edits, vector<ReusedTokens> &reused) {
+  lex::TokenBuffer tokens(lexer.file());
+  tokens.reserve(old.size());
+
+  // How far tokens after the edits applied so far moved.
+  int64_t delta = 0;
+  size_t nextEdit = 0;
+  size_t i = 0;
+
+  // Copy old tokens [first, end) over.
+  auto keep = [&](size_t first, size_t end) {
+    if (first == end) return;
+
+    // An edit that only touched whitespace or comments leaves the run going.
+    if (!reused.empty() && reused.back().oldEnd == first &&
+        reused.back().newFirst + (first - reused.back().oldFirst) == tokens.size()) {
+      reused.back().oldEnd = end;
+    } else {
+      reused.push_back({uint32_t(first), uint32_t(end), uint32_t(tokens.size())});
+    }
+    tokens.types.insert(tokens.types.end(), old.types.begin() + first,
+                        old.types.begin() + end);
+    tokens.lengths.insert(tokens.lengths.end(), old.lengths.begin() + first,
+                          old.lengths.begin() + end);
+    tokens.symbols.insert(tokens.symbols.end(), old.symbols.begin() + first,
+                          old.symbols.begin() + end);
+    for (size_t k = first; k < end; k++) {
+      tokens.offsets.push_back(old.offsets[k] + delta);
+    }
+  };
+
+  auto applyEdit = [&](int64_t &damagedUntil) {
+    const Edit &edit = edits[nextEdit++];
+    damagedUntil = std::max(damagedUntil, int64_t(edit.offset) + edit.oldLength);
+    delta += int64_t(edit.newLength) - edit.oldLength;
+  };
+
+  while (i < old.size()) {
+    int64_t editOffset = nextEdit < edits.size() ? edits[nextEdit].offset : INT64_MAX;
+    size_t first = i;
+    while (i < old.size() &&
+           int64_t(old.offsets[i]) + old.lengths[i] + lex::MAX_TOKEN_LOOKAHEAD <=
+               editOffset) {
+      i++;
+    }
+    keep(first, i);
+    if (i == old.size()) break;
+
+    // Relex from the end of the last token that's still good. Everything before
+    // `damagedUntil` in the old source code might have changed.
+    int64_t damagedUntil = 0;
+    applyEdit(damagedUntil);
+    lexer.seek(tokens.size() > 0 ? tokens.offsets.back() + tokens.lengths.back() : 0);
+
+    while (true) {
+      lex::Token token = lexer.nextToken();
+      while (nextEdit < edits.size() &&
+             int64_t(token.offset) + token.length + lex::MAX_TOKEN_LOOKAHEAD >
+                 int64_t(edits[nextEdit].offset) + delta) {
+        applyEdit(damagedUntil);
+      }
+
+      if (token.type == lex::Eof) {
+        tokens.push_back(token);
+        return tokens;
+      }
+
+      // Past the damage, lexing from the start of an old token gives the old tokens
+      // again, so copy those instead.
+      int64_t oldOffset = int64_t(token.offset) - delta;
+      if (oldOffset >= damagedUntil) {
+        i = std::lower_bound(old.offsets.begin() + i, old.offsets.end(), oldOffset) -
+            old.offsets.begin();
+        if (i < old.size() && old.offsets[i] == oldOffset) break;
+      }
+
+      tokens.push_back(token);
+    }
   }
 
-  return parser.top();
+  return tokens;
+}
+
+/// The state in the NodeHistory of nodes that reparse() can't reuse.
+constexpr uint32_t NOT_REUSABLE = UINT32_MAX;
+
+/// Walks the old tree in step with reparse(), finding the nodes that start at each
+/// token. Nodes get relinked once they're reused, so this has to be told to move past
+/// them before that happens.
+class ReusableNodes {
+public:
+  explicit ReusableNodes(const Tree &tree) : tree(tree) { path.push_back(tree.root); }
+
+  /// The outermost node that starts at token `token`, or NO_NODE. The tokens asked
+  /// about must only ever increase.
+  NodeId at(uint32_t token) {
+    while (!path.empty()) {
+      NodeId id = path.back();
+      const NodeHistory &history = tree.history[id];
+
+      if (history.endToken <= token) {
+        // Done with this node. Its parent ends where its last child does, so if this
+        // was the last one, the parent gets popped next.
+        next();
+      } else if (history.firstToken == token) {
+        return id;
+      } else if (history.firstToken > token || tree[id].firstChild == NO_NODE) {
+        return NO_NODE;
+      } else {
+        path.push_back(tree[id].firstChild);
+      }
+    }
+
+    return NO_NODE;
+  }
+
+  /// Go from the node at() returned to the next one inside it that starts at the same
+  /// token (its first child that isn't empty). Returns NO_NODE once there are none.
+  NodeId inner() {
+    NodeId child = tree[path.back()].firstChild;
+    while (child != NO_NODE &&
+           tree.history[child].firstToken == tree.history[child].endToken) {
+      child = tree[child].nextSibling;
+    }
+
+    if (child != NO_NODE) path.push_back(child);
+    return child;
+  }
+
+  /// Move past the node at() or inner() returned last, and its next siblings up to
+  /// `last`.
+  void skip(NodeId last) {
+    NodeId id;
+    do {
+      id = path.back();
+      next();
+    } while (id != last);
+  }
+
+private:
+  void next() {
+    NodeId sibling = tree[path.back()].nextSibling;
+    path.pop_back();
+    if (sibling != NO_NODE) path.push_back(sibling);
+  }
+
+  const Tree &tree;
+  /// The node being looked at, and (below it) where to carry on once it's done.
+  vector<NodeId> path;
+};
+
+/// Move the nodes of `tree` over to the tokens relex() made out of `oldNumTokens` old
+/// ones, and mark the nodes whose tokens or lookahead changed as not reusable.
+void remapTokens(Tree &tree, size_t oldNumTokens, const vector<ReusedTokens> &reused,
+                 size_t newNumTokens) {
+  constexpr uint32_t NOT_REUSED = UINT32_MAX;
+
+  // Where each old token ended up (for relexed ones, where the next reused one did),
+  // and which run of reused tokens it's in.
+  vector<uint32_t> newIndex(oldNumTokens + 1, newNumTokens);
+  vector<uint32_t> runs(oldNumTokens + 1, NOT_REUSED);
+  size_t k = 0;
+  for (uint32_t run = 0; run < reused.size(); run++) {
+    for (; k < reused[run].oldFirst; k++) newIndex[k] = reused[run].newFirst;
+    for (; k < reused[run].oldEnd; k++) {
+      newIndex[k] = reused[run].newFirst + (k - reused[run].oldFirst);
+      runs[k] = run;
+    }
+  }
+
+  // Nothing about the nodes before the first change changes.
+  uint32_t unchangedUntil = 0;
+  if (!reused.empty() && reused[0].oldFirst == 0 && reused[0].newFirst == 0) {
+    unchangedUntil = reused[0].oldEnd;
+  }
+
+  for (NodeId id = 0; id < tree.nodes.size(); id++) {
+    NodeHistory &history = tree.history[id];
+    if (history.endToken < unchangedUntil) continue;
+
+    // A node can be pushed again only if none of its tokens changed, and neither did
+    // the lookahead after it that made the parser reduce it.
+    uint32_t run = runs[history.firstToken];
+    if (run == NOT_REUSED || runs[history.endToken] != run) {
+      history.state = NOT_REUSABLE;
+    }
+
+    history.firstToken = newIndex[history.firstToken];
+    history.endToken = newIndex[history.endToken];
+    if (tree.nodes[id].isTerminal()) tree.nodes[id].token = history.firstToken;
+  }
+}
+
+/// Drop the nodes of `tree` that aren't reachable from its root anymore - the ones
+/// reparse() replaced - once there are at least as many of them as there are reachable
+/// ones. The rest keep their order. Compacting only then keeps the array within twice
+/// the size of the tree, at an amortized cost of O(1) per node.
+void collectGarbage(Tree &tree) {
+  constexpr NodeId UNREACHABLE = NO_NODE;
+
+  vector<NodeId> newIds(tree.nodes.size(), UNREACHABLE);
+  vector<NodeId> pending{tree.root};
+  size_t numReachable = 0;
+  while (!pending.empty()) {
+    NodeId id = pending.back();
+    pending.pop_back();
+    newIds[id] = 0;
+    numReachable++;
+    for (NodeId child = tree[id].firstChild; child != NO_NODE;
+         child = tree[child].nextSibling) {
+      pending.push_back(child);
+    }
+  }
+  if (tree.nodes.size() - numReachable < numReachable) return;
+
+  NodeId next = 0;
+  for (NodeId &newId : newIds) {
+    if (newId != UNREACHABLE) newId = next++;
+  }
+  auto remap = [&](NodeId id) { return id == NO_NODE ? NO_NODE : newIds[id]; };
+
+  for (NodeId id = 0; id < tree.nodes.size(); id++) {
+    if (newIds[id] == UNREACHABLE) continue;
+
+    Node node = tree.nodes[id];
+    node.firstChild = remap(node.firstChild);
+    node.nextSibling = remap(node.nextSibling);
+    NodeHistory history = tree.history[id];
+    history.itemEnd = remap(history.itemEnd);
+
+    tree.nodes[newIds[id]] = node;
+    tree.history[newIds[id]] = history;
+  }
+  tree.nodes.resize(numReachable);
+  tree.history.resize(numReachable);
+  tree.root = newIds[tree.root];
+}
+} // namespace
+
+Tree reparse(const Grammar *grammar, Tree old, lex::Lexer &lexer,
+             const vector<Edit> &edits) {
+  if (old.grammar != grammar || old.root == NO_NODE ||
+      old.history.size() != old.nodes.size()) {
+    return parse(grammar, lexer);
+  }
+
+  lexer.setTerminals(&grammar->table.terminals);
+  vector<ReusedTokens> reused;
+  lex::TokenBuffer tokens = relex(old.tokens, lexer, edits, reused);
+
+  // The new tree gets built right on top of the old one, so reused nodes stay where
+  // they are. The ones that didn't make it are left unreachable, until there are
+  // enough of them for collectGarbage() to drop them.
+  Tree tree = std::move(old);
+  remapTokens(tree, tree.tokens.size(), reused, tokens.size());
+
+  std::string_view text = lex::sourceFile(lexer.file()).text();
+  tree.spans.resize(tokens.size());
+  for (size_t i = 0; i < tokens.size(); i++) {
+    // Like Token::span(), without looking the file up every time.
+    bool quoted =
+        tokens.types[i] == lex::StringLiteral || tokens.types[i] == lex::CharLiteral;
+    tree.spans[i] = std::string_view(text.data() + tokens.offsets[i] + quoted,
+                                     tokens.lengths[i] - 2 * quoted);
+  }
+
+  Parser parser(grammar->table, tree);
+  ReusableNodes reusable(tree);
+  const NodeId firstNewNode = tree.nodes.size();
+
+  size_t i = 0;
+  while (!parser.done()) {
+    // Past the end, the lookahead stays Eof, like it would from the lexer.
+    lex::Token lookahead = tokens[std::min(i, tokens.size() - 1)];
+    NodeId candidate = i < tokens.size() ? reusable.at(i) : NO_NODE;
+
+    bool pushed = false;
+    if (candidate != NO_NODE) {
+      if (!parser.reduceBefore(lookahead)) fatalError(4);
+      if (parser.done()) break;
+
+      for (NodeId id = candidate; id != NO_NODE; id = reusable.inner()) {
+        const NodeHistory &history = tree.history[id];
+        if (history.state != parser.currState()) continue;
+
+        // All of an item of a list can go straight into the list being built, without
+        // pushing and reducing anything.
+        if (history.itemEnd != NO_NODE) {
+          NodeId last = id;
+          while (last != NO_NODE && last != history.itemEnd &&
+                 tree.history[last].state != NOT_REUSABLE) {
+            last = tree[last].nextSibling;
+          }
+
+          if (last == history.itemEnd && tree.history[last].state != NOT_REUSABLE) {
+            uint32_t numTokens = tree.history[last].endToken - history.firstToken;
+            reusable.skip(last);
+            parser.appendItem(id, last, numTokens);
+            i += numTokens;
+            pushed = true;
+            break;
+          }
+        }
+
+        // Otherwise a node can be pushed again if it's in the same state as last time,
+        // and neither its tokens nor the lookahead that ended it changed.
+        if (tree[id].isTerminal()) break;
+
+        PendingNode node{id};
+        for (NodeId child = tree[id].firstChild; child != NO_NODE;
+             child = tree[child].nextSibling) {
+          node.lastChild = child;
+        }
+
+        uint32_t numTokens = history.endToken - history.firstToken;
+        reusable.skip(id);
+        tree.nodes[id].nextSibling = NO_NODE;
+        parser.push(node, tree[id].symbol, numTokens);
+        i += numTokens;
+        pushed = true;
+        break;
+      }
+    }
+
+    if (pushed) continue;
+    if (!parser.advance(lookahead)) fatalError(4);
+    i++;
+  }
+
+  // The leaves shifted just now got their text appended to the spans. Like the rest,
+  // they should point at their token's instead, for the next reparse().
+  for (NodeId id = firstNewNode; id < tree.nodes.size(); id++) {
+    if (tree.nodes[id].isTerminal()) tree.nodes[id].token = tree.history[id].firstToken;
+  }
+  tree.spans.resize(tokens.size());
+
+  tree.root = parser.top();
+  tree.tokens = std::move(tokens);
+  collectGarbage(tree);
+  return tree;
 }
 
 template<typename K, typename V>
@@ -600,17 +2013,6 @@ std::ostream &operator<<(std::ostream &os, const map<K, V> &map) {
   return os;
 }
 
-template<typename T>
-std::ostream &operator<<(std::ostream &os, const vector<T> &vector) {
-  os << "[";
-  for (size_t i = 0; i < vector.size(); i++) {
-    os << vector[i];
-    if (i < vector.size() - 1) os << ", ";
-  }
-  os << "]";
-  return os;
-}
-
 template<typename T>
 std::ostream &operator<<(std::ostream &os, const set<T> &set) {
   if (set.empty()) {
@@ -639,22 +2041,6 @@ std::ostream &operator<<(std::ostream &os, const grammar::Rule::Target &target)
   return os;
 }
 
-std::ostream &operator<<(std::ostream &os, const grammar::DottedRule &rule) {
-  os << rule.ruleName << " ->";
-  for (size_t i = 0; i < rule.alternative->size(); i++) {
-    if (rule.dotPosition == i) {
-      os << " 💠";
-    }
-    const auto &target = (*rule.alternative)[i];
-    os << " " << target;
-  }
-
-  if (rule.dotPosition >= rule.alternative->size()) {
-    os << " 💠";
-  }
-  return os;
-}
-
 std::ostream &operator<<(std::ostream &os, grammar::TerminalToken token) {
   switch (token) {
   case grammar::TT_Invalid       : os << "<?invalid-token?>"; break;
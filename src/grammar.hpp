@@ -2,21 +2,163 @@
 
 #include "lex.hpp"
 
+#include <cstdint>
+#include <functional>
+#include <iostream>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace grammar {
 using std::string, std::vector, std::optional;
 
 struct Grammar;
+
+/// Which lookaheads the parse table uses to decide when to reduce.
+enum TableKind {
+  Table_SLR1,
+  Table_LALR1,
+  /// Canonical LR(1) - more states than LALR(1), but no conflicts from merging them.
+  Table_CanonicalLR1,
+};
+
+/// Index of a node in Tree::nodes.
+using NodeId = uint32_t;
+constexpr NodeId NO_NODE = UINT32_MAX;
+
 struct Node {
-  string name;
-  vector<Node> children;
-  bool isTerminal = false;
+  /// The grammar symbol of the rule this node was reduced to, or for leaves, of the
+  /// terminal that was shifted.
+  int32_t symbol;
+  /// For leaves, the index of the token's text in Tree::spans, NO_NODE otherwise.
+  uint32_t token = NO_NODE;
+
+  NodeId firstChild = NO_NODE;
+  NodeId nextSibling = NO_NODE;
+
+  inline bool isTerminal() const { return token != NO_NODE; }
+};
+
+/// What the parser knew about a node when it pushed it, which is what reparse() needs
+/// to tell whether it can push the same node again.
+struct NodeHistory {
+  /// The LR state on top of the stack right before the node was pushed.
+  uint32_t state;
+  /// The tokens the node covers are [firstToken, endToken) - empty nodes cover none.
+  uint32_t firstToken;
+  uint32_t endToken;
+  /// If this node was the first of the ones a left-recursive list got extended with
+  /// (`list -> list item`), the last of them.
+  NodeId itemEnd = NO_NODE;
+};
+
+/// A concrete syntax tree. All of its nodes live in one array and refer to each other
+/// by index, so building one doesn't allocate per node, and it's freed all at once.
+///
+/// The token text of the leaves points into the parsed source code, so the tree must
+/// not outlive it.
+struct Tree {
+  const Grammar *grammar = nullptr;
+  NodeId root = NO_NODE;
+
+  vector<Node> nodes;
+  vector<std::string_view> spans;
+
+  /// Every token of the source code, in order, including the Eof at the end.
+  lex::TokenBuffer tokens;
+  /// Indexed by NodeId, and only filled in by parse(), for reparse().
+  vector<NodeHistory> history;
+
+  inline const Node &operator[](NodeId id) const { return nodes[id]; }
+
+  /// The text of a leaf, or the name of the rule for any other node.
+  std::string_view name(NodeId id) const;
 };
 
 extern Grammar *parseGrammarFile(const string filename);
-extern Node parse(const Grammar *grammar, lex::Lexer &lexer);
-extern void printNodeTree(const Node &root);
+
+/// The grammar toycpp was built with: the parse table compiled into the binary if
+/// there is one, otherwise "grammar.rule" from the current directory.
+extern Grammar *defaultGrammar();
+
+/// Build the parse table for `grammarFilename` and write it to `outputFilename` as a
+/// C++ header of constexpr arrays (see TOYCPP_EMBEDDED_PARSE_TABLE).
+extern void generateParseTableHeader(const string grammarFilename,
+                                     const string outputFilename,
+                                     TableKind kind = Table_LALR1);
+
+/// Parse everything `lexer` has left. The input gets lexed up front first, in chunks
+/// on up to `numLexThreads` threads if it's big enough.
+extern Tree parse(const Grammar *grammar, lex::Lexer &lexer,
+                  unsigned numLexThreads = 1);
+
+/// Parse everything `lexer` has left like parse() does, but hand every item of the
+/// top-level list (for toycpp, every function and global variable) to `consume` as soon
+/// as it's been reduced, and forget about it. That way only one item at a time has to
+/// fit in memory, however long the file is. `lexer` runs on a thread of its own,
+/// staying a little ahead of the parser.
+///
+/// Each item is a tree of its own, whose root is the item's first node, followed by
+/// the rest of its nodes as its next siblings. They all get handed over on the calling
+/// thread. What's returned is the rest: the root of the whole tree, with whatever
+/// children weren't handed over (e.g. the Eof) - put together, that's the tree parse()
+/// builds. If the input has an error, the items before it will have been handed over
+/// already.
+extern Tree parseStreaming(const Grammar *grammar, lex::Lexer &lexer,
+                           const std::function<void(Tree)> &consume);
+
+/// A change to the source code: the `oldLength` bytes at `offset` were replaced with
+/// `newLength` new ones.
+struct Edit {
+  uint32_t offset;
+  uint32_t oldLength;
+  uint32_t newLength;
+};
+
+/// Parse the source code `lexer` reads, which is what `old` was parsed from with
+/// `edits` applied. The edits use offsets into the old source code, and have to be
+/// sorted and not overlap. Only the tokens near an edit get lexed again, and every
+/// subtree of `old` whose tokens didn't change gets pushed onto the stack whole when
+/// the parser gets to it in the same state as last time, instead of being parsed
+/// token by token again.
+///
+/// The result is the same as parse() would build. Trees from parseGLR() can't be
+/// reused, so those get parsed from scratch.
+extern Tree reparse(const Grammar *grammar, Tree old, lex::Lexer &lexer,
+                    const vector<Edit> &edits);
+
+/// Like parse(), but with a GLR parser that explores every alternative wherever the
+/// grammar is ambiguous, instead of relying on how the table resolved its conflicts.
+/// Where the input really is ambiguous, it builds the tree parse() would have.
+extern Tree parseGLR(const Grammar *grammar, lex::Lexer &lexer,
+                     unsigned numLexThreads = 1);
+extern void printNodeTree(const Tree &tree, std::ostream &os = std::cout);
+
+/// Prints the tree parseStreaming() builds a piece at a time, as the items are handed
+/// over, the same way printNodeTree() would print all of it.
+class TreePrinter {
+public:
+  TreePrinter(const Grammar *grammar, std::ostream &os) : _grammar(grammar), _os(os) {}
+
+  /// Print an item from parseStreaming(). The last one is held on to until the next
+  /// one comes along, since it's only clear then which of its nodes is the last child.
+  void print(Tree item);
+
+  /// Print the rest of the tree that parseStreaming() returned, and flush.
+  void finish(const Tree &rest);
+
+private:
+  /// Print the root's name, unless it already has been.
+  void start();
+
+  /// Print the nodes of the held item, if there is one, where `endsTree` says whether
+  /// nothing else comes after them.
+  void printHeld(bool endsTree);
+
+  const Grammar *_grammar;
+  std::ostream &_os;
+  bool _started = false;
+  optional<Tree> _held;
+};
 } // namespace grammar
@@ -0,0 +1,304 @@
+#include "ir.hpp"
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+namespace ir {
+using std::endl;
+
+void computeCfg(Function &function) {
+  for (Block &block : function.blocks) {
+    block.preds.clear();
+    block.succs.clear();
+  }
+
+  for (BlockId b = 0; b < function.blocks.size(); b++) {
+    if (function.blocks[b].instructions.empty()) continue;
+
+    const Instruction &terminator = function.terminator(b);
+    if (!terminator.isTerminator()) continue;
+
+    for (BlockId target : terminator.targets) {
+      function.blocks[b].succs.push_back(target);
+      function.blocks[target].preds.push_back(b);
+    }
+  }
+}
+
+vector<BlockId> reversePostorder(const Function &function) {
+  vector<BlockId> postorder;
+  vector<bool> visited(function.blocks.size());
+
+  // Blocks along with how many of their successors have been visited so far.
+  vector<std::pair<BlockId, size_t>> stack{{0, 0}};
+  visited[0] = true;
+  while (!stack.empty()) {
+    auto &[block, next] = stack.back();
+    const vector<BlockId> &succs = function.blocks[block].succs;
+
+    if (next == succs.size()) {
+      postorder.push_back(block);
+      stack.pop_back();
+      continue;
+    }
+
+    BlockId succ = succs[next++];
+    if (!visited[succ]) {
+      visited[succ] = true;
+      stack.push_back({succ, 0});
+    }
+  }
+
+  return vector<BlockId>(postorder.rbegin(), postorder.rend());
+}
+
+void computeDominators(Function &function) {
+  vector<BlockId> order = reversePostorder(function);
+
+  // Each block's index in `order`, which is what the intersection walks up by.
+  vector<uint32_t> rpoIndex(function.blocks.size(), NONE);
+  for (uint32_t i = 0; i < order.size(); i++) rpoIndex[order[i]] = i;
+
+  for (Block &block : function.blocks) block.idom = NONE;
+  function.blocks[0].idom = 0;
+
+  auto intersect = [&](BlockId a, BlockId b) {
+    while (a != b) {
+      while (rpoIndex[a] > rpoIndex[b]) a = function.blocks[a].idom;
+      while (rpoIndex[b] > rpoIndex[a]) b = function.blocks[b].idom;
+    }
+    return a;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (BlockId b : order) {
+      if (b == 0) continue;
+
+      BlockId idom = NONE;
+      for (BlockId pred : function.blocks[b].preds) {
+        if (function.blocks[pred].idom == NONE) continue;
+        idom = idom == NONE ? pred : intersect(pred, idom);
+      }
+
+      if (function.blocks[b].idom != idom) {
+        function.blocks[b].idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  function.blocks[0].idom = NONE;
+}
+
+bool dominates(const Function &function, BlockId a, BlockId b) {
+  for (; b != NONE; b = function.blocks[b].idom) {
+    if (b == a) return true;
+  }
+  return false;
+}
+
+void splitCriticalEdges(Function &function) {
+  const size_t numBlocks = function.blocks.size();
+  for (BlockId b = 0; b < numBlocks; b++) {
+    if (function.blocks[b].succs.size() < 2) continue;
+
+    ValueId terminator = function.blocks[b].instructions.back();
+    for (size_t i = 0; i < function.values[terminator].targets.size(); i++) {
+      BlockId succ = function.values[terminator].targets[i];
+      if (function.blocks[succ].preds.size() < 2) continue;
+
+      // Reroute the edge through a new block that just jumps on.
+      BlockId split = function.blocks.size();
+      ValueId jump = function.values.size();
+      function.values.push_back(
+          Instruction{.op = Opcode::Jump, .block = split, .targets = {succ}});
+      function.blocks.push_back(
+          Block{.instructions = {jump}, .preds = {b}, .succs = {succ}});
+
+      function.values[terminator].targets[i] = split;
+      function.blocks[b].succs[i] = split;
+
+      // If a block branches to the same place either way, that's two edges, so only
+      // reroute one of them at a time.
+      Block &target = function.blocks[succ];
+      *std::find(target.preds.begin(), target.preds.end(), b) = split;
+      for (ValueId id : target.instructions) {
+        Instruction &phi = function.values[id];
+        if (phi.op != Opcode::Phi) break;
+        *std::find(phi.targets.begin(), phi.targets.end(), b) = split;
+      }
+    }
+  }
+}
+
+bool verify(const Function &function) {
+  bool ok = true;
+  auto fail = [&](BlockId block, const string &what) {
+    diagnostics() << color::boldred("ERROR") << ": Invalid IR in " << function.name
+                  << ", bb" << block << ": " << what << endl;
+    ok = false;
+  };
+
+  // Where every instruction is in its block.
+  vector<uint32_t> indexInBlock(function.values.size(), NONE);
+  for (const Block &block : function.blocks) {
+    for (uint32_t i = 0; i < block.instructions.size(); i++) {
+      indexInBlock[block.instructions[i]] = i;
+    }
+  }
+
+  for (BlockId b : reversePostorder(function)) {
+    const Block &block = function.blocks[b];
+    if (block.instructions.empty() || !function.terminator(b).isTerminator()) {
+      fail(b, "doesn't end in a terminator");
+      continue;
+    }
+
+    for (uint32_t i = 0; i < block.instructions.size(); i++) {
+      ValueId id = block.instructions[i];
+      const Instruction &instruction = function[id];
+      if (instruction.block != b) fail(b, format("%{} thinks it's elsewhere", id));
+      if (instruction.isTerminator() && i + 1 != block.instructions.size()) {
+        fail(b, format("%{} is a terminator in the middle", id));
+      }
+
+      if (instruction.op == Opcode::Phi) {
+        if (i > 0 && function[block.instructions[i - 1]].op != Opcode::Phi) {
+          fail(b, format("%{} comes after something that isn't a phi", id));
+        }
+
+        vector<BlockId> from = instruction.targets, preds = block.preds;
+        std::sort(from.begin(), from.end());
+        std::sort(preds.begin(), preds.end());
+        if (from != preds || instruction.operands.size() != from.size()) {
+          fail(b, format("%{} doesn't have an operand per predecessor", id));
+          continue;
+        }
+      }
+
+      for (size_t k = 0; k < instruction.operands.size(); k++) {
+        ValueId operand = instruction.operands[k];
+        if (operand >= function.values.size() || function[operand].type == Type::Void ||
+            indexInBlock[operand] == NONE) {
+          fail(b, format("%{} uses %{}, which isn't a value", id, operand));
+          continue;
+        }
+
+        // A phi's operands only have to be there by the end of their predecessor.
+        BlockId def = function[operand].block;
+        bool isDominated;
+        if (instruction.op == Opcode::Phi) {
+          isDominated = dominates(function, def, instruction.targets[k]);
+        } else if (def == b) {
+          isDominated = indexInBlock[operand] < i;
+        } else {
+          isDominated = dominates(function, def, b);
+        }
+        if (!isDominated) {
+          fail(b, format("%{} uses %{} where it might not be defined", id, operand));
+        }
+      }
+    }
+  }
+
+  return ok;
+}
+
+static const char *typeName(Type type) {
+  switch (type) {
+  case Type::Void: return "void";
+  case Type::I8  : return "i8";
+  case Type::I32 : return "i32";
+  }
+  return "?";
+}
+
+static const char *opcodeName(Opcode op) {
+  switch (op) {
+  case Opcode::Const             : return "const";
+  case Opcode::Undef             : return "undef";
+  case Opcode::Param             : return "param";
+  case Opcode::Add               : return "add";
+  case Opcode::Sub               : return "sub";
+  case Opcode::Mul               : return "mul";
+  case Opcode::Div               : return "div";
+  case Opcode::Mod               : return "mod";
+  case Opcode::Equal             : return "eq";
+  case Opcode::NotEqual          : return "ne";
+  case Opcode::LessThan          : return "lt";
+  case Opcode::GreaterThan       : return "gt";
+  case Opcode::LessThanOrEqual   : return "le";
+  case Opcode::GreaterThanOrEqual: return "ge";
+  case Opcode::Negate            : return "neg";
+  case Opcode::Not               : return "not";
+  case Opcode::Trunc             : return "trunc";
+  case Opcode::SExt              : return "sext";
+  case Opcode::Phi               : return "phi";
+  case Opcode::Call              : return "call";
+  case Opcode::InlineAsm         : return "asm";
+  case Opcode::Jump              : return "jump";
+  case Opcode::Branch            : return "branch";
+  case Opcode::Return            : return "return";
+  }
+  return "?";
+}
+
+void print(const Function &function, ValueId id, std::ostream &os) {
+  const Instruction &instruction = function[id];
+  if (instruction.type != Type::Void) {
+    os << "%" << id << " = " << typeName(instruction.type) << " ";
+  }
+  os << opcodeName(instruction.op);
+
+  if (instruction.op == Opcode::Const || instruction.op == Opcode::Param) {
+    os << " " << instruction.imm;
+  } else if (instruction.op == Opcode::Call) {
+    os << " " << instruction.text;
+  } else if (instruction.op == Opcode::InlineAsm) {
+    os << " \"" << instruction.text << "\"";
+  }
+
+  for (size_t k = 0; k < instruction.operands.size(); k++) {
+    os << (k > 0 ? ", " : " ") << "%" << instruction.operands[k];
+    if (instruction.op == Opcode::Phi) os << " from bb" << instruction.targets[k];
+  }
+  if (instruction.op != Opcode::Phi) {
+    for (size_t k = 0; k < instruction.targets.size(); k++) {
+      os << (k > 0 || !instruction.operands.empty() ? ", " : " ") << "bb"
+         << instruction.targets[k];
+    }
+  }
+}
+
+void print(const Function &function, std::ostream &os) {
+  os << typeName(function.returnType) << " " << function.name << "(";
+  for (size_t i = 0; i < function.paramTypes.size(); i++) {
+    if (i > 0) os << ", ";
+    os << typeName(function.paramTypes[i]);
+  }
+  os << "):\n";
+
+  for (BlockId b = 0; b < function.blocks.size(); b++) {
+    os << "bb" << b << ":";
+    if (!function.blocks[b].preds.empty()) {
+      os << "  ; from";
+      for (BlockId pred : function.blocks[b].preds) os << " bb" << pred;
+    }
+    os << "\n";
+
+    for (ValueId id : function.blocks[b].instructions) {
+      os << "  ";
+      print(function, id, os);
+      os << "\n";
+    }
+  }
+  for (const string &text : function.unreachableAsm) {
+    os << "unreachable: asm \"" << text << "\"\n";
+  }
+}
+} // namespace ir
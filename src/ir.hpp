@@ -0,0 +1,176 @@
+#pragma once
+
+#include "ast.hpp"
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The intermediate representation between the AST and assembly: functions made of
+// basic blocks of instructions in SSA form, i.e. every value is defined by exactly one
+// instruction, and where control flow merges, phi instructions pick the value that
+// came from the predecessor that was taken.
+
+namespace ir {
+using std::string, std::vector;
+
+enum class Type : uint8_t {
+  Void,
+  /// Kept sign-extended to 32 bits wherever it's held, so using one as an I32 (see
+  /// Opcode::SExt) doesn't take any work.
+  I8,
+  I32,
+};
+
+enum class Opcode : uint8_t {
+  /// `imm`.
+  Const,
+  /// Whatever happened to be there, e.g. a variable that's read before it's assigned.
+  Undef,
+  /// The function's parameter number `imm`.
+  Param,
+
+  // Arithmetic, on two I32s. Div and Mod round towards zero, like C++.
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Mod,
+
+  // Comparisons of two I32s, which are 1 if they hold and 0 otherwise.
+  Equal,
+  NotEqual,
+  LessThan,
+  GreaterThan,
+  LessThanOrEqual,
+  GreaterThanOrEqual,
+
+  Negate,
+  /// 1 if the operand is 0, 0 otherwise.
+  Not,
+
+  /// The lower 8 bits of an I32, or an I8 as an I32.
+  Trunc,
+  SExt,
+
+  /// One operand per predecessor of the block, with `targets` saying which is which.
+  Phi,
+
+  /// Call the function named `text`. The result is whatever it returned.
+  Call,
+  /// Put `text` into the output as is. As far as the IR knows, it could do anything.
+  InlineAsm,
+
+  // Terminators - exactly one of these ends every block.
+
+  /// Go to targets[0].
+  Jump,
+  /// Go to targets[0] if the operand isn't 0, otherwise to targets[1].
+  Branch,
+  /// Return the operand, if there is one.
+  Return,
+};
+
+/// Index of a value (the instruction that defines it) in Function::values.
+using ValueId = uint32_t;
+/// Index of a block in Function::blocks.
+using BlockId = uint32_t;
+
+constexpr uint32_t NONE = UINT32_MAX;
+
+struct Instruction {
+  Opcode op;
+  /// The type of the value this defines, Void if it doesn't define one.
+  Type type = Type::Void;
+  /// The block it's in.
+  BlockId block = NONE;
+
+  /// For Const, the value, for Param the parameter's number.
+  int32_t imm = 0;
+  vector<ValueId> operands = {};
+  /// For Jump and Branch, the blocks they go to. For Phi, the predecessor each operand
+  /// comes from.
+  vector<BlockId> targets = {};
+  /// For Call the function's name, for InlineAsm the assembly.
+  string text = {};
+
+  inline bool isTerminator() const {
+    return op == Opcode::Jump || op == Opcode::Branch || op == Opcode::Return;
+  }
+};
+
+struct Block {
+  /// In order, phis first and the terminator last.
+  vector<ValueId> instructions;
+
+  /// Filled in by computeCfg().
+  vector<BlockId> preds;
+  vector<BlockId> succs;
+
+  /// The immediate dominator, filled in by computeDominators(). NONE for the entry
+  /// block and blocks that can't be reached.
+  BlockId idom = NONE;
+};
+
+struct Function {
+  string name;
+  Type returnType = Type::Void;
+  vector<Type> paramTypes;
+
+  /// Every instruction of the function, whether it defines a value or not.
+  vector<Instruction> values;
+  /// The entry block is the first one.
+  vector<Block> blocks;
+  /// Inline assembly that can't be reached, e.g. after a return. It never runs, but
+  /// it can define labels or data that the rest refers to, so it goes after the code
+  /// of the function as is, rather than into a block that nothing would emit.
+  vector<string> unreachableAsm;
+
+  inline const Instruction &operator[](ValueId id) const { return values[id]; }
+  inline Instruction &operator[](ValueId id) { return values[id]; }
+
+  /// The terminator of `block`.
+  inline const Instruction &terminator(BlockId block) const {
+    return values[blocks[block].instructions.back()];
+  }
+};
+
+/// Lower the functions of `program` into SSA form.
+vector<Function> lowerProgram(const ast::Program &program);
+
+/// Replace every value that's the same constant whenever it's computed by that
+/// constant, and branches on constants by jumps, emptying the blocks that can't be
+/// reached anymore (see fold.cpp). Keeps the CFG up to date.
+void propagateConstants(Function &function);
+
+/// Fill in the predecessors and successors of every block from their terminators.
+void computeCfg(Function &function);
+
+/// The blocks that can be reached from the entry block, each one before its successors
+/// wherever there's no loop in the way. Needs computeCfg().
+vector<BlockId> reversePostorder(const Function &function);
+
+/// Fill in the immediate dominator of every block, with the algorithm from "A Simple,
+/// Fast Dominance Algorithm" by Cooper, Harvey and Kennedy. Needs computeCfg().
+void computeDominators(Function &function);
+
+/// Whether every path from the entry block to `b` goes through `a`. Needs
+/// computeDominators().
+bool dominates(const Function &function, BlockId a, BlockId b);
+
+/// Put a block of its own on every edge from a block with several successors to one
+/// with several predecessors, so there's somewhere to put the moves for the phis of the
+/// latter that only happen on that edge. Keeps the CFG up to date.
+void splitCriticalEdges(Function &function);
+
+/// Check that `function` is well-formed SSA: every block reachable from the entry ends
+/// in a terminator, phis have an operand per predecessor, and every use of a value is
+/// dominated by its definition. Reports what's wrong to diagnostics(). Needs
+/// computeDominators().
+bool verify(const Function &function);
+
+/// Print a single instruction, e.g. `%3 = i32 add %1, %2`.
+void print(const Function &function, ValueId id, std::ostream &os);
+void print(const Function &function, std::ostream &os);
+} // namespace ir
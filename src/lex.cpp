@@ -1,182 +1,638 @@
 #include "lex.hpp"
 
 #include "color.hpp"
+#include "scan.hpp"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <ostream>
 #include <string_view>
+#include <thread>
 
-using std::cerr, std::endl;
+using std::endl, std::vector;
 
 namespace lex {
 
-Token Lexer::peek() {
-  const char *oldHead = _head;
+namespace {
+struct Punctuator {
+  std::string_view spelling;
+  TokenType type;
+};
+
+constexpr Punctuator PUNCTUATORS[] = {
+    {"-", Minus},
+    {"+", Plus},
+    {"/", Slash},
+    {",", Comma},
+    {"=", Equal},
+    {"<", LessThan},
+    {">", GreaterThan},
+    {"!", Not},
+    {".", Dot},
+    {"*", Star},
+    {"&", Ampersand},
+    {"|", BitwiseOr},
+    {":", Colon},
+    {";", Semicolon},
+    {"(", LParen},
+    {")", RParen},
+    {"[", LSquare},
+    {"]", RSquare},
+    {"{", LBracket},
+    {"}", RBracket},
+    {"<=", LessThanOrEqual},
+    {">=", GreaterThanOrEqual},
+    {"==", EqualEqual},
+    {"!=", NotEqual},
+    {"++", Increment},
+    {"--", Decrement},
+    {"->", Arrow},
+    {"&&", LogicalAnd},
+    {"||", LogicalOr},
+    {"%", Percent},
+    {"^", Caret},
+    {"~", Tilde},
+    {"?", Question},
+    {"::", ColonColon},
+    {"...", Ellipsis},
+    {".*", DotStar},
+    {"->*", ArrowStar},
+    {"<=>", Spaceship},
+    {"<<", ShiftLeft},
+    {">>", ShiftRight},
+    {"+=", PlusEqual},
+    {"-=", MinusEqual},
+    {"*=", StarEqual},
+    {"/=", SlashEqual},
+    {"%=", PercentEqual},
+    {"^=", CaretEqual},
+    {"&=", AmpersandEqual},
+    {"|=", BitwiseOrEqual},
+    {"<<=", ShiftLeftEqual},
+    {">>=", ShiftRightEqual},
+};
+
+/// Each punctuator type must be spelled exactly once, and nothing else may be.
+constexpr bool punctuatorsMatchTokenTypes() {
+  for (int type = FIRST_PUNCTUATOR; type <= LAST_PUNCTUATOR; type++) {
+    int count = 0;
+    for (const auto &punctuator : PUNCTUATORS) {
+      count += punctuator.type == type;
+    }
+    if (count != 1) return false;
+  }
 
-  Token result = nextToken();
+  for (const auto &punctuator : PUNCTUATORS) {
+    if (punctuator.type < FIRST_PUNCTUATOR || punctuator.type > LAST_PUNCTUATOR ||
+        punctuator.spelling.empty())
+      return false;
+  }
+  return true;
+}
 
-  _head = oldHead;
-  return result;
+static_assert(punctuatorsMatchTokenTypes(),
+              "PUNCTUATORS must list every punctuator TokenType exactly once");
+
+/// A DFA that recognizes every punctuator. It's the trie of their spellings, over the
+/// classes of characters that appear in any of them.
+struct PunctuatorDfa {
+  static constexpr size_t MAX_STATES = 64;
+  static constexpr size_t MAX_CLASSES = 32;
+
+  /// State 0 is the dead state, and 1 the start state.
+  static constexpr uint8_t DEAD = 0, START = 1;
+
+  /// The class of every byte. Class 0 is for characters that aren't in any
+  /// punctuator, which always lead to the dead state.
+  std::array<uint8_t, 256> charClass{};
+  std::array<std::array<uint8_t, MAX_CLASSES>, MAX_STATES> next{};
+  /// The punctuator that ends in each state, or Invalid.
+  std::array<TokenType, MAX_STATES> accepts{};
+
+  size_t numClasses = 1;
+  size_t numStates = 2;
+};
+
+constexpr PunctuatorDfa buildPunctuatorDfa() {
+  PunctuatorDfa dfa;
+
+  for (const auto &punctuator : PUNCTUATORS) {
+    uint8_t state = PunctuatorDfa::START;
+
+    for (char c : punctuator.spelling) {
+      auto &cls = dfa.charClass[(unsigned char)c];
+      if (cls == 0) cls = dfa.numClasses++;
+
+      auto &next = dfa.next[state][cls];
+      if (next == PunctuatorDfa::DEAD) next = dfa.numStates++;
+      state = next;
+    }
+
+    dfa.accepts[state] = punctuator.type;
+  }
+
+  return dfa;
 }
 
-Token Lexer::nextToken(TokenType expected) {
-  _skipWhitespace();
+constexpr PunctuatorDfa PUNCTUATOR_DFA = buildPunctuatorDfa();
+static_assert(PUNCTUATOR_DFA.numStates <= PunctuatorDfa::MAX_STATES &&
+              PUNCTUATOR_DFA.numClasses <= PunctuatorDfa::MAX_CLASSES);
 
-  Token result;
-  result.location.filename = _filename;
-  result.location.startLine = currLine;
-  result.location.startColumn = _head - lineStart;
+/// matchPunctuator() reads up to a whole punctuator from the start of a token, and
+/// words look at the one character after them.
+constexpr bool punctuatorsFitLookahead() {
+  for (const auto &punctuator : PUNCTUATORS) {
+    if (punctuator.spelling.size() - 1 > MAX_TOKEN_LOOKAHEAD) return false;
+  }
+  return MAX_TOKEN_LOOKAHEAD >= 1;
+}
 
-  if (_isEOF()) {
-    if (expected != AnyToken && result.type != expected) {
-      cerr << color::boldred("ERROR") << ": Expected token of type " << expected
-           << " but got " << result.type << "!" << endl;
-      exit(1);
+static_assert(punctuatorsFitLookahead(),
+              "MAX_TOKEN_LOOKAHEAD must cover the longest punctuator");
+
+/// Find the longest punctuator at the start of [p, end). Returns its length (0 if
+/// there's none) and sets `type`.
+inline size_t matchPunctuator(const char *p, const char *end, TokenType &type) {
+  const auto &dfa = PUNCTUATOR_DFA;
+  uint8_t state = PunctuatorDfa::START;
+  size_t length = 0;
+
+  for (const char *c = p; c < end; c++) {
+    state = dfa.next[state][dfa.charClass[(unsigned char)*c]];
+    if (state == PunctuatorDfa::DEAD) break;
+
+    if (dfa.accepts[state] != Invalid) {
+      type = dfa.accepts[state];
+      length = c - p + 1;
     }
-    result.type = Eof;
-    return result;
   }
 
-  char currChar = *_head;
+  return length;
+}
+} // namespace
+
+namespace {
+constexpr size_t MAX_SOURCE_FILES = size_t(1) << (8 * sizeof(FileId));
+
+// A slot only changes while nothing refers to its ID, so a plain array of them can be
+// read without locking while other threads register and release files.
+std::unique_ptr<SourceFile> sourceFiles[MAX_SOURCE_FILES];
+size_t numSourceFiles = 1;
+vector<FileId> freeSourceFiles;
+std::mutex sourceFilesMutex;
+const SourceFile noSourceFile("", "");
+} // namespace
+
+FileId registerSourceFile(std::string filename, std::string_view text) {
+  // ID 0 is never handed out, so it stands for running out of them.
+  size_t id = 0;
+  {
+    std::lock_guard lock(sourceFilesMutex);
+    if (!freeSourceFiles.empty()) {
+      id = freeSourceFiles.back();
+      freeSourceFiles.pop_back();
+    } else if (numSourceFiles < MAX_SOURCE_FILES) {
+      id = numSourceFiles++;
+    }
+  }
 
-  if (isalpha(currChar) || curr() == '_') {
-    auto nextWord = _eatNextWord();
-    result.span = nextWord;
-    result.type = Identifier;
-  } else if (isdigit(currChar)) {
-    result.type = NumberLiteral;
-    result.span = _eatNextWord();
-  } else if (currChar == '"') {
-    result.type = StringLiteral;
+  if (id == 0) {
+    diagnostics() << color::boldred("ERROR") << ": Too many source files!" << endl;
+    fatalError(1);
+  }
 
-    const char *end = _head + 1;
-    for (; end < _src + _length; end++) {
-      if (*end == '\\') {
-        end++;
-      } else if (*end == '"') {
-        break;
-      }
+  sourceFiles[id] = std::make_unique<SourceFile>(std::move(filename), text);
+  return id;
+}
+
+void releaseSourceFile(FileId id) {
+  if (id == 0) return;
+  sourceFiles[id].reset();
+
+  std::lock_guard lock(sourceFilesMutex);
+  freeSourceFiles.push_back(id);
+}
+
+const SourceFile &sourceFile(FileId id) {
+  return id == 0 ? noSourceFile : *sourceFiles[id];
+}
+
+Location SourceFile::locate(uint32_t offset, uint32_t length) const {
+  std::call_once(_indexed, [&] {
+    const auto &kernels = scan::kernels();
+    const char *begin = _text.data(), *end = begin + _text.size();
+
+    // Like the lexer always has, this treats '\r' and '\n' as a line break each.
+    _lineStarts.push_back(0);
+    for (const char *p = kernels.findNewline(begin, end); p < end;
+         p = kernels.findNewline(p + 1, end)) {
+      _lineStarts.push_back(p + 1 - begin);
+    }
+  });
+
+  // The line an offset is on, counting from 1, and where that line starts.
+  auto lineOf = [&](uint32_t offset) -> std::pair<unsigned, uint32_t> {
+    auto it = std::upper_bound(_lineStarts.begin(), _lineStarts.end(), offset);
+    return {it - _lineStarts.begin(), *(it - 1)};
+  };
+
+  auto [startLine, startLineOffset] = lineOf(offset);
+  auto [endLine, endLineOffset] = lineOf(offset + length);
+
+  uint32_t lineEnd = startLine < _lineStarts.size() ? _lineStarts[startLine] - 1
+                                                    : uint32_t(_text.size());
+
+  return Location{
+      .filename = _filename,
+      .fullSpan = _text.substr(startLineOffset, lineEnd - startLineOffset),
+      .startLine = startLine,
+      .startColumn = offset - startLineOffset + 1,
+      .endLine = endLine,
+      .endColumn = offset + length - endLineOffset + 1,
+  };
+}
+
+std::string_view Token::span() const {
+  std::string_view text = sourceFile(file).text().substr(offset, length);
+
+  if (type == StringLiteral || type == CharLiteral) {
+    text = text.substr(1, text.size() - 2);
+  }
+  return text;
+}
+
+/// The `length` bytes at `src`, if tokens can refer to all of them. Only having 32 bits
+/// for their offset, they can't in files of 4 GB or more.
+static std::string_view checkSize(const std::string &filename, const char *src,
+                                  size_t length) {
+  if (length > UINT32_MAX) {
+    diagnostics() << color::boldred("ERROR") << ": '" << filename << "' is too big!"
+                  << endl;
+    fatalError(1);
+  }
+  return std::string_view(src, length);
+}
+
+// The size is checked before the file gets an ID, since nothing would release the ID if
+// the constructor threw afterwards.
+Lexer::Lexer(const std::string filename, const char *src, size_t length)
+    : _file(registerSourceFile(filename, checkSize(filename, src, length))), _src(src),
+      _length(length), _head(src), _tokens(_file) {}
+
+Token Lexer::peek(size_t k) {
+  while (_tokens.size() <= _next + k) {
+    // There's nothing after Eof but more Eof.
+    if (_tokens.size() > 0 && _tokens.types.back() == Eof) {
+      return _tokens[_tokens.size() - 1];
     }
+    _tokens.push_back(_lexToken());
+  }
+  return _tokens[_next + k];
+}
 
-    if (*end != '\"') {
-      cerr << color::boldred("ERROR") << ": Unterminated string literal!" << endl;
-      exit(1);
+Token Lexer::nextToken(TokenType expected) {
+  Token result;
+  if (_next < _tokens.size()) {
+    result = _tokens[_next];
+    if (result.type != Eof) _next++;
+    if (_next == _tokens.size() && !_marked) {
+      _tokens.clear();
+      _next = 0;
     }
+  } else if (_marked) {
+    // Keep it, in case of a rewind() to before it.
+    result = _lexToken();
+    _tokens.push_back(result);
+    if (result.type != Eof) _next++;
+  } else {
+    result = _lexToken();
+  }
 
-    result.span = std::string_view(_head + 1, end - _head - 1);
-    _head = end + 1;
-  } else if (currChar == '\'') {
-    result.type = CharLiteral;
+  if (expected != AnyToken && result.type != expected) {
+    if (result.type == Eof) {
+      diagnostics() << color::boldred("ERROR") << ": Expected token of type "
+                    << expected << " but got " << result.type << "!" << endl;
+    } else {
+      reportWithContext(ERROR, result.location(), "Expected {}, but got {}!", expected,
+                        result);
+    }
+    fatalError(1);
+  }
+
+  return result;
+}
+
+Lexer::~Lexer() {
+  // Chunk lexers share their parent's file.
+  if (!_speculative) releaseSourceFile(_file);
+}
+
+Lexer::Lexer(const Lexer &parent, size_t offset)
+    : _file(parent._file), _src(parent._src), _length(parent._length),
+      _head(parent._src + offset), _terminals(parent._terminals), _tokens(_file),
+      _speculative(true) {}
 
-    const char *end = _head + 1;
-    for (; end < _src + _length; end++) {
-      if (*end == '\\') {
-        end++;
-      } else if (*end == '\'') {
+void Lexer::lexAll(unsigned numThreads) {
+  // Chunks smaller than this aren't worth a thread.
+  constexpr size_t MIN_CHUNK_SIZE = 1 << 20;
+
+  _marked = true;
+  if (_tokens.size() > 0 && _tokens.types.back() == Eof) return;
+
+  _skipWhitespace();
+  const size_t start = _head - _src;
+  const size_t numChunks =
+      std::min<size_t>(numThreads, (_length - start) / MIN_CHUNK_SIZE);
+
+  if (numChunks > 1) {
+    // Split right after line breaks, where a token is most likely to start.
+    vector<size_t> chunkStarts{start};
+    for (size_t i = 1; i < numChunks; i++) {
+      size_t split = start + (_length - start) * i / numChunks;
+      const char *lineEnd = scan::kernels().findNewline(_src + split, _src + _length);
+      split = std::min<size_t>(lineEnd - _src + 1, _length);
+
+      if (split > chunkStarts.back() && split < _length) chunkStarts.push_back(split);
+    }
+
+    _lexChunks(chunkStarts);
+    return;
+  }
+
+  // About one token for every 4 bytes is typical.
+  _tokens.reserve(_tokens.size() + (_length - start) / 4);
+  while (_tokens.size() == 0 || _tokens.types.back() != Eof) {
+    _tokens.push_back(_lexToken());
+  }
+}
+
+void Lexer::_lexChunks(const vector<size_t> &chunkStarts) {
+  struct Chunk {
+    size_t start, end;
+    TokenBuffer tokens;
+    /// Where the chunk lexer stopped - the start of the first token at or after `end`
+    /// (or the end of the file), or the end of its last token if it failed.
+    size_t stop;
+  };
+
+  // Lex every chunk as if it started with a token. That's usually true, but the
+  // chunk could also start in the middle of a comment or a multi-line literal, so
+  // these are only a guess at what the tokens are.
+  vector<Chunk> chunks;
+  for (size_t i = 0; i < chunkStarts.size(); i++) {
+    size_t end = i + 1 < chunkStarts.size() ? chunkStarts[i + 1] : _length;
+    chunks.push_back(Chunk{chunkStarts[i], end, TokenBuffer(_file), 0});
+  }
+
+  auto lexChunk = [this](Chunk &chunk) {
+    Lexer lexer(*this, chunk.start);
+    chunk.tokens.reserve((chunk.end - chunk.start) / 4);
+
+    while (true) {
+      lexer._skipWhitespace();
+      if (lexer._failed || lexer._head >= lexer._src + chunk.end || lexer._isEOF()) {
         break;
       }
+
+      Token token = lexer._lexToken();
+      if (lexer._failed) break;
+      chunk.tokens.push_back(token);
     }
 
-    if (*end != '\"') {
-      cerr << color::boldred("ERROR") << ": Unterminated character literal!" << endl;
-      exit(1);
+    if (!lexer._failed) {
+      chunk.stop = lexer._head - lexer._src;
+    } else if (chunk.tokens.size() > 0) {
+      chunk.stop = chunk.tokens.offsets.back() + chunk.tokens.lengths.back();
+    } else {
+      chunk.stop = chunk.start;
     }
+  };
 
-    result.span = std::string_view(_head + 1, end - _head - 1);
-    _head = end + 1;
-  } else {
-    size_t len = 1;
-
-    switch (currChar) {
-    case '+':
-      if (next() == '+') {
-        len = 2;
-        result.type = Increment;
-      } else {
-        result.type = Plus;
+  vector<std::thread> threads;
+  for (size_t i = 1; i < chunks.size(); i++) {
+    threads.emplace_back(lexChunk, std::ref(chunks[i]));
+  }
+  lexChunk(chunks[0]);
+  for (auto &thread : threads)
+    thread.join();
+
+  // Lexing is deterministic from the start of a token on, so a chunk's tokens are
+  // right from the first one that starts where the previous chunk's really ended.
+  // Until then, and past wherever a chunk lexer gave up, lex token by token here.
+  // That only works out which tokens go where - copying them is done in parallel.
+  struct Piece {
+    const TokenBuffer *from;
+    size_t first, last;
+    /// Where in `_tokens` the piece goes.
+    size_t to;
+  };
+
+  vector<Piece> pieces;
+  std::deque<TokenBuffer> relexed;
+  size_t numTokens = _tokens.size();
+
+  for (auto &chunk : chunks) {
+    while (!_isEOF() && size_t(_head - _src) < chunk.end) {
+      const uint32_t offset = _head - _src;
+      const auto &offsets = chunk.tokens.offsets;
+      auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+
+      if (it != offsets.end() && *it == offset) {
+        size_t first = it - offsets.begin();
+        pieces.push_back(Piece{&chunk.tokens, first, offsets.size(), numTokens});
+        numTokens += offsets.size() - first;
+
+        _head = _src + chunk.stop;
+        _skipWhitespace();
+        continue;
       }
-      break;
-    case '-':
-      if (next() == '-') {
-        len = 2;
-        result.type = Decrement;
-      } else if (next() == '>') {
-        len = 2;
-        result.type = Arrow;
-      } else {
-        result.type = Minus;
+
+      if (relexed.empty() || pieces.back().from != &relexed.back()) {
+        relexed.emplace_back(_file);
+        pieces.push_back(Piece{&relexed.back(), 0, 0, numTokens});
       }
-      break;
-    // TODO: & | && || += -= *= /= &&= ||=
-    case '*': result.type = Star; break;
-    case '!': result.type = Not; break;
-    case '{': result.type = LBracket; break;
-    case '}': result.type = RBracket; break;
-    case '(': result.type = LParen; break;
-    case ')': result.type = RParen; break;
-    case '[': result.type = LSquare; break;
-    case ']': result.type = RSquare; break;
-    case '.': result.type = Dot; break;
-    case ';': result.type = Semicolon; break;
-    case '=': result.type = Equal; break;
+      relexed.back().push_back(_lexToken());
+      pieces.back().last++;
+      numTokens++;
+
+      _skipWhitespace();
     }
-    result.span = std::string_view(_head, len);
-    _head += len;
   }
 
-  result.location.endLine = currLine;
-  result.location.endColumn = _head - lineStart;
-  result.location.fullSpan =
-      std::string_view(lineStart + 1, findLineEnd() - lineStart - 1);
+  _tokens.resize(numTokens);
+  auto copyPiece = [this](const Piece &piece) {
+    auto copy = [&piece](auto &to, const auto &from) {
+      std::copy(from.begin() + piece.first, from.begin() + piece.last,
+                to.begin() + piece.to);
+    };
+    copy(_tokens.types, piece.from->types);
+    copy(_tokens.offsets, piece.from->offsets);
+    copy(_tokens.lengths, piece.from->lengths);
+    copy(_tokens.symbols, piece.from->symbols);
+  };
+
+  threads.clear();
+  for (size_t i = 1; i < pieces.size(); i++) {
+    threads.emplace_back(copyPiece, std::cref(pieces[i]));
+  }
+  if (!pieces.empty()) copyPiece(pieces[0]);
+  for (auto &thread : threads)
+    thread.join();
 
-  if (expected != AnyToken && result.type != expected) {
-    reportWithContext(ERROR, result.location, "Expected {}, but got {}!", expected,
-                      result);
-    exit(1);
+  _tokens.push_back(_lexToken());
+  assert(_tokens.types.back() == Eof);
+}
+
+Lexer::Mark Lexer::mark() {
+  _marked = true;
+  return _next;
+}
+
+void Lexer::rewind(Mark mark) {
+  assert(_marked && mark <= _tokens.size());
+  _next = mark;
+}
+
+void Lexer::seek(size_t offset) {
+  _tokens.clear();
+  _next = 0;
+  _marked = false;
+  _head = _src + std::min(offset, _length);
+}
+
+TokenBuffer Lexer::takeTokens() {
+  TokenBuffer tokens(_file);
+  std::swap(tokens, _tokens);
+  _next = 0;
+  return tokens;
+}
+
+void Lexer::setTerminals(const TerminalIds *terminals) {
+  if (terminals == _terminals) return;
+  _terminals = terminals;
+  for (size_t i = 0; i < _tokens.size(); i++) {
+    _tokens.symbols[i] = terminals->lookup(_tokens.types[i], _tokens[i].span());
+  }
+}
+
+Token Lexer::_lexToken() {
+  _skipWhitespace();
+
+  Token result;
+  result.file = _file;
+  result.offset = _head - _src;
+
+  if (_isEOF()) {
+    result.type = Eof;
+    if (_terminals) result.symbol = _terminals->lookup(Eof, {});
+    return result;
+  }
+
+  char currChar = *_head;
+  std::string_view span;
+
+  if (isalpha(currChar) || curr() == '_') {
+    span = _eatNextWord();
+    result.type = Identifier;
+  } else if (isdigit(currChar)) {
+    span = _eatNextWord();
+    result.type = NumberLiteral;
+  } else if (currChar == '"') {
+    result.type = StringLiteral;
+    _eatQuoted('"', "string");
+  } else if (currChar == '\'') {
+    result.type = CharLiteral;
+    _eatQuoted('\'', "character");
+  } else {
+    // Anything that isn't a punctuator becomes a single character Invalid token.
+    size_t len = matchPunctuator(_head, _src + _length, result.type);
+    if (len == 0) len = 1;
+
+    span = std::string_view(_head, len);
+    _head += len;
   }
 
+  result.length = _head - _src - result.offset;
+
+  if (_terminals) {
+    if (span.empty()) span = result.span();
+    result.symbol = _terminals->lookup(result.type, span);
+  }
   return result;
 }
 
-const char *Lexer::findLineEnd() const {
+void Lexer::_eatQuoted(char quote, const char *what) {
   const char *end = _head + 1;
   for (; end < _src + _length; end++) {
-    if (*end == '\n' || *end == '\r') break;
+    if (*end == '\\') {
+      end++;
+    } else if (*end == quote) {
+      break;
+    }
   }
-  return end;
+
+  if (end >= _src + _length) {
+    _fail(std::string("Unterminated ") + what + " literal!");
+    return;
+  }
+
+  _head = end + 1;
+}
+
+void Lexer::_fail(const std::string &message) {
+  if (!_speculative) {
+    diagnostics() << color::boldred("ERROR") << ": " << message << endl;
+    fatalError(1);
+  }
+
+  _failed = true;
+  _head = _src + _length;
 }
 
 void Lexer::eatToken(TokenType expected) { nextToken(expected); }
 
-bool Lexer::_isEOF() { return _head >= _src + _length; }
+bool Lexer::_isEOF() const { return _head >= _src + _length; }
 
 void Lexer::_skipWhitespace() {
-  while (!_isEOF() && isspace(curr())) {
-    if (curr() == '\n' || curr() == '\r') {
-      lineStart = _head;
-      currLine++;
-    }
-    _head++;
-  }
-}
+  const auto &kernels = scan::kernels();
+  const char *end = _src + _length;
+
+  while (true) {
+    _head = kernels.skipWhitespace(_head, end);
+
+    if (end - _head >= 2 && _head[0] == '/' && _head[1] == '/') {
+      // The line break itself gets skipped as whitespace next time around.
+      _head = kernels.findNewline(_head + 2, end);
+    } else if (end - _head >= 2 && _head[0] == '/' && _head[1] == '*') {
+      const char *commentEnd = _head + 2;
+      while (true) {
+        commentEnd = static_cast<const char *>(
+            std::memchr(commentEnd, '*', std::max<ptrdiff_t>(end - commentEnd, 0)));
+        if (!commentEnd || commentEnd + 1 >= end) {
+          _fail("Unterminated comment!");
+          return;
+        }
+        if (commentEnd[1] == '/') break;
+        commentEnd++;
+      }
 
-bool isOneOf(char c, const std::string symbols) {
-  for (char s : symbols) {
-    if (c == s) return true;
+      _head = commentEnd + 2;
+    } else {
+      return;
+    }
   }
-
-  return false;
 }
 
 std::string_view Lexer::_eatNextWord() {
   assert(!isspace(*_head));
 
-  const char *end = _head;
-  while (end < _src + _length && !isspace(*end) &&
-         !isOneOf(*end, "()[]{}.,:;-+/*^|&!%\'\"<>?!=^")) {
-    end++;
-  }
+  const char *end = scan::kernels().findWordEnd(_head, _src + _length);
 
   auto s = std::string_view(_head, end - _head);
   _head = end;
@@ -184,7 +640,7 @@ std::string_view Lexer::_eatNextWord() {
 }
 
 std::ostream &operator<<(std::ostream &o, lex::Token token) {
-  o << "Token(type: " << token.type << ", span: <" << token.span << ">)";
+  o << "Token(type: " << token.type << ", span: <" << token.span() << ">)";
   return o;
 }
 
@@ -228,6 +684,27 @@ std::ostream &operator<<(std::ostream &o, lex::TokenType type) {
   case Arrow             : o << "->"; break;
   case LogicalAnd        : o << "&&"; break;
   case LogicalOr         : o << "||"; break;
+  case Percent           : o << "%"; break;
+  case Caret             : o << "^"; break;
+  case Tilde             : o << "~"; break;
+  case Question          : o << "?"; break;
+  case ColonColon        : o << "::"; break;
+  case Ellipsis          : o << "..."; break;
+  case DotStar           : o << ".*"; break;
+  case ArrowStar         : o << "->*"; break;
+  case Spaceship         : o << "<=>"; break;
+  case ShiftLeft         : o << "<<"; break;
+  case ShiftRight        : o << ">>"; break;
+  case PlusEqual         : o << "+="; break;
+  case MinusEqual        : o << "-="; break;
+  case StarEqual         : o << "*="; break;
+  case SlashEqual        : o << "/="; break;
+  case PercentEqual      : o << "%="; break;
+  case CaretEqual        : o << "^="; break;
+  case AmpersandEqual    : o << "&="; break;
+  case BitwiseOrEqual    : o << "|="; break;
+  case ShiftLeftEqual    : o << "<<="; break;
+  case ShiftRightEqual   : o << ">>="; break;
   case AnyToken          : o << "[AnyToken]"; break;
   }
 
@@ -4,12 +4,16 @@
 
 #include <array>
 #include <cassert>
+#include <cstdint>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 
 namespace lex {
-enum TokenType {
+enum TokenType : uint8_t {
   Invalid,
   Eof,
 
@@ -57,52 +61,264 @@ enum TokenType {
   LogicalAnd, // &&
   LogicalOr,  // ||
 
+  Percent,    // %
+  Caret,      // ^
+  Tilde,      // ~
+  Question,   // ?
+  ColonColon, // ::
+  Ellipsis,   // ...
+  DotStar,    // .*
+  ArrowStar,  // ->*
+  Spaceship,  // <=>
+  ShiftLeft,  // <<
+  ShiftRight, // >>
+
+  PlusEqual,       // +=
+  MinusEqual,      // -=
+  StarEqual,       // *=
+  SlashEqual,      // /=
+  PercentEqual,    // %=
+  CaretEqual,      // ^=
+  AmpersandEqual,  // &=
+  BitwiseOrEqual,  // |=
+  ShiftLeftEqual,  // <<=
+  ShiftRightEqual, // >>=
+
   AnyToken, // Any token - default value for Lexer::nextToken().
 };
 
+/// Every operator and punctuation token type, which Lexer::nextToken() recognizes
+/// with a DFA built from the table in lex.cpp.
+constexpr TokenType FIRST_PUNCTUATOR = Minus;
+constexpr TokenType LAST_PUNCTUATOR = ShiftRightEqual;
+
+/// Identifies a SourceFile, see registerSourceFile().
+using FileId = uint16_t;
+
+/// A file (or string) that's being lexed. Tokens only keep its ID and their offset
+/// into it, and work out line and column numbers from it when a diagnostic needs them.
+class SourceFile {
+public:
+  SourceFile(std::string filename, std::string_view text)
+      : _filename(std::move(filename)), _text(text) {}
+
+  inline const std::string &filename() const { return _filename; }
+  inline std::string_view text() const { return _text; }
+
+  /// The location of the `length` bytes at `offset`, along with the line they're on.
+  Location locate(uint32_t offset, uint32_t length) const;
+
+private:
+  const std::string _filename;
+  const std::string_view _text;
+
+  /// The offset each line starts at, built the first time anything is located.
+  mutable std::vector<uint32_t> _lineStarts;
+  mutable std::once_flag _indexed;
+};
+
+/// Give `text` an ID that tokens can refer to it by. The text must outlive every
+/// token lexed from it.
+FileId registerSourceFile(std::string filename, std::string_view text);
+
+/// Free up `id` for another file, once no token refers to it anymore.
+void releaseSourceFile(FileId id);
+
+/// The file with the given ID. ID 0 is an empty file without a name, which
+/// default-constructed tokens refer to.
+const SourceFile &sourceFile(FileId id);
+
 struct Token {
-  Token() : type(Invalid), span() {}
-  Token(TokenType type, std::string_view span, Location location)
-      : type(type), span(span), location(location) {}
+  TokenType type = Invalid;
+  FileId file = 0;
+
+  /// Where the token starts in its file, and how long it is. For string and character
+  /// literals that includes the quotes.
+  uint32_t offset = 0;
+  uint32_t length = 0;
 
-  TokenType type;
-  std::string_view span;
-  Location location;
+  /// The grammar's ID for this token's terminal symbol, or -1 if there's none (or the
+  /// lexer doesn't have a TerminalIds to look it up in).
+  int32_t symbol = -1;
+
+  /// The text of the token - without the quotes, for string and character literals.
+  std::string_view span() const;
+
+  /// Where the token is. Slow-ish, so only meant for diagnostics.
+  inline Location location() const { return sourceFile(file).locate(offset, length); }
+};
+
+static_assert(sizeof(Token) == 16, "Tokens should stay small enough to pass around");
+
+/// Maps tokens to the terminal symbol IDs of a grammar, so the parser can index its
+/// tables directly instead of comparing tokens against the grammar.
+struct TerminalIds {
+  /// Terminals that must be spelled exactly, e.g. "int" or "(". These take priority,
+  /// so keywords are never treated as identifiers.
+  std::unordered_map<std::string_view, int32_t> bySpelling;
+
+  /// Terminals that match any token of a type, e.g. Identifier.
+  std::array<int32_t, AnyToken + 1> byType;
+
+  TerminalIds() { byType.fill(-1); }
+
+  int32_t lookup(TokenType type, std::string_view span) const {
+    switch (type) {
+    case NumberLiteral:
+    case CharLiteral:
+    case StringLiteral:
+    case RawStringLiteral:
+    case Eof             : return byType[type];
+    default:
+      if (auto it = bySpelling.find(span); it != bySpelling.end()) {
+        return it->second;
+      }
+      return byType[type];
+    }
+  }
+};
+
+/// How many characters past the end of a token the lexer might look at to decide
+/// where the token ends. Changing anything further away can't change the token.
+constexpr uint32_t MAX_TOKEN_LOOKAHEAD = 3;
+
+/// Tokens of a single file stored as a struct of arrays, which packs them tighter
+/// than a vector of Tokens and keeps e.g. a scan over just the types cache friendly.
+class TokenBuffer {
+public:
+  /// resize() leaves new tokens uninitialized, to be filled in by whoever resized.
+  template<typename T>
+  using Array = std::vector<T, DefaultInitAllocator<T>>;
+
+  explicit TokenBuffer(FileId file = 0) : _file(file) {}
+
+  inline size_t size() const { return types.size(); }
+
+  inline Token operator[](size_t i) const {
+    Token token;
+    token.type = types[i];
+    token.file = _file;
+    token.offset = offsets[i];
+    token.length = lengths[i];
+    token.symbol = symbols[i];
+    return token;
+  }
+
+  void push_back(const Token &token) {
+    types.push_back(token.type);
+    offsets.push_back(token.offset);
+    lengths.push_back(token.length);
+    symbols.push_back(token.symbol);
+  }
+
+  void reserve(size_t n) {
+    types.reserve(n);
+    offsets.reserve(n);
+    lengths.reserve(n);
+    symbols.reserve(n);
+  }
+
+  void resize(size_t n) {
+    types.resize(n);
+    offsets.resize(n);
+    lengths.resize(n);
+    symbols.resize(n);
+  }
+
+  void clear() {
+    types.clear();
+    offsets.clear();
+    lengths.clear();
+    symbols.clear();
+  }
+
+  Array<TokenType> types;
+  Array<uint32_t> offsets;
+  Array<uint32_t> lengths;
+  Array<int32_t> symbols;
+
+private:
+  FileId _file;
 };
 
 class Lexer {
 public:
   Lexer(const std::string filename, const std::string &src)
-      : _filename(filename), _src(src.c_str()), _length(src.length()),
-        _head(src.c_str()), lineStart(_src - 1) {}
+      : Lexer(filename, src.c_str(), src.length()) {}
 
-  Lexer(const std::string filename, const char *src, size_t length)
-      : _filename(filename), _src(src), _length(length), _head(src),
-        lineStart(_src - 1) {}
+  Lexer(const std::string filename, const char *src, size_t length);
+  Lexer(const Lexer &) = delete;
+
+  /// Releases the source file, so tokens from this lexer mustn't outlive it.
+  ~Lexer();
 
   void eatToken(TokenType expected);
   Token nextToken(TokenType expected = AnyToken);
 
-  /// Look at the next token without actually advancing to it.
-  Token peek();
+  /// Look at the token `k` tokens ahead without advancing to it. Anything looked at
+  /// gets buffered, so is only ever lexed once. Past the end of the file, that's Eof.
+  Token peek(size_t k = 0);
+
+  /// Lex the rest of the file into the buffer up front, after which nextToken() and
+  /// peek() are just array lookups. Big files get split into chunks that are lexed on
+  /// up to `numThreads` threads, with the same result as lexing them in one go.
+  void lexAll(unsigned numThreads = 1);
+
+  /// A position in the token stream to rewind() to later.
+  using Mark = uint32_t;
+
+  /// Remember the current position. From then on every token is kept in the buffer,
+  /// so backtracking is O(1).
+  Mark mark();
+
+  /// Go back (or forward) to a position from mark().
+  void rewind(Mark mark);
+
+  /// Tag every token, including any that are already buffered, with its terminal
+  /// symbol from `terminals`.
+  void setTerminals(const TerminalIds *terminals);
+
+  /// Forget whatever is buffered and carry on lexing from `offset`, which has to be
+  /// outside of any token, comment or literal.
+  void seek(size_t offset);
+
+  inline FileId file() const { return _file; }
+
+  /// Hand over the buffer, which after lexAll() holds every token of the file.
+  TokenBuffer takeTokens();
 
 private:
+  /// A lexer for lexing a chunk of the same file, starting at `offset`.
+  Lexer(const Lexer &parent, size_t offset);
+
   // Look at the current character.
   inline char curr() const { return *_head; }
 
   // Look at the next character.
   inline char next() const { return *(_head + 1); }
 
+  /// Skip whitespace and comments.
   void _skipWhitespace();
 
-  bool _isEOF();
+  bool _isEOF() const;
 
-  const char *findLineEnd() const;
+  /// Lex a token from the source code, skipping the buffer.
+  Token _lexToken();
+
+  /// Lex the rest of the file in chunks starting at `chunkStarts`, each on its own
+  /// thread, and stitch them together into the buffer.
+  void _lexChunks(const std::vector<size_t> &chunkStarts);
+
+  /// Report a lexing error and exit, or for speculative lexers just give up.
+  void _fail(const std::string &message);
 
   /// Consume characters until a separator character is found.
   std::string_view _eatNextWord();
 
-  const std::string _filename;
+  /// Consume a string or character literal up to the closing `quote`.
+  void _eatQuoted(char quote, const char *what);
+
+  const FileId _file;
 
   /// The source code that this lexer is parsing.
   const char *const _src;
@@ -113,10 +329,18 @@ private:
   /// The position where the Lexer is currently located.
   const char *_head;
 
-  /// The current line that the lexer is located on.
-  unsigned currLine = 1;
+  const TerminalIds *_terminals = nullptr;
+
+  /// Tokens that were peeked at or pre-lexed, and the index of the next one to return.
+  /// Unless something is marked, the buffer is emptied whenever it runs dry.
+  TokenBuffer _tokens;
+  size_t _next = 0;
+  bool _marked = false;
 
-  const char *lineStart;
+  /// Chunk lexers can start in the middle of a comment or a literal, so they might run
+  /// into errors that aren't really there. Those set `_failed` instead of exiting.
+  bool _speculative = false;
+  bool _failed = false;
 };
 
 std::ostream &operator<<(std::ostream &o, lex::Token token);
@@ -0,0 +1,396 @@
+#include "ir.hpp"
+
+#include "utils.hpp"
+
+#include <map>
+#include <unordered_map>
+
+// Lowering ASTs into SSA form right away, with the algorithm from "Simple and
+// Efficient Construction of Static Single Assignment Form" by Braun et al.: reading a
+// variable looks for its last assignment in the current block, and failing that in
+// the predecessors, adding phis where they meet.
+
+namespace ir {
+using std::endl, std::map;
+
+namespace {
+class FunctionBuilder {
+public:
+  FunctionBuilder(Function &function, const map<string, Type> &returnTypes)
+      : function(function), returnTypes(returnTypes) {}
+
+  void lower(const ast::FunctionDefinition &funcDef) {
+    function.name = funcDef.name;
+    function.returnType = lowerType(funcDef.returnType);
+    returnKind = funcDef.returnType.kind;
+
+    current = newBlock();
+    seal(current);
+
+    for (const auto &param : funcDef.parameters) {
+      Type type = lowerType(param.type);
+      function.paramTypes.push_back(type);
+
+      // Only what fits in registers (System V ABI).
+      if (function.paramTypes.size() > 6) fail("More than 6 parameters");
+
+      int32_t index = function.paramTypes.size() - 1;
+      write(declare(param.name, param.type.kind, type), current,
+            add(Instruction{.op = Opcode::Param, .type = type, .imm = index}));
+    }
+
+    for (const auto &statement : funcDef.body) lower(statement);
+
+    // Falling off the end of main returns 0, and of anything else, garbage.
+    if (!isTerminated()) {
+      Instruction ret{.op = Opcode::Return};
+      if (function.returnType != Type::Void) {
+        ValueId value = funcDef.name == "main" ? constant(0) : undef(Type::I32);
+        ret.operands = {convert(value, returnKind, function.returnType)};
+      }
+      add(std::move(ret));
+    }
+
+    removeTrivialPhis();
+  }
+
+private:
+  struct Variable {
+    string name;
+    ast::TypeKind kind;
+    Type type;
+  };
+
+  [[noreturn]] void fail(const string &what) {
+    diagnostics() << color::boldred("ERROR") << ": In " << function.name << ": " << what
+                  << "!" << endl;
+    fatalError(1);
+  }
+
+  Type lowerType(const ast::Type &type) {
+    switch (type.kind) {
+    case ast::Void: return Type::Void;
+    case ast::Int : return Type::I32;
+    case ast::Char:
+    case ast::Bool: return Type::I8;
+    default       : fail("Type '" + type.name + "' isn't supported yet");
+    }
+  }
+
+  BlockId newBlock() {
+    function.blocks.emplace_back();
+    sealed.push_back(false);
+    return function.blocks.size() - 1;
+  }
+
+  bool isTerminated() const {
+    const auto &instructions = function.blocks[current].instructions;
+    return !instructions.empty() && function[instructions.back()].isTerminator();
+  }
+
+  /// Whether nothing can get to the current block, since it's where statements after a
+  /// return go.
+  bool isUnreachable() const {
+    return current != 0 && sealed[current] && function.blocks[current].preds.empty();
+  }
+
+  /// Append `instruction` to the current block, and add the edges it makes if it's a
+  /// terminator.
+  ValueId add(Instruction instruction) {
+    instruction.block = current;
+    ValueId id = function.values.size();
+    function.values.push_back(std::move(instruction));
+    function.blocks[current].instructions.push_back(id);
+
+    for (BlockId target : function[id].targets) {
+      function.blocks[target].preds.push_back(current);
+      function.blocks[current].succs.push_back(target);
+    }
+    return id;
+  }
+
+  /// Insert `instruction` at the start of `block`, before anything but its phis.
+  ValueId insertAtStart(BlockId block, Instruction instruction) {
+    instruction.block = block;
+    ValueId id = function.values.size();
+    function.values.push_back(std::move(instruction));
+
+    auto &instructions = function.blocks[block].instructions;
+    auto it = instructions.begin();
+    while (it != instructions.end() && function[*it].op == Opcode::Phi) ++it;
+    instructions.insert(it, id);
+    return id;
+  }
+
+  ValueId constant(int32_t value) {
+    return add(Instruction{.op = Opcode::Const, .type = Type::I32, .imm = value});
+  }
+
+  ValueId undef(Type type) {
+    return insertAtStart(0, Instruction{.op = Opcode::Undef, .type = type});
+  }
+
+  /// `value` as a `type`, which is what C++ would implicitly convert it to.
+  ValueId convert(ValueId value, Type type) {
+    Type from = function[value].type;
+    if (from == type) return value;
+
+    if (type == Type::I32) {
+      return add(Instruction{.op = Opcode::SExt, .type = type, .operands = {value}});
+    }
+    return add(Instruction{.op = Opcode::Trunc, .type = type, .operands = {value}});
+  }
+
+  /// `value` as something of the given kind - a bool is 1 if it isn't 0.
+  ValueId convert(ValueId value, ast::TypeKind kind, Type type) {
+    if (kind == ast::Bool) {
+      value = add(Instruction{.op = Opcode::NotEqual,
+                              .type = Type::I32,
+                              .operands = {convert(value, Type::I32), constant(0)}});
+    }
+    return convert(value, type);
+  }
+
+  size_t declare(const string &name, ast::TypeKind kind, Type type) {
+    if (type == Type::Void) fail("Variable '" + name + "' can't be void");
+
+    variables.push_back({name, kind, type});
+    scope[name] = variables.size() - 1;
+    currentDefs.emplace_back();
+    return variables.size() - 1;
+  }
+
+  size_t lookup(const string &name) {
+    auto it = scope.find(name);
+    if (it == scope.end()) fail("'" + name + "' isn't declared");
+    return it->second;
+  }
+
+  void write(size_t variable, BlockId block, ValueId value) {
+    currentDefs[variable][block] = value;
+  }
+
+  ValueId read(size_t variable, BlockId block) {
+    auto it = currentDefs[variable].find(block);
+    if (it != currentDefs[variable].end()) return it->second;
+
+    const Block &b = function.blocks[block];
+    ValueId value;
+    if (!sealed[block]) {
+      // More predecessors might still come along, so fill in the phi once they have.
+      value = newPhi(variable, block);
+      incompletePhis[block].push_back({variable, value});
+    } else if (b.preds.size() == 1) {
+      value = read(variable, b.preds[0]);
+    } else if (b.preds.empty()) {
+      value = undef(variables[variable].type);
+    } else {
+      // Reading this block's variable while reading the predecessors' (in a loop)
+      // should find the phi rather than go around in circles.
+      value = newPhi(variable, block);
+      write(variable, block, value);
+      addPhiOperands(variable, value);
+    }
+
+    write(variable, block, value);
+    return value;
+  }
+
+  ValueId newPhi(size_t variable, BlockId block) {
+    ValueId id = function.values.size();
+    function.values.push_back(
+        Instruction{.op = Opcode::Phi, .type = variables[variable].type,
+                    .block = block});
+
+    auto &instructions = function.blocks[block].instructions;
+    auto it = instructions.begin();
+    while (it != instructions.end() && function[*it].op == Opcode::Phi) ++it;
+    instructions.insert(it, id);
+    return id;
+  }
+
+  void addPhiOperands(size_t variable, ValueId phi) {
+    BlockId block = function[phi].block;
+    for (BlockId pred : function.blocks[block].preds) {
+      ValueId operand = read(variable, pred);
+      function[phi].operands.push_back(operand);
+      function[phi].targets.push_back(pred);
+    }
+  }
+
+  /// Note that `block` won't get any more predecessors.
+  void seal(BlockId block) {
+    for (auto [variable, phi] : incompletePhis[block]) addPhiOperands(variable, phi);
+    incompletePhis.erase(block);
+    sealed[block] = true;
+  }
+
+  /// Replace every phi that only ever picks one value (other than itself) by that
+  /// value, until there are none left.
+  void removeTrivialPhis() {
+    vector<ValueId> replacement(function.values.size(), NONE);
+    auto resolve = [&](ValueId id) {
+      while (replacement[id] != NONE) id = replacement[id];
+      return id;
+    };
+
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (ValueId id = 0; id < function.values.size(); id++) {
+        const Instruction &phi = function[id];
+        if (phi.op != Opcode::Phi || replacement[id] != NONE) continue;
+
+        ValueId same = NONE;
+        bool isTrivial = true;
+        for (ValueId operand : phi.operands) {
+          operand = resolve(operand);
+          if (operand == id || operand == same) continue;
+          if (same != NONE) {
+            isTrivial = false;
+            break;
+          }
+          same = operand;
+        }
+        if (!isTrivial) continue;
+
+        // A phi that only refers to itself is in a block nothing can get to.
+        if (same == NONE) same = undef(phi.type);
+        replacement.resize(function.values.size(), NONE);
+        replacement[id] = same;
+        changed = true;
+      }
+    }
+
+    for (Instruction &instruction : function.values) {
+      for (ValueId &operand : instruction.operands) operand = resolve(operand);
+    }
+    for (Block &block : function.blocks) {
+      auto &instructions = block.instructions;
+      instructions.erase(std::remove_if(instructions.begin(), instructions.end(),
+                                        [&](ValueId id) {
+                                          return replacement[id] != NONE;
+                                        }),
+                         instructions.end());
+    }
+    for (ValueId id = 0; id < replacement.size(); id++) {
+      if (replacement[id] != NONE) function[id].block = NONE;
+    }
+  }
+
+  void lower(const ast::Statement &statement) {
+    std::visit(
+        Overloaded{
+            [&](const ast::VarDefStmt &def) {
+              Type type = lowerType(def.type);
+              for (const auto &name : def.names) declare(name, def.type.kind, type);
+            },
+            [&](const ast::VarAssignStmt &assignment) {
+              size_t variable = lookup(assignment.varName);
+              const Variable &var = variables[variable];
+              write(variable, current,
+                    convert(lower(assignment.expression), var.kind, var.type));
+            },
+            [&](const ast::ReturnStatement &ret) {
+              Instruction instruction{.op = Opcode::Return};
+              if (ret.returnValue.has_value()) {
+                if (function.returnType == Type::Void) fail("Returning a value");
+                instruction.operands = {
+                    convert(lower(*ret.returnValue), returnKind, function.returnType)};
+              } else if (function.returnType != Type::Void) {
+                fail("Returning without a value");
+              }
+              add(std::move(instruction));
+
+              // Anything after this can't be reached, but still has to go somewhere.
+              current = newBlock();
+              seal(current);
+            },
+            [&](const ast::FuncCallStatement &call) {
+              auto it = returnTypes.find(call.functionName);
+              Type type = it == returnTypes.end() ? Type::I32 : it->second;
+              add(Instruction{
+                  .op = Opcode::Call, .type = type, .text = call.functionName});
+            },
+            [&](const ast::InlineAssemblyStatement &inlineAsm) {
+              if (isUnreachable()) {
+                function.unreachableAsm.push_back(inlineAsm.content);
+              } else {
+                add(Instruction{.op = Opcode::InlineAsm, .text = inlineAsm.content});
+              }
+            },
+        },
+        statement);
+  }
+
+  /// Lower `expr` to an I32 value.
+  ValueId lower(const ast::Expression &expr) {
+    switch (expr.type) {
+    case ast::Expr_IntConstant: return constant(expr.integer);
+    case ast::Expr_StringConstant: fail("String literals aren't supported yet");
+    case ast::Expr_VarAccess:
+      return convert(read(lookup(expr.identifier), current), Type::I32);
+
+    case ast::Expr_UnaryOp: {
+      Opcode op;
+      switch (expr.unaryOpType) {
+      case ast::UnaryOp_Not   : op = Opcode::Not; break;
+      case ast::UnaryOp_Negate: op = Opcode::Negate; break;
+      default                 : fail("Pointers aren't supported yet");
+      }
+      ValueId operand = lower(*expr.lhs);
+      return add(Instruction{.op = op, .type = Type::I32, .operands = {operand}});
+    }
+
+    case ast::Expr_BinaryOp: {
+      Opcode op = Opcode::Add;
+      switch (expr.binOpType) {
+      case ast::BinOp_Add               : op = Opcode::Add; break;
+      case ast::BinOp_Sub               : op = Opcode::Sub; break;
+      case ast::BinOp_Divide            : op = Opcode::Div; break;
+      case ast::BinOp_Mult              : op = Opcode::Mul; break;
+      case ast::BinOp_Modulo            : op = Opcode::Mod; break;
+      case ast::BinOp_Equal             : op = Opcode::Equal; break;
+      case ast::BinOp_NotEqual          : op = Opcode::NotEqual; break;
+      case ast::BinOp_LessThan          : op = Opcode::LessThan; break;
+      case ast::BinOp_GreaterThan       : op = Opcode::GreaterThan; break;
+      case ast::BinOp_LessThanOrEqual   : op = Opcode::LessThanOrEqual; break;
+      case ast::BinOp_GreaterThanOrEqual: op = Opcode::GreaterThanOrEqual; break;
+      }
+      ValueId lhs = lower(*expr.lhs);
+      ValueId rhs = lower(*expr.rhs);
+      return add(Instruction{.op = op, .type = Type::I32, .operands = {lhs, rhs}});
+    }
+    }
+    fail("Unknown expression");
+  }
+
+  Function &function;
+  const map<string, Type> &returnTypes;
+
+  ast::TypeKind returnKind = ast::Void;
+
+  BlockId current = NONE;
+  vector<bool> sealed;
+  std::unordered_map<BlockId, vector<std::pair<size_t, ValueId>>> incompletePhis;
+
+  vector<Variable> variables;
+  /// The variable each name refers to at this point.
+  map<string, size_t> scope;
+  /// By variable, its value at the end of each block that assigns it.
+  vector<std::unordered_map<BlockId, ValueId>> currentDefs;
+};
+} // namespace
+
+vector<Function> lowerProgram(const ast::Program &program) {
+  map<string, Type> returnTypes;
+  vector<Function> functions(program.funcDefs.size());
+
+  for (size_t i = 0; i < program.funcDefs.size(); i++) {
+    FunctionBuilder(functions[i], returnTypes).lower(program.funcDefs[i]);
+    returnTypes[functions[i].name] = functions[i].returnType;
+  }
+
+  return functions;
+}
+} // namespace ir
@@ -1,36 +1,279 @@
 #include "ast.hpp"
 #include "color.hpp"
+#include "compile.hpp"
+#include "driver.hpp"
+#include "file.hpp"
 #include "grammar.hpp"
 #include "lex.hpp"
+#include "peephole.hpp"
+#include "thread_pool.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstdlib>
-#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-using std::cerr, std::cout, std::endl, std::ifstream, std::string;
+using std::cerr, std::cout, std::endl, std::string, std::vector;
 
-int main(int argc, const char **argv) {
-  if (argc != 2) {
-    cerr << "ERROR: Not enough/too many arguments!" << endl;
+/// Where `--server` listens if it isn't told otherwise.
+constexpr const char *DEFAULT_SOCKET = "toycpp.sock";
+/// What `--compile` writes a single file to if it isn't told otherwise.
+constexpr const char *DEFAULT_EXECUTABLE = "executable";
+
+/// Where `--compile` writes what it compiles `filename` into: next to it, named after it
+/// without the extension, or with .asm instead of it for FASM. Source code from stdin
+/// goes to DEFAULT_EXECUTABLE.
+static string outputPathFor(const string &filename, compile::OutputFormat format) {
+  string path = filename == "-" ? DEFAULT_EXECUTABLE : filename;
+  size_t dot = path.rfind('.');
+  if (dot != string::npos && path.find('/', dot) == string::npos) path.resize(dot);
+
+  if (format == compile::OutputFormat::Fasm) path += ".asm";
+  // Don't overwrite the source file, if it has no extension (or .asm already).
+  return path == filename ? path + ".out" : path;
+}
+
+/// Add the whitespace separated arguments in `filename` to `args`. Arguments can be
+/// quoted with "" or '' to include whitespace.
+static void readResponseFile(const string &filename, vector<string> &args) {
+  auto file = FileContents::read(filename);
+  if (!file.has_value()) {
+    cerr << "ERROR: Failed to read or open '" << filename << "'!" << endl;
+    exit(1);
+  }
+
+  std::string_view text = file->text();
+  for (size_t i = 0; i < text.size();) {
+    if (isspace(text[i])) {
+      i++;
+      continue;
+    }
+
+    string arg;
+    for (char quote = 0; i < text.size(); i++) {
+      if (quote && text[i] == quote) {
+        quote = 0;
+      } else if (!quote && (text[i] == '"' || text[i] == '\'')) {
+        quote = text[i];
+      } else if (!quote && isspace(text[i])) {
+        break;
+      } else {
+        arg += text[i];
+      }
+    }
+    args.push_back(arg);
+  }
+}
+
+// Errors outside of compileFile() and generateCode(), e.g. in grammar.rule, still exit with their code.
+int main(int argc, const char **argv) try {
+  if (argc >= 4 && string(argv[1]) == "--emit-parse-table") {
+    auto kind = grammar::Table_LALR1;
+
+    if (argc == 5 && string(argv[2]) == "--slr1") {
+      kind = grammar::Table_SLR1;
+    } else if (argc == 5 && string(argv[2]) == "--lr1") {
+      kind = grammar::Table_CanonicalLR1;
+    } else if (argc != 4) {
+      cerr << "ERROR: Usage: toycpp --emit-parse-table [--slr1|--lr1] <grammar> "
+              "<header>"
+           << endl;
+      exit(-1);
+    }
+
+    grammar::generateParseTableHeader(argv[argc - 2], argv[argc - 1], kind);
+    return 0;
+  }
+
+  if (argc >= 2 && string(argv[1]) == "--server") {
+    if (argc > 3) {
+      cerr << "ERROR: Usage: toycpp --server [<socket>]" << endl;
+      exit(-1);
+    }
+    return runServer(argc == 3 ? argv[2] : DEFAULT_SOCKET);
+  }
+
+  if (argc >= 2 && string(argv[1]) == "--client") {
+    bool useGlr = false, generate = false, fasm = false;
+    vector<string> paths;
+    for (int i = 3; i < argc; i++) {
+      string arg = argv[i];
+      if (arg == "--glr") {
+        useGlr = true;
+      } else if (arg == "--compile") {
+        generate = true;
+      } else if (arg == "--fasm") {
+        fasm = true;
+      } else {
+        paths.push_back(arg);
+      }
+    }
+
+    if (argc < 3 || paths.size() != 2 || (fasm && !generate)) {
+      cerr << "ERROR: Usage: toycpp --client <socket> [--glr] [--compile [--fasm]] "
+              "<file> <output>"
+           << endl;
+      exit(-1);
+    }
+
+    std::optional<compile::OutputFormat> format;
+    if (generate) {
+      format = fasm ? compile::OutputFormat::Fasm : compile::OutputFormat::Executable;
+    }
+    return runClient(argv[2], paths[0], paths[1], useGlr, format);
+  }
+
+  vector<string> args;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '@') {
+      readResponseFile(argv[i] + 1, args);
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+
+  bool useGlr = false, stream = false, generate = false, printPeepholeStats = false;
+  auto format = compile::OutputFormat::Executable;
+  std::optional<string> output;
+  bool badArgs = false;
+  vector<string> filenames;
+  for (size_t i = 0; i < args.size(); i++) {
+    const string &arg = args[i];
+    if (arg == "--glr") {
+      useGlr = true;
+    } else if (arg == "--stream") {
+      stream = true;
+    } else if (arg == "--compile") {
+      generate = true;
+    } else if (arg == "--fasm") {
+      format = compile::OutputFormat::Fasm;
+    } else if (arg == "--peephole-stats") {
+      printPeepholeStats = true;
+    } else if (arg == "-o") {
+      // -o needs a path after it, and can only be given once.
+      if (i + 1 == args.size() || output.has_value()) badArgs = true;
+      if (i + 1 < args.size()) output = args[++i];
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+
+  bool compileOnlyFlags = format == compile::OutputFormat::Fasm || printPeepholeStats ||
+                          output.has_value();
+  if (badArgs || filenames.empty() ||
+      (stream && (useGlr || generate || filenames.size() > 1)) ||
+      (!generate && compileOnlyFlags) || (output.has_value() && filenames.size() > 1)) {
+    cerr << "ERROR: Usage: toycpp [--glr] <file>... (or @<file> to read arguments from)"
+         << endl
+         << "       toycpp --compile [--glr] [--fasm] [--peephole-stats] <file>... "
+            "[-o <output>]"
+         << endl
+         << "       toycpp --stream <file>" << endl;
     exit(-1);
   }
 
-  ifstream source_file(argv[1]);
-  if (!source_file.is_open() || !source_file.good()) {
-    cerr << "ERROR: Failed to read or open ''" << argv[1] << "'!";
-    exit(1);
+  // Where each file gets compiled into, which has to be somewhere no other file goes,
+  // and isn't one of the files being compiled.
+  vector<string> outputPaths;
+  if (generate && filenames.size() > 1) {
+    std::unordered_map<string, const string *> compiledInto;
+    for (const string &filename : filenames) compiledInto.emplace(filename, nullptr);
+
+    for (const string &filename : filenames) {
+      outputPaths.push_back(outputPathFor(filename, format));
+      auto [it, inserted] = compiledInto.emplace(outputPaths.back(), &filename);
+      if (inserted) continue;
+
+      cerr << "ERROR: '" << filename << "' would be compiled into '" << it->first << "', ";
+      if (it->second) {
+        cerr << "and so would '" << *it->second << "'!" << endl;
+      } else {
+        cerr << "which is one of the files being compiled!" << endl;
+      }
+      exit(-1);
+    }
+  }
+
+  grammar::Grammar *grammar = grammar::defaultGrammar();
+  const unsigned numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  if (stream) return compileFileStreaming(grammar, filenames[0], cout);
+  if (generate && filenames.size() == 1) {
+    compile::PeepholeStats stats;
+    int exitCode = generateCode(grammar, filenames[0], useGlr, format,
+                                output.value_or(outputPathFor("-", format)),
+                                printPeepholeStats ? &stats : nullptr);
+    if (exitCode == 0 && printPeepholeStats) cout << stats;
+    return exitCode;
   }
+  if (filenames.size() == 1) {
+    return compileFile(grammar, filenames[0], useGlr, numThreads, cout);
+  }
+
+  // Every file gets compiled on its own, with its output and diagnostics collected
+  // and printed in the order the files were given.
+  struct Result {
+    std::ostringstream output, diagnostics;
+    compile::PeepholeStats peepholeStats;
+    int exitCode = 0;
+    bool done = false;
+  };
+
+  vector<Result> results(filenames.size());
+  std::mutex resultsMutex;
+  std::condition_variable resultDone;
+
+  // Lexing big files in parallel only pays off while there are cores to spare.
+  const unsigned numLexThreads = std::max<size_t>(numThreads / filenames.size(), 1);
+
+  ThreadPool pool(std::min<size_t>(numThreads, filenames.size()));
+  for (size_t i = 0; i < filenames.size(); i++) {
+    pool.submit([&, i] {
+      Result &result = results[i];
 
-  string sourceCode = slurp(source_file);
-  lex::Lexer lexer(argv[1], sourceCode);
-  grammar::Grammar *grammar = grammar::parseGrammarFile("grammar.rule");
+      diagnosticStream = &result.diagnostics;
+      int exitCode =
+          generate ? generateCode(grammar, filenames[i], useGlr, format, outputPaths[i],
+                                  printPeepholeStats ? &result.peepholeStats : nullptr)
+                   : compileFile(grammar, filenames[i], useGlr, numLexThreads,
+                                 result.output);
+      diagnosticStream = &cerr;
 
-  grammar::Node rootNode = grammar::parse(grammar, lexer);
-  grammar::printNodeTree(rootNode);
+      std::lock_guard lock(resultsMutex);
+      result.exitCode = exitCode;
+      result.done = true;
+      resultDone.notify_all();
+    });
+  }
+
+  int exitCode = 0;
+  compile::PeepholeStats peepholeStats;
+  for (auto &result : results) {
+    {
+      std::unique_lock lock(resultsMutex);
+      resultDone.wait(lock, [&] { return result.done; });
+    }
+
+    cout << result.output.str() << std::flush;
+    cerr << result.diagnostics.str() << std::flush;
+    if (exitCode == 0) exitCode = result.exitCode;
+    peepholeStats += result.peepholeStats;
+
+    // Free the output as soon as it's printed.
+    result.output = {};
+    result.diagnostics = {};
+  }
 
-  return 0;
+  if (exitCode == 0 && printPeepholeStats) cout << peepholeStats;
+  return exitCode;
+} catch (const FatalError &error) {
+  return error.exitCode;
 }
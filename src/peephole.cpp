@@ -0,0 +1,157 @@
+#include "peephole.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace compile {
+using std::vector;
+
+namespace {
+/// A rule looks at the last `size` records that are left, and rewrites them (deleting
+/// records as it sees fit) if they match.
+struct Rule {
+  const char *name;
+  size_t size;
+  bool (*apply)(Record *window[]);
+};
+
+const Rule RULES[] = {
+    {"adding 0", 1,
+     [](Record *w[]) {
+       // Like what `x + 0` becomes.
+       if (!(w[0]->is(Mnemonic::add, 2) || w[0]->is(Mnemonic::sub, 2))) return false;
+       if (w[0]->operands[1] != Operand::imm(0)) return false;
+       w[0]->kind = Record::Deleted;
+       return true;
+     }},
+    {"self move", 1,
+     [](Record *w[]) {
+       if (!w[0]->is(Mnemonic::mov, 2) || w[0]->operands[0] != w[0]->operands[1]) {
+         return false;
+       }
+       w[0]->kind = Record::Deleted;
+       return true;
+     }},
+    {"reload after store", 2,
+     [](Record *w[]) {
+       // `mov a, b` then `mov b, a`: b already is what it'd be set to.
+       if (!w[0]->is(Mnemonic::mov, 2) || !w[1]->is(Mnemonic::mov, 2)) return false;
+       if (w[0]->operands[0] != w[1]->operands[1] ||
+           w[0]->operands[1] != w[1]->operands[0]) {
+         return false;
+       }
+       w[1]->kind = Record::Deleted;
+       return true;
+     }},
+    {"repeated move", 2,
+     [](Record *w[]) {
+       // The same `mov a, b` twice, as long as the first one didn't change b, which
+       // only the stack pointer could be in the way of.
+       if (!w[0]->is(Mnemonic::mov, 2) || !w[1]->is(Mnemonic::mov, 2)) return false;
+       const Operand &dest = w[0]->operands[0], &source = w[0]->operands[1];
+       if (dest != w[1]->operands[0] || source != w[1]->operands[1]) return false;
+       if (dest == source ||
+           (dest.kind == Operand::Register && source.kind == Operand::Memory &&
+            regNumber(dest.base) == regNumber(source.base))) {
+         return false;
+       }
+       w[1]->kind = Record::Deleted;
+       return true;
+     }},
+    {"jump to next line", 2,
+     [](Record *w[]) {
+       if (!w[0]->is(Mnemonic::jmp, 1) || w[1]->kind != Record::Label) return false;
+       if (w[0]->operands[0] != Operand::label(w[1]->index)) return false;
+       w[0]->kind = Record::Deleted;
+       return true;
+     }},
+    {"mov/add into lea", 2,
+     [](Record *w[]) {
+       // `mov a, b` then `add a, c` is `lea a, [b+c]`, with a, b and c registers or c a
+       // constant. lea doesn't set flags, but nothing after an add looks at them.
+       if (!w[0]->is(Mnemonic::mov, 2) || !w[1]->is(Mnemonic::add, 2)) return false;
+       const Operand &dest = w[0]->operands[0], &base = w[0]->operands[1];
+       const Operand &addend = w[1]->operands[1];
+       if (w[1]->operands[0] != dest || !dest.isReg32() || !base.isReg32()) {
+         return false;
+       }
+
+       // The address is computed with 64-bit registers, whose lower half is the same.
+       Operand address;
+       if (addend.isReg32() && addend != dest) {
+         address = Operand::address(reg64(base.base), reg64(addend.base));
+       } else if (addend.kind == Operand::Immediate) {
+         address = Operand::address(reg64(base.base), addend.value);
+       } else {
+         return false;
+       }
+
+       w[0]->kind = Record::Deleted;
+       w[1]->mnemonic = Mnemonic::lea;
+       w[1]->operands[1] = address;
+       return true;
+     }},
+};
+
+constexpr size_t WINDOW_SIZE = 2;
+} // namespace
+
+PeepholeStats &PeepholeStats::operator+=(const PeepholeStats &other) {
+  for (const auto &[rule, count] : other.rewrites) rewrites[rule] += count;
+  instructionsBefore += other.instructionsBefore;
+  instructionsAfter += other.instructionsAfter;
+  return *this;
+}
+
+std::ostream &operator<<(std::ostream &os, const PeepholeStats &stats) {
+  os << "Peephole: " << stats.instructionsBefore << " -> " << stats.instructionsAfter
+     << " instructions\n";
+  for (const auto &[rule, count] : stats.rewrites) {
+    os << "  " << rule << ": " << count << "\n";
+  }
+  return os;
+}
+
+void optimizePeephole(Assembly &assembly, size_t start, PeepholeStats &stats) {
+  // The instructions and labels that are left so far, the last few of which are the
+  // window the rules look at. Whenever one of them rewrites something, they all get
+  // another look, since that might have made something else match.
+  vector<Record *> kept;
+  for (size_t i = start; i < assembly.records.size(); i++) {
+    Record &record = assembly.records[i];
+    switch (record.kind) {
+    case Record::Instruction: stats.instructionsBefore++; break;
+    case Record::Label      : break;
+    case Record::Text:
+      // Inline assembly is the user's business, so nothing gets optimized across it.
+      kept.clear();
+      continue;
+    default: continue;
+    }
+    kept.push_back(&record);
+
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (const Rule &rule : RULES) {
+        if (kept.size() < rule.size) continue;
+
+        Record *window[WINDOW_SIZE];
+        std::copy(kept.end() - rule.size, kept.end(), window);
+        if (!rule.apply(window)) continue;
+
+        stats.rewrites[rule.name]++;
+        kept.erase(std::remove_if(kept.end() - rule.size, kept.end(),
+                                  [](Record *r) { return r->kind == Record::Deleted; }),
+                   kept.end());
+        changed = true;
+        break;
+      }
+    }
+  }
+
+  for (size_t i = start; i < assembly.records.size(); i++) {
+    if (assembly.records[i].kind == Record::Instruction) stats.instructionsAfter++;
+  }
+}
+} // namespace compile
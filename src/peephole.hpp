@@ -0,0 +1,34 @@
+#pragma once
+
+#include "asm.hpp"
+
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+
+// A peephole optimizer over generated assembly (see asm.hpp): it looks at a few
+// instructions at a time, and rewrites the ones that match a rule (see RULES in
+// peephole.cpp) into something shorter.
+
+namespace compile {
+using std::string;
+
+struct PeepholeStats {
+  /// By rule, how often it rewrote something.
+  std::map<string, size_t> rewrites;
+  /// The instructions that went in, and the ones that came out.
+  size_t instructionsBefore = 0;
+  size_t instructionsAfter = 0;
+
+  PeepholeStats &operator+=(const PeepholeStats &other);
+};
+
+std::ostream &operator<<(std::ostream &os, const PeepholeStats &stats);
+
+/// Optimize the records of `assembly` from `start` on, which have to come from the
+/// code generator - a label wherever control flow can get to from anywhere but the
+/// line before, and nothing looking at the flags set by an instruction other than
+/// cmp. Counts the rewrites into `stats`.
+void optimizePeephole(Assembly &assembly, size_t start, PeepholeStats &stats);
+} // namespace compile
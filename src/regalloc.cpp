@@ -0,0 +1,83 @@
+#include "regalloc.hpp"
+
+#include <algorithm>
+
+namespace compile {
+namespace {
+/// The registers values can go in, the caller-saved ones first: those don't need
+/// saving, so only values that have to survive a call should get the others. rbp comes
+/// last, since it's the frame pointer in functions that need one (see Frame).
+constexpr reg ALLOCATABLE[] = {
+    reg::ecx,  reg::edx,  reg::esi,  reg::edi,  reg::r8d,  reg::r9d,  reg::r10d,
+    reg::ebx,  reg::r12d, reg::r13d, reg::r14d, reg::r15d, reg::ebp,
+};
+
+bool fits(const LiveInterval &interval, reg r) {
+  return !(interval.clobbered & regBit(r));
+}
+} // namespace
+
+Allocation allocateRegisters(vector<LiveInterval> intervals, size_t numValues) {
+  Allocation result;
+  result.registers.resize(numValues);
+
+  std::sort(intervals.begin(), intervals.end(), [](const auto &a, const auto &b) {
+    return a.start != b.start ? a.start < b.start : a.value < b.value;
+  });
+
+  // The intervals that currently have a register, along with it.
+  vector<std::pair<const LiveInterval *, reg>> active;
+  bool isFree[NUM_REGISTERS];
+  std::fill(std::begin(isFree), std::end(isFree), false);
+  for (reg r : ALLOCATABLE) isFree[regNumber(r)] = true;
+
+  for (const LiveInterval &interval : intervals) {
+    // Free up the registers of everything that's dead by now.
+    active.erase(std::remove_if(active.begin(), active.end(),
+                                [&](const auto &entry) {
+                                  if (entry.first->end > interval.start) return false;
+                                  isFree[regNumber(entry.second)] = true;
+                                  return true;
+                                }),
+                 active.end());
+
+    optional<reg> chosen;
+    for (reg r : ALLOCATABLE) {
+      if (isFree[regNumber(r)] && fits(interval, r)) {
+        chosen = r;
+        break;
+      }
+    }
+
+    if (!chosen.has_value()) {
+      // Out of registers: take one from whatever lives the longest past this, if that's
+      // longer than this one does, and spill that instead.
+      auto victim = active.end();
+      for (auto it = active.begin(); it != active.end(); ++it) {
+        if (fits(interval, it->second) &&
+            (victim == active.end() || it->first->end > victim->first->end)) {
+          victim = it;
+        }
+      }
+      if (victim == active.end() || victim->first->end <= interval.end) continue;
+
+      chosen = victim->second;
+      result.registers[victim->first->value].reset();
+      active.erase(victim);
+    }
+
+    isFree[regNumber(*chosen)] = false;
+    result.registers[interval.value] = chosen;
+    active.push_back({&interval, *chosen});
+  }
+
+  // Every callee-saved register that ended up with a value has to be saved.
+  for (reg r : ALLOCATABLE) {
+    bool used = std::find(result.registers.begin(), result.registers.end(),
+                          optional<reg>(r)) != result.registers.end();
+    if (isCalleeSaved(r) && used) result.savedRegs.push_back(r);
+  }
+
+  return result;
+}
+} // namespace compile
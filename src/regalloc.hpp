@@ -0,0 +1,57 @@
+#pragma once
+
+#include "compile.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Register allocation by linear scan, over whatever the values being allocated are -
+// all it needs is where each of them is live.
+
+namespace compile {
+using std::vector, std::optional;
+
+/// Where a value is live: from the position it's first needed in a register up to the
+/// last position it's read at. A value whose interval ends where another one's starts
+/// can share its register, so whoever emits the code has to read every operand of an
+/// instruction before writing its result.
+struct LiveInterval {
+  /// Which value this is, as an index into Allocation::registers.
+  size_t value;
+  uint32_t start;
+  uint32_t end;
+
+  /// The registers something overwrites while the value is live (see regBit()), which
+  /// it can't go in - e.g. the caller-saved ones if it's live across a call, or all of
+  /// them across inline assembly, so it has to stay on the stack.
+  uint32_t clobbered = 0;
+};
+
+inline uint32_t regBit(reg r) { return uint32_t(1) << regNumber(r); }
+
+/// The registers a call might overwrite (System V ABI).
+inline uint32_t callerSavedRegs() {
+  uint32_t mask = 0;
+  for (unsigned i = 0; i < NUM_REGISTERS; i++) {
+    if (!isCalleeSaved(reg(i))) mask |= regBit(reg(i));
+  }
+  return mask;
+}
+
+struct Allocation {
+  /// By value, the (32-bit) register it got, or nothing if it has to be spilled.
+  vector<optional<reg>> registers;
+  /// Every callee-saved register that was handed out, which the function has to save
+  /// on entry and restore before it returns.
+  vector<reg> savedRegs;
+};
+
+/// Give each of `numValues` values a register, by walking the intervals in the order
+/// they start and handing out whatever register is free. Where more are live at once
+/// than there are registers, whichever of them ends last gets spilled. Values without
+/// an interval don't get one. rax, r11 and rsp are never handed out - rax and r11 are
+/// left for the code generator to compute things in. rbp is, unless it's clobbered.
+Allocation allocateRegisters(vector<LiveInterval> intervals, size_t numValues);
+} // namespace compile
@@ -0,0 +1,244 @@
+#include "scan.hpp"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOYCPP_SCAN_X86 1
+#endif
+
+namespace lex::scan {
+namespace {
+enum CharClass : uint8_t {
+  CC_Whitespace = 1 << 0,
+  CC_Newline = 1 << 1,
+  CC_Separator = 1 << 2,
+};
+
+constexpr std::array<uint8_t, 256> makeCharClasses() {
+  std::array<uint8_t, 256> classes{};
+
+  for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+    classes[c] |= CC_Whitespace | CC_Separator;
+  for (unsigned char c : {'\n', '\r'})
+    classes[c] |= CC_Newline;
+  for (const char *c = "()[]{}.,:;-+/*^|&!%~\'\"<>?="; *c; c++)
+    classes[(unsigned char)*c] |= CC_Separator;
+
+  return classes;
+}
+
+constexpr std::array<uint8_t, 256> charClasses = makeCharClasses();
+
+inline bool hasClass(char c, uint8_t cls) {
+  return charClasses[(unsigned char)c] & cls;
+}
+
+// Scalar kernels, which also finish off the last few bytes for the SIMD ones.
+
+const char *skipWhitespaceScalar(const char *p, const char *end) {
+  while (p < end && hasClass(*p, CC_Whitespace))
+    p++;
+  return p;
+}
+
+const char *findWordEndScalar(const char *p, const char *end) {
+  while (p < end && !hasClass(*p, CC_Separator))
+    p++;
+  return p;
+}
+
+const char *findNewlineScalar(const char *p, const char *end) {
+  while (p < end && !hasClass(*p, CC_Newline))
+    p++;
+  return p;
+}
+
+#ifdef TOYCPP_SCAN_X86
+// The SIMD kernels are written once against an ISA whose masks have one bit per byte
+// of a `Isa::width` byte chunk, and instantiated for SSE2 and AVX2. Bytes >= 0x80 are
+// negative as signed chars, so they never fall in any of the ranges below.
+
+#define TOYCPP_SCAN_AVX2 __attribute__((target("avx2")))
+// Inline everything a kernel calls into it, including the scalar code for the tail.
+#define TOYCPP_SCAN_KERNEL __attribute__((flatten))
+
+struct Sse2 {
+  static constexpr int width = 16;
+
+  static inline __m128i load(const char *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  }
+
+  static inline __m128i inRange(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+  }
+
+  static inline uint32_t newlines(const char *p) {
+    __m128i v = load(p);
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                          _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+  }
+
+  static inline uint32_t whitespace(const char *p) {
+    __m128i v = load(p);
+    return _mm_movemask_epi8(
+        _mm_or_si128(inRange(v, '\t', '\r'), _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))));
+  }
+
+  /// [0-9A-Za-z_], which covers nearly every character of a word.
+  static inline uint32_t wordChars(const char *p) {
+    __m128i v = load(p);
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return _mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(inRange(v, '0', '9'), inRange(lower, 'a', 'z')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+  }
+};
+
+struct Avx2 {
+  static constexpr int width = 32;
+
+  static inline TOYCPP_SCAN_AVX2 __m256i load(const char *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  }
+
+  static inline TOYCPP_SCAN_AVX2 __m256i inRange(__m256i v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+  }
+
+  static inline TOYCPP_SCAN_AVX2 uint32_t newlines(const char *p) {
+    __m256i v = load(p);
+    return _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+  }
+
+  static inline TOYCPP_SCAN_AVX2 uint32_t whitespace(const char *p) {
+    __m256i v = load(p);
+    return _mm256_movemask_epi8(_mm256_or_si256(
+        inRange(v, '\t', '\r'), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))));
+  }
+
+  static inline TOYCPP_SCAN_AVX2 uint32_t wordChars(const char *p) {
+    __m256i v = load(p);
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    return _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_or_si256(inRange(v, '0', '9'), inRange(lower, 'a', 'z')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))));
+  }
+};
+
+template<typename Isa>
+constexpr uint32_t fullMask = Isa::width == 32 ? UINT32_MAX : (1u << Isa::width) - 1;
+
+template<typename Isa>
+inline const char *skipWhitespace(const char *p, const char *end) {
+  for (; end - p >= Isa::width; p += Isa::width) {
+    if (uint32_t other = ~Isa::whitespace(p) & fullMask<Isa>) {
+      return p + __builtin_ctz(other);
+    }
+  }
+  return skipWhitespaceScalar(p, end);
+}
+
+template<typename Isa>
+inline const char *findWordEnd(const char *p, const char *end) {
+  while (end - p >= Isa::width) {
+    uint32_t other = ~Isa::wordChars(p) & fullMask<Isa>;
+    if (!other) {
+      p += Isa::width;
+      continue;
+    }
+
+    // Something other than a letter, digit or '_' - rare characters like '$' or
+    // UTF-8 continue the word, anything in the separator table ends it.
+    p += __builtin_ctz(other);
+    if (hasClass(*p, CC_Separator)) return p;
+    p++;
+  }
+  return findWordEndScalar(p, end);
+}
+
+template<typename Isa>
+inline const char *findNewline(const char *p, const char *end) {
+  for (; end - p >= Isa::width; p += Isa::width) {
+    if (uint32_t mask = Isa::newlines(p)) return p + __builtin_ctz(mask);
+  }
+  return findNewlineScalar(p, end);
+}
+
+// The AVX2 intrinsics can only be inlined into functions targeting AVX2, so each
+// kernel gets the templates (and everything they call) flattened into it.
+
+TOYCPP_SCAN_KERNEL const char *skipWhitespaceSse2(const char *p, const char *end) {
+  return skipWhitespace<Sse2>(p, end);
+}
+TOYCPP_SCAN_KERNEL const char *findWordEndSse2(const char *p, const char *end) {
+  return findWordEnd<Sse2>(p, end);
+}
+TOYCPP_SCAN_KERNEL const char *findNewlineSse2(const char *p, const char *end) {
+  return findNewline<Sse2>(p, end);
+}
+
+#define TOYCPP_SCAN_AVX2_KERNEL TOYCPP_SCAN_KERNEL TOYCPP_SCAN_AVX2
+
+TOYCPP_SCAN_AVX2_KERNEL const char *skipWhitespaceAvx2(const char *p, const char *end) {
+  return skipWhitespace<Avx2>(p, end);
+}
+TOYCPP_SCAN_AVX2_KERNEL const char *findWordEndAvx2(const char *p, const char *end) {
+  return findWordEnd<Avx2>(p, end);
+}
+TOYCPP_SCAN_AVX2_KERNEL const char *findNewlineAvx2(const char *p, const char *end) {
+  return findNewline<Avx2>(p, end);
+}
+#endif
+
+const Kernels scalar{
+    .skipWhitespace = skipWhitespaceScalar,
+    .findWordEnd = findWordEndScalar,
+    .findNewline = findNewlineScalar,
+    .name = "scalar",
+};
+
+#ifdef TOYCPP_SCAN_X86
+const Kernels sse2{
+    .skipWhitespace = skipWhitespaceSse2,
+    .findWordEnd = findWordEndSse2,
+    .findNewline = findNewlineSse2,
+    .name = "sse2",
+};
+
+const Kernels avx2{
+    .skipWhitespace = skipWhitespaceAvx2,
+    .findWordEnd = findWordEndAvx2,
+    .findNewline = findNewlineAvx2,
+    .name = "avx2",
+};
+#endif
+} // namespace
+
+const Kernels &kernels() {
+  static const Kernels &best = *supportedKernels().back();
+  return best;
+}
+
+const Kernels &scalarKernels() { return scalar; }
+
+std::vector<const Kernels *> supportedKernels() {
+  std::vector<const Kernels *> result{&scalar};
+#ifdef TOYCPP_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) result.push_back(&sse2);
+  if (__builtin_cpu_supports("avx2")) result.push_back(&avx2);
+#endif
+  return result;
+}
+
+bool isWordSeparator(char c) { return hasClass(c, CC_Separator); }
+
+} // namespace lex::scan
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Kernels for the lexer's hot loops, which classify 16 or 32 bytes of source code at
+// a time with SSE2 or AVX2 when the CPU has them, and fall back to a byte at a time
+// otherwise. All of them stop at `end` and never read past it.
+
+namespace lex::scan {
+
+struct Kernels {
+  /// Skip spaces, tabs and line breaks, returning the first other character.
+  const char *(*skipWhitespace)(const char *p, const char *end);
+
+  /// Find the end of an identifier or number - the first whitespace or punctuation.
+  const char *(*findWordEnd)(const char *p, const char *end);
+
+  /// Find the first '\n' or '\r', or `end` if there isn't one.
+  const char *(*findNewline)(const char *p, const char *end);
+
+  /// What the kernels use, e.g. "avx2", for diagnostics and benchmarks.
+  const char *name;
+};
+
+/// The fastest kernels this CPU supports, picked the first time this is called.
+const Kernels &kernels();
+
+/// The plain C++ kernels, regardless of what the CPU supports.
+const Kernels &scalarKernels();
+
+/// Every set of kernels this CPU can run, from the scalar ones to the fastest, so they
+/// can be checked against each other.
+std::vector<const Kernels *> supportedKernels();
+
+/// True for whitespace and the punctuation that ends a word (see Kernels::findWordEnd).
+bool isWordSeparator(char c);
+
+} // namespace lex::scan
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "grammar.hpp"
+#include "lex.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The grammar's rules and the LR table built from them, shared by the LR parser in
+// grammar.cpp and the GLR parser in glr.cpp.
+
+namespace grammar {
+using std::string, std::vector, std::map;
+
+enum TerminalToken {
+  TT_Invalid,
+  TT_Empty,
+  TT_Identifier,
+  TT_IntegerLiteral,
+  TT_FloatLiteral,
+  TT_DoubleLiteral,
+  TT_CharLiteral,
+  TT_StringLiteral,
+  TT_Eof,
+};
+
+enum RuleTargetType { RT_TerminalToken, RT_String, RT_Rule };
+
+struct Rule {
+  struct Target {
+  private:
+    Target() {}
+
+  public:
+    Target(TerminalToken token) : type(RT_TerminalToken), token(token) {}
+    Target(string string) : type(RT_String), str(string) {}
+    Target(const Rule &rule) : type(RT_Rule), str(rule.name) {}
+
+    inline bool isTerminal() const { return !isNonTerminal(); }
+    inline bool isNonTerminal() const { return type == RT_Rule; }
+
+    static Target RuleByName(string ruleName) {
+      Target t;
+      t.type = RT_Rule;
+      t.str = ruleName;
+      return t;
+    }
+
+    inline bool operator==(const Target &other) const {
+      if (type != other.type) return false;
+
+      switch (type) {
+      case RT_TerminalToken:
+        if (token == TT_Identifier && other.token == TT_Identifier) {
+          return str == other.str;
+        } else {
+          return token == other.token;
+        }
+
+      case RT_Rule:
+      case RT_String: return str == other.str;
+      }
+      return false;
+    }
+
+    RuleTargetType type;
+    string str;
+    TerminalToken token = TT_Invalid;
+  };
+
+  using AlternativeT = vector<Target>;
+
+  string name;
+  vector<vector<Target>> alternatives;
+  /// For each alternative, the name after its `%prec`, whose precedence it takes
+  /// instead of its last operator's, or "" if it doesn't have one.
+  vector<string> precedences;
+};
+
+/// How tightly an operator binds, from a `%left` or `%right` line of the grammar. Where
+/// reducing by a production conflicts with shifting an operator, the table does
+/// whichever binds tighter: the operator, or the production's last operator.
+struct Precedence {
+  /// Lines further down bind tighter, starting at 1.
+  int level;
+  /// For operators on the same level, whether `a op b op c` is (a op b) op c, so the
+  /// table reduces instead of shifting.
+  bool isLeftAssociative;
+};
+
+std::ostream &operator<<(std::ostream &os, const Rule::Target &target);
+std::ostream &operator<<(std::ostream &os, TerminalToken token);
+bool operator<(const Rule::Target &lhs, const Rule::Target &rhs);
+
+template<typename T>
+std::ostream &operator<<(std::ostream &os, const vector<T> &vector) {
+  os << "[";
+  for (size_t i = 0; i < vector.size(); i++) {
+    os << vector[i];
+    if (i < vector.size() - 1) os << ", ";
+  }
+  os << "]";
+  return os;
+}
+
+/// Entries of ParseTable::actions. Positive values shift (or, for non-terminals, go
+/// to) state `action - 1`, negative values reduce by production `-action - 1`.
+using Action = int32_t;
+
+constexpr Action ACTION_ERROR = 0;
+
+inline Action shiftAction(size_t state) { return Action(state) + 1; }
+inline Action reduceAction(size_t production) { return -Action(production) - 1; }
+inline bool isShift(Action action) { return action > 0; }
+inline bool isReduce(Action action) { return action < 0; }
+inline size_t shiftTarget(Action action) { return action - 1; }
+inline size_t reduceProduction(Action action) { return -(action + 1); }
+
+struct TableProduction {
+  /// The symbol of the rule to reduce to.
+  int32_t lhs;
+  /// The number of items to pop off the stack when reducing.
+  uint32_t numPop;
+  /// Where the production's symbols start in ParseTable::rhsSymbols.
+  uint32_t firstSymbol;
+};
+
+/// One of possibly several things the GLR parser does for a (state, lookahead).
+struct GlrAction {
+  Action action;
+  /// For reductions, how many symbols to pop. This can be less than the production's
+  /// numPop if the rest of it can be empty (a "right-nulled" reduction).
+  uint32_t length;
+};
+
+/// An array of table data that's either owned, or points into the parse table that
+/// was compiled into the binary.
+template<typename T>
+class TableArray {
+public:
+  TableArray() = default;
+  TableArray(const TableArray &) = delete;
+  TableArray(TableArray &&) = default;
+  TableArray &operator=(TableArray &&) = default;
+
+  void assign(vector<T> data) {
+    storage = std::move(data);
+    ptr = storage.data();
+    count = storage.size();
+  }
+
+  void borrow(const T *data, size_t size) {
+    storage.clear();
+    ptr = data;
+    count = size;
+  }
+
+  inline const T &operator[](size_t i) const { return ptr[i]; }
+  inline const T *begin() const { return ptr; }
+  inline const T *end() const { return ptr + count; }
+  inline const T *data() const { return ptr; }
+  inline size_t size() const { return count; }
+
+private:
+  const T *ptr = nullptr;
+  size_t count = 0;
+  vector<T> storage;
+};
+
+struct ParseTable {
+  size_t numStates = 0;
+
+  /// Every symbol of the grammar, indexed by symbol ID.
+  vector<Rule::Target> symbols;
+
+  /// Every production, indexed by production number. Production 0 is T -> program,
+  /// which accepts the input when reduced.
+  TableArray<TableProduction> productions;
+
+  /// The right hand sides of all productions, one after another.
+  TableArray<int32_t> rhsSymbols;
+
+  /// For every symbol that can derive nothing at all, the production to derive that
+  /// with in the fewest steps, and -1 for every other symbol.
+  TableArray<int32_t> epsilonProductions;
+
+  /// A `numStates × symbols.size()` matrix of actions. For terminals that's the
+  /// shift/reduce to do on that lookahead, for non-terminals the state to go to.
+  TableArray<Action> actions;
+
+  /// For each state, a reduction to do without looking at the next token at all, or
+  /// ACTION_ERROR. Set for states with a single reduction and nothing to shift.
+  TableArray<Action> defaultActions;
+
+  /// Every action for every (state, terminal), without resolving conflicts and
+  /// including right-nulled reductions, for the GLR parser. The actions of cell
+  /// `state * symbols.size() + symbol` are glrActions[glrCells[cell]] up to
+  /// glrActions[glrCells[cell + 1]].
+  TableArray<uint32_t> glrCells;
+  TableArray<GlrAction> glrActions;
+
+  /// Lets the lexer tag tokens with symbol IDs from this table.
+  lex::TerminalIds terminals;
+
+  inline Action action(size_t state, int32_t symbol) const {
+    return actions[state * symbols.size() + symbol];
+  }
+
+  inline const string &ruleName(size_t production) const {
+    return symbols[productions[production].lhs].str;
+  }
+
+  /// Fill in `terminals` from `symbols`. Must be called once `symbols` won't change.
+  void indexTerminals();
+};
+
+struct Grammar {
+  map<string, Rule> rules;
+  /// By operator spelling, or name used with `%prec`.
+  map<string, Precedence> precedences;
+
+  /// The LR table built from `rules`, either freshly, loaded from the cache or
+  /// compiled into the binary.
+  ParseTable table;
+};
+
+/// A node that doesn't have a parent yet, along with its last child so that more can
+/// be appended to its children in O(1).
+struct PendingNode {
+  NodeId node;
+  NodeId lastChild = NO_NODE;
+};
+
+/// Add a leaf for `token` to `tree`.
+PendingNode shiftNode(Tree &tree, const lex::Token &token);
+
+/// Add the node for reducing `children` to `symbol` to `tree`. The children of
+/// `_`-prefixed helper rules get inlined, as do those of a first child that's the same
+/// rule (i.e. a left-recursive list) - that one's node gets reused as is.
+PendingNode reduceNodes(Tree &tree, const ParseTable &table, int32_t symbol,
+                        const PendingNode *children, size_t numChildren);
+} // namespace grammar
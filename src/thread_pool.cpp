@@ -0,0 +1,100 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+/// The pool the current thread is a worker of, and its index in it.
+thread_local const ThreadPool *currentPool = nullptr;
+thread_local unsigned currentWorker = 0;
+} // namespace
+
+ThreadPool::ThreadPool(unsigned numThreads) {
+  numThreads = std::max(numThreads, 1u);
+  for (unsigned i = 0; i < numThreads; i++) {
+    _queues.push_back(std::make_unique<Queue>());
+  }
+  for (unsigned i = 0; i < numThreads; i++) {
+    _threads.emplace_back(&ThreadPool::work, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  wait();
+  {
+    std::lock_guard lock(_mutex);
+    _stopping = true;
+  }
+  _wakeUp.notify_all();
+
+  for (auto &thread : _threads)
+    thread.join();
+}
+
+void ThreadPool::submit(Task task) {
+  Queue &queue = currentPool == this ? *_queues[currentWorker] : _injected;
+
+  // Count the task before queueing it, so `_queued` never drops below zero. A worker
+  // that wakes up in between just looks again.
+  {
+    std::lock_guard lock(_mutex);
+    _pending++;
+    _queued++;
+  }
+  {
+    std::lock_guard lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+  }
+  _wakeUp.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock lock(_mutex);
+  _idle.wait(lock, [this] { return _pending == 0; });
+}
+
+bool ThreadPool::take(unsigned index, Task &task) {
+  // Our own queue, then the tasks from outside the pool, then everyone else's queues.
+  for (unsigned i = 0; i <= _queues.size(); i++) {
+    Queue &queue = i == 0 ? *_queues[index]
+                   : i == 1 ? _injected
+                            : *_queues[(index + i - 1) % _queues.size()];
+    std::lock_guard lock(queue.mutex);
+    if (queue.tasks.empty()) continue;
+
+    // Newest first from our own queue while it's still warm in the cache, oldest
+    // first from everyone else's. Whoever submits from outside, like the driver
+    // printing each file's output as soon as it can, usually waits for them in order.
+    if (i == 0) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    _queued--;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::work(unsigned index) {
+  currentPool = this;
+  currentWorker = index;
+
+  while (true) {
+    Task task;
+    if (take(index, task)) {
+      task();
+
+      std::lock_guard lock(_mutex);
+      if (--_pending == 0) _idle.notify_all();
+      continue;
+    }
+
+    // If a task was counted but isn't queued yet, this spins for a moment until it is.
+    std::unique_lock lock(_mutex);
+    _wakeUp.wait(lock, [this] { return _stopping || _queued > 0; });
+    if (_stopping && _queued == 0) return;
+  }
+}
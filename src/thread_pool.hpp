@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed set of worker threads that run tasks. Every worker has a queue of its own
+/// for the tasks it submits, which it takes from newest first. Once that runs dry, it
+/// takes the oldest task submitted from outside the pool, and then steals the oldest
+/// tasks from the other workers, so a few slow tasks don't hold up the rest.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit ThreadPool(unsigned numThreads);
+  ThreadPool(const ThreadPool &) = delete;
+
+  /// Waits for every task that was submitted to finish.
+  ~ThreadPool();
+
+  /// Run `task` on one of the workers. Tasks submitted by a worker go on its own
+  /// queue. Others go on a queue all workers share, and start in the order they were
+  /// submitted in.
+  void submit(Task task);
+
+  /// Wait until every submitted task has finished.
+  void wait();
+
+  inline unsigned size() const { return _threads.size(); }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void work(unsigned index);
+
+  /// Take a task from queue `index`, or else from `_injected`, or else steal one from
+  /// another queue.
+  bool take(unsigned index, Task &task);
+
+  std::vector<std::unique_ptr<Queue>> _queues;
+  /// Tasks submitted from outside the pool.
+  Queue _injected;
+  std::vector<std::thread> _threads;
+
+  /// Guards `_pending` and `_stopping`, and goes with the condition variables.
+  std::mutex _mutex;
+  std::condition_variable _wakeUp;
+  std::condition_variable _idle;
+
+  /// Tasks sitting in a queue, and tasks that were submitted but haven't finished.
+  std::atomic<size_t> _queued{0};
+  size_t _pending = 0;
+  bool _stopping = false;
+};
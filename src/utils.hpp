@@ -7,10 +7,13 @@
 #include <fstream>
 #include <initializer_list>
 #include <iostream>
+#include <memory>
 #include <ostream>
 #include <sstream>
 #include <string>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 struct Location {
@@ -34,17 +37,31 @@ struct Overloaded : Ts... {
 template<class... Ts>
 Overloaded(Ts...) -> Overloaded<Ts...>;
 
-// Thank you,
-// https://stackoverflow.com/a/116220
-inline std::string slurp(std::ifstream &in) {
-  if (!in.is_open() || !in.good()) {
-    abort();
+/// An allocator that default-initializes elements instead of value-initializing them,
+/// so that e.g. resizing a vector of ints leaves the new ones uninitialized rather
+/// than zeroing memory that's about to be overwritten anyway.
+template<typename T, typename Base = std::allocator<T>>
+class DefaultInitAllocator : public Base {
+  using Traits = std::allocator_traits<Base>;
+
+public:
+  template<typename U>
+  struct rebind {
+    using other = DefaultInitAllocator<U, typename Traits::template rebind_alloc<U>>;
+  };
+
+  using Base::Base;
+
+  template<typename U>
+  void construct(U *ptr) noexcept(std::is_nothrow_default_constructible_v<U>) {
+    ::new (static_cast<void *>(ptr)) U;
   }
 
-  std::ostringstream sstr;
-  sstr << in.rdbuf();
-  return sstr.str();
-}
+  template<typename U, typename... Args>
+  void construct(U *ptr, Args &&...args) {
+    Traits::construct(static_cast<Base &>(*this), ptr, std::forward<Args>(args)...);
+  }
+};
 
 /// A set that only includes elements that aren't equal to any other elements in
 /// the set. Comparison is done using operator==.
@@ -158,12 +175,28 @@ std::string format(const std::string &fmtStr, First f, Args &&...args) {
 
 enum ReportLevel { INFO, WARNING, ERROR };
 
+/// Where errors about the file being compiled go - std::cerr, unless this thread is
+/// compiling one of several files and collecting its diagnostics to print in order.
+inline thread_local std::ostream *diagnosticStream = &std::cerr;
+
+inline std::ostream &diagnostics() { return *diagnosticStream; }
+
+/// Thrown by fatalError(), for the driver to catch.
+struct FatalError {
+  int exitCode;
+};
+
+/// Give up on the file being compiled after an error's been reported. toycpp exits
+/// with `exitCode` once any other files are done.
+[[noreturn]] inline void fatalError(int exitCode) { throw FatalError{exitCode}; }
+
 /// Report something while including context from the source code.
 template<typename... Args>
 void reportWithContext(ReportLevel level, Location location, std::string fmt,
                        Args &&...args) {
-  using std::cerr, std::endl, std::string;
+  using std::endl, std::string;
 
+  std::ostream &cerr = diagnostics();
   cerr << location.filename << ":" << location.startLine << ":" << location.startColumn
        << ": ";
 
@@ -0,0 +1,391 @@
+// Compiling small programs, built straight as ASTs, has to give executables that exit
+// with what the programs return. Each is compiled both to an executable and to FASM,
+// which gets assembled with GNU as (see gas.hpp) if it's around. Programs with inline
+// assembly can only be compiled to FASM.
+
+#include "../../src/compile.hpp"
+#include "../../src/ir.hpp"
+#include "../../src/utils.hpp"
+#include "gas.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace ast;
+using std::string, std::to_string, std::vector;
+
+static int failures = 0;
+static string workDir;
+static bool useGnuAs;
+
+static Expression *expression(ExpressionType type) {
+  Expression *result = new Expression{};
+  result->type = type;
+  return result;
+}
+
+static Expression *num(int value) {
+  Expression *result = expression(Expr_IntConstant);
+  result->integer = value;
+  return result;
+}
+
+static Expression *var(const string &name) {
+  Expression *result = expression(Expr_VarAccess);
+  result->identifier = name;
+  return result;
+}
+
+static Expression *bin(BinaryOpType op, Expression *lhs, Expression *rhs) {
+  Expression *result = expression(Expr_BinaryOp);
+  result->binOpType = op;
+  result->lhs = lhs;
+  result->rhs = rhs;
+  return result;
+}
+
+static Expression *add(Expression *lhs, Expression *rhs) {
+  return bin(BinOp_Add, lhs, rhs);
+}
+
+static Expression *un(UnaryOpType op, Expression *operand) {
+  Expression *result = expression(Expr_UnaryOp);
+  result->unaryOpType = op;
+  result->lhs = operand;
+  return result;
+}
+
+static Statement def(const vector<string> &names) {
+  return VarDefStmt{Type{Int, "int"}, names};
+}
+
+static Statement defBool(const vector<string> &names) {
+  return VarDefStmt{Type{Bool, "bool"}, names};
+}
+
+static Statement assign(const string &name, Expression *value) {
+  return VarAssignStmt{name, *value};
+}
+
+static Statement ret(Expression *value) { return ReturnStatement{*value}; }
+static Statement call(const string &name) { return FuncCallStatement{name}; }
+static Statement asmText(const string &text) { return InlineAssemblyStatement{text}; }
+
+static FunctionDefinition fn(const string &name, const vector<string> &params,
+                             const vector<Statement> &body) {
+  vector<FuncParameter> parameters;
+  for (const string &param : params) {
+    parameters.push_back(FuncParameter{Type{Int, "int"}, param});
+  }
+  return FunctionDefinition{Type{Int, "int"}, name, parameters, body};
+}
+
+static FunctionDefinition fn(const string &name, const vector<Statement> &body) {
+  return fn(name, {}, body);
+}
+
+/// "prefix0", "prefix1", ... up to `count`.
+static vector<string> names(const string &prefix, int count) {
+  vector<string> result;
+  for (int i = 0; i < count; i++) result.push_back(prefix + to_string(i));
+  return result;
+}
+
+/// A main() that calls g() with `args` in edi, esi, ... and exits with what it returns,
+/// since there's no way to pass arguments to a call in the AST yet.
+static FunctionDefinition callG(const vector<int> &args) {
+  static const char *REGS[] = {"edi", "esi", "edx", "ecx"};
+  string text;
+  for (size_t i = 0; i < args.size(); i++) {
+    text += "  mov " + string(REGS[i]) + ", " + to_string(args[i]) + "\n";
+  }
+  text += "  call g\n  mov edi, eax\n  mov eax, 60\n  syscall";
+  return fn("main", {asmText(text), ret(num(0))});
+}
+
+static int run(const string &path) {
+  int status = system(path.c_str());
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void report(const string &what, int exitCode, int expected, size_t size) {
+  if (exitCode == expected) {
+    printf("ok   %s (%zu bytes)\n", what.c_str(), size);
+  } else {
+    printf("FAIL %s: exited with %d, expected %d\n", what.c_str(), exitCode, expected);
+    failures++;
+  }
+}
+
+static void check(const char *name, const Program &program, int expected) {
+  const string base = workDir + "/" + name;
+
+  try {
+    string executable = compile::compileProgram(program);
+    std::ofstream(base, std::ios::binary | std::ios::trunc) << executable;
+    chmod(base.c_str(), 0755);
+    report(name, run(base), expected, executable.size());
+  } catch (const FatalError &) {
+    // Inline assembly, which only FASM output can have.
+  }
+
+  if (!useGnuAs) return;
+  string fasm = compile::compileProgram(program, compile::OutputFormat::Fasm);
+  std::ofstream(base + ".s", std::ios::trunc) << fasmToGas(fasm);
+  string assemble = "as -o " + base + ".o " + base + ".s && ld -o " + base + ".gas " +
+                    base + ".o";
+  if (system(assemble.c_str()) != 0) {
+    printf("FAIL %s (FASM): doesn't assemble\n", name);
+    failures++;
+    return;
+  }
+  report(string(name) + " (FASM)", run(base + ".gas"), expected, fasm.size());
+}
+
+/// Sum `names` up into `result`, one addition at a time.
+static void sum(vector<Statement> &body, const string &result,
+                const vector<string> &names) {
+  body.push_back(assign(result, num(0)));
+  for (const string &name : names) {
+    body.push_back(assign(result, add(var(result), var(name))));
+  }
+}
+
+static void checkPrograms() {
+  check("add",
+        Program{{fn("main", {def({"a", "b", "c"}), assign("a", num(1)),
+                             assign("b", num(2)), assign("c", add(var("a"), var("b"))),
+                             ret(var("c"))})}},
+        3);
+
+  {
+    // More constants live at once than there are registers.
+    vector<string> vs = names("v", 20);
+    vector<Statement> body{def(vs), def({"s"})};
+    for (int i = 0; i < 20; i++) body.push_back(assign(vs[i], num(i)));
+    sum(body, "s", vs);
+    body.push_back(ret(var("s")));
+    check("pressure", Program{{fn("main", body)}}, 190);
+  }
+
+  {
+    // f trashes every caller-saved register while main has values in them.
+    auto f = fn("f", {asmText("  mov rax, 77\n  mov rcx, 77\n  mov rdx, 77\n"
+                              "  mov rsi, 77\n  mov rdi, 77\n  mov r8, 77\n"
+                              "  mov r9, 77\n  mov r10, 77\n  mov r11, 77"),
+                      ret(num(0))});
+    vector<string> vs = names("v", 8);
+    vector<Statement> body{def(vs), def({"s"})};
+    for (int i = 0; i < 8; i++) body.push_back(assign(vs[i], num(i + 1)));
+    body.push_back(call("f"));
+    sum(body, "s", vs);
+    body.push_back(ret(var("s")));
+    check("call", Program{{fn("main", body), f}}, 36);
+  }
+
+  check("inline_asm",
+        Program{{fn("main", {def({"a", "b"}), assign("a", num(7)), assign("b", num(5)),
+                             asmText("  mov ecx, 99\n  mov ebx, 99\n"
+                                     "  mov r12d, 99\n  mov esi, 99"),
+                             assign("a", add(var("a"), var("b"))), ret(var("a"))})}},
+        12);
+
+  {
+    // g keeps lots of values alive across a call, so it needs callee-saved registers,
+    // which main relies on across its call to g.
+    vector<string> ws = names("w", 7);
+    vector<Statement> g{def(ws), def({"s"})};
+    for (const string &w : ws) g.push_back(assign(w, num(10)));
+    g.push_back(call("h"));
+    sum(g, "s", ws);
+    g.push_back(ret(var("s")));
+    auto main = fn("main", {def({"a", "b", "c"}), assign("a", num(3)),
+                            assign("b", num(4)), call("g"),
+                            assign("c", add(var("a"), var("b"))), ret(var("c"))});
+    check("saved", Program{{main, fn("g", g), fn("h", {ret(num(0))})}}, 7);
+  }
+
+  check("commute",
+        Program{{fn("main", {def({"a", "b"}), assign("a", num(40)), assign("b", num(2)),
+                             assign("b", add(var("a"), var("b"))), ret(var("b"))})}},
+        42);
+
+  check("dead",
+        Program{{fn("main", {def({"a", "b"}), assign("a", num(1)), assign("b", num(2)),
+                             assign("a", num(9)), ret(var("b"))})}},
+        2);
+
+  {
+    // g(50, 8, 3): (50 - 8) * 3 + 50 / 8 + 50 % 8 - (8 < 50) + (3 == 3) + !50 - -3
+    //   = 126 + 6 + 2 - 1 + 1 + 0 + 3 = 137
+    auto g = fn("g", {"a", "b", "c"},
+                {def({"x", "y"}),
+                 assign("x", bin(BinOp_Mult, bin(BinOp_Sub, var("a"), var("b")),
+                                 var("c"))),
+                 assign("x", add(var("x"), bin(BinOp_Divide, var("a"), var("b")))),
+                 assign("x", add(var("x"), bin(BinOp_Modulo, var("a"), var("b")))),
+                 assign("x", bin(BinOp_Sub, var("x"),
+                                 bin(BinOp_LessThan, var("b"), var("a")))),
+                 assign("x", add(var("x"), bin(BinOp_Equal, var("c"), num(3)))),
+                 assign("y", un(UnaryOp_Not, var("a"))),
+                 assign("x", add(var("x"), var("y"))),
+                 assign("x", bin(BinOp_Sub, var("x"), un(UnaryOp_Negate, var("c")))),
+                 ret(var("x"))});
+    check("arith", Program{{callG({50, 8, 3}), g}}, 137);
+  }
+
+  {
+    // Parameters that have to trade places, and division by a constant and into edx.
+    // 100 - (70 / 7 + 23 % 5) = 100 - 13 = 87
+    auto g = fn("g", {"a", "b", "c", "d"},
+                {def({"x"}), assign("x", bin(BinOp_Divide, var("d"), num(7))),
+                 assign("x", add(var("x"), bin(BinOp_Modulo, var("c"), var("b")))),
+                 assign("x", bin(BinOp_Sub, var("a"), var("x"))), ret(var("x"))});
+    check("params", Program{{callG({100, 5, 23, 70}), g}}, 87);
+  }
+
+  check("bool",
+        Program{{fn("main", {defBool({"b"}), def({"a"}), assign("b", num(256)),
+                             assign("a", add(var("b"), num(40))), ret(var("a"))})}},
+        41);
+
+  check("unreachable",
+        Program{{fn("main", {def({"a"}), assign("a", num(5)), ret(var("a")),
+                             assign("a", add(var("a"), num(1))), ret(var("a"))})}},
+        5);
+
+  // Inline assembly after a return is only reachable through its own labels, so it
+  // still has to be emitted for the jump to land.
+  check("unreachable_asm",
+        Program{{fn("main", {asmText("  jmp after"), ret(num(1)),
+                             asmText("after:\n  mov edi, 9\n  mov eax, 60\n  syscall")})}},
+        9);
+
+  {
+    // Lots of values that aren't constants live at once, across a call.
+    // 20 * 1 + 190 = 210
+    vector<string> vs = names("v", 20);
+    vector<Statement> g{def(vs), def({"s"})};
+    for (int i = 0; i < 20; i++) g.push_back(assign(vs[i], add(var("p"), num(i))));
+    g.push_back(call("f"));
+    sum(g, "s", vs);
+    g.push_back(ret(var("s")));
+    check("pressure_params",
+          Program{{callG({1}), fn("g", {"p"}, g), fn("f", {ret(num(0))})}}, 210);
+  }
+
+  for (bool withCall : {true, false}) {
+    // Bools and ints that don't all fit in registers, across a call (so they spill into
+    // an aligned frame) or not (so they spill into the red zone).
+    // 14 * 5 + 91, plus 2 for each of b0..b4.
+    vector<string> vs = names("v", 14), bs = names("b", 12);
+    vector<Statement> g{def(vs), def({"s"}), defBool(bs)};
+    for (int i = 0; i < 14; i++) g.push_back(assign(vs[i], add(var("p"), num(i))));
+    for (int i = 0; i < 12; i++) {
+      g.push_back(assign(bs[i], bin(BinOp_GreaterThan, var("p"), num(i))));
+    }
+    if (withCall) g.push_back(call("f"));
+    sum(g, "s", vs);
+    for (const string &b : bs) {
+      g.push_back(assign("s", add(var("s"), bin(BinOp_Mult, var(b), var(b)))));
+      g.push_back(assign("s", add(var("s"), bin(BinOp_Divide, var(b), var("b0")))));
+      g.push_back(
+          assign("s", bin(BinOp_Sub, var("s"), bin(BinOp_Sub, var(b), var(b)))));
+    }
+    g.push_back(ret(var("s")));
+    check(withCall ? "bool_spill_call" : "bool_spill_leaf",
+          Program{{callG({5}), fn("g", {"p"}, g), fn("f", {ret(num(0))})}}, 171);
+  }
+
+  {
+    // rsp has to be 16-byte aligned at calls: chk exits with how far off it is + 100.
+    vector<string> vs = names("v", 9);
+    vector<Statement> g{def(vs), def({"s"})};
+    for (int i = 0; i < 9; i++) g.push_back(assign(vs[i], add(var("p"), num(i))));
+    g.push_back(call("chk"));
+    sum(g, "s", vs);
+    g.push_back(ret(var("s")));
+    auto chk = fn("chk", {asmText("  mov rdi, rsp\n  and edi, 15\n  add edi, 100\n"
+                                  "  mov eax, 60\n  syscall"),
+                          ret(num(0))});
+    check("aligned", Program{{callG({1}), fn("g", {"p"}, g), chk}}, 100);
+  }
+}
+
+/// Constant propagation has to see through a branch that always goes one way, and
+/// the phi after it.
+static void checkConstantPropagation() {
+  using namespace ir;
+
+  // bb0: branch (1 < 2) bb1, bb2; bb1: jump bb3; bb2: jump bb3;
+  // bb3: return phi(5 from bb1, %p from bb2) + 1
+  Function f;
+  f.name = "t";
+  f.returnType = ir::Type::I32;
+  f.paramTypes = {ir::Type::I32};
+  f.blocks.resize(4);
+  auto append = [&](BlockId block, Instruction instruction) {
+    instruction.block = block;
+    f.values.push_back(instruction);
+    f.blocks[block].instructions.push_back(f.values.size() - 1);
+    return ValueId(f.values.size() - 1);
+  };
+  const auto I32 = ir::Type::I32;
+  ValueId p = append(0, {.op = Opcode::Param, .type = I32, .imm = 0});
+  ValueId one = append(0, {.op = Opcode::Const, .type = I32, .imm = 1});
+  ValueId two = append(0, {.op = Opcode::Const, .type = I32, .imm = 2});
+  ValueId lt = append(0, {.op = Opcode::LessThan, .type = I32, .operands = {one, two}});
+  append(0, {.op = Opcode::Branch, .operands = {lt}, .targets = {1, 2}});
+  ValueId five = append(1, {.op = Opcode::Const, .type = I32, .imm = 5});
+  append(1, {.op = Opcode::Jump, .targets = {3}});
+  append(2, {.op = Opcode::Jump, .targets = {3}});
+  ValueId phi = append(
+      3, {.op = Opcode::Phi, .type = I32, .operands = {five, p}, .targets = {1, 2}});
+  ValueId sum = append(3, {.op = Opcode::Add, .type = I32, .operands = {phi, one}});
+  append(3, {.op = Opcode::Return, .operands = {sum}});
+
+  computeCfg(f);
+  propagateConstants(f);
+  splitCriticalEdges(f);
+  computeDominators(f);
+  bool ok = verify(f);
+  std::ostringstream printed;
+  print(f, printed);
+
+  if (ok && printed.str().find("i32 const 6") != string::npos) {
+    printf("ok   constant propagation\n");
+  } else {
+    printf("FAIL constant propagation:\n%s", printed.str().c_str());
+    failures++;
+  }
+}
+
+int main() {
+  char dir[] = "/tmp/toycpp-codegen-XXXXXX";
+  if (!mkdtemp(dir)) {
+    printf("FAIL can't set up a directory to work in\n");
+    return 1;
+  }
+  workDir = dir;
+  useGnuAs = haveGnuAs();
+  if (!useGnuAs) printf("skip FASM output, since there's no GNU as and ld\n");
+
+  // Compiling inline assembly to an executable fails, and says so.
+  std::ostringstream messages;
+  diagnosticStream = &messages;
+
+  checkPrograms();
+  checkConstantPropagation();
+
+  diagnosticStream = &std::cerr;
+  system(("rm -rf " + workDir).c_str());
+  return failures != 0;
+}
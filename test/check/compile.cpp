@@ -0,0 +1,146 @@
+// Compiling source files all the way, from the parse tree on, has to give executables
+// that exit with what main() returns, and report what it can't compile yet.
+
+#include "../../src/driver.hpp"
+#include "../../src/peephole.hpp"
+#include "../../src/utils.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using std::string;
+
+static int failures = 0;
+static string workDir;
+static const grammar::Grammar *theGrammar;
+
+static void check(const char *name, const string &source, int expected) {
+  const string path = workDir + "/" + name;
+  std::ofstream(path + ".cpp", std::ios::trunc) << source;
+
+  for (bool useGlr : {false, true}) {
+    const char *parser = useGlr ? "GLR" : "LR";
+    int exitCode = generateCode(theGrammar, path + ".cpp", useGlr,
+                                compile::OutputFormat::Executable, path);
+    if (exitCode == 0) {
+      int status = system(path.c_str());
+      exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    } else {
+      exitCode = -1;
+    }
+
+    if (exitCode == expected) {
+      printf("ok   %s (%s)\n", name, parser);
+    } else {
+      printf("FAIL %s (%s): exited with %d, expected %d\n", name, parser, exitCode,
+             expected);
+      failures++;
+    }
+  }
+}
+
+static void checkError(const char *name, const string &source, const string &error) {
+  const string path = workDir + "/" + name;
+  std::ofstream(path + ".cpp", std::ios::trunc) << source;
+
+  std::ostringstream messages;
+  diagnosticStream = &messages;
+  int exitCode = generateCode(theGrammar, path + ".cpp", false,
+                              compile::OutputFormat::Executable, path);
+  diagnosticStream = &std::cerr;
+
+  if (exitCode != 0 && messages.str().find(error) != string::npos) {
+    printf("ok   %s\n", name);
+  } else {
+    printf("FAIL %s: exited with %d, and said:\n%s", name, exitCode,
+           messages.str().c_str());
+    failures++;
+  }
+}
+
+int main() {
+  char dir[] = "/tmp/toycpp-compile-XXXXXX";
+  if (!mkdtemp(dir)) {
+    printf("FAIL can't set up a directory to work in\n");
+    return 1;
+  }
+  workDir = dir;
+  theGrammar = grammar::defaultGrammar();
+
+  check("calls",
+        "int a() {\n  return 3;\n}\n\nint main() {\n  a();\n  return 250;\n}\n", 250);
+
+  check("variables",
+        "int main() {\n"
+        "  int a = 1, b = 2, c;\n"
+        "  char d = 300;\n"
+        "  bool e = 7;\n"
+        "  c = a + b + a;\n"
+        "  return c + d + e;\n"
+        "}\n",
+        4 + 44 + 1);
+
+  // Chains of + and -, which group from the left, with unary operators binding tighter.
+  check("associativity",
+        "int main() {\n"
+        "  int a = 5;\n"
+        "  return 100 - a - 3 + -a + 10 - -a - 1 + !a;\n"
+        "}\n",
+        101);
+
+  checkError("loops", "int main() {\n  for (;;) {\n    break;\n  }\n}\n",
+             "In main: Loops aren't supported yet");
+  checkError("globals", "int a;\nint main() {\n  return 0;\n}\n",
+             "Global variables aren't supported yet");
+  checkError("pointers", "int *f() {\n  return 0;\n}\n",
+             "In f: Pointers and references aren't supported yet");
+  checkError("inline assembly", "int main() {\n  asm(\"mov eax, 1\");\n}\n",
+             "needs FASM output");
+
+  // FASM output has inline assembly in it, with the string's escapes resolved.
+  {
+    const string path = workDir + "/inline";
+    std::ofstream(path + ".cpp", std::ios::trunc)
+        << "int main() {\n  asm(\"mov eax, 1\\n\" \"  nop\");\n  return 0;\n}\n";
+    compile::PeepholeStats stats;
+    int exitCode = generateCode(theGrammar, path + ".cpp", false,
+                                compile::OutputFormat::Fasm, path + ".asm", &stats);
+    std::ifstream file(path + ".asm");
+    std::stringstream text;
+    text << file.rdbuf();
+    if (exitCode == 0 && text.str().find("mov eax, 1\n  nop") != string::npos &&
+        stats.instructionsBefore > 0) {
+      printf("ok   FASM output\n");
+    } else {
+      printf("FAIL FASM output:\n%s", text.str().c_str());
+      failures++;
+    }
+  }
+
+  // Inline assembly after a return never runs, but it's where test/inline_asm.cpp puts
+  // the label its other inline assembly refers to.
+  {
+    const string path = workDir + "/inline_asm.asm";
+    int exitCode = generateCode(theGrammar, "test/inline_asm.cpp", false,
+                                compile::OutputFormat::Fasm, path);
+    std::ifstream file(path);
+    std::stringstream text;
+    text << file.rdbuf();
+    if (exitCode == 0 && text.str().find("inline_asm:\n") != string::npos &&
+        text.str().find("file \"test/inline_asm.cpp\"") != string::npos) {
+      printf("ok   test/inline_asm.cpp\n");
+    } else {
+      printf("FAIL test/inline_asm.cpp:\n%s", text.str().c_str());
+      failures++;
+    }
+  }
+
+  system(("rm -rf " + workDir).c_str());
+  return failures != 0;
+}
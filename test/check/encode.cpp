@@ -0,0 +1,149 @@
+// The encoder has to give exactly the bytes GNU as does for the same assembly, for
+// every form of every instruction the code generator emits. Skipped without GNU as.
+
+#include "../../src/asm.hpp"
+#include "../../src/encode.hpp"
+#include "gas.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace compile;
+using std::string, std::vector;
+
+/// One of everything, with every register and a spread of immediates and
+/// displacements around where their encodings get bigger.
+static Assembly everything() {
+  Assembly a;
+  // Not "far", which GNU as takes for the far jump keyword.
+  uint32_t ahead = a.label("ahead"), back = a.label("back");
+  a.bind(a.label("_start"));
+  a.bind(back);
+  a.emit(Mnemonic::jmp, Operand::label(ahead));
+  a.emit(Mnemonic::jne, Operand::label(ahead));
+  a.emit(Mnemonic::jne, Operand::label(back));
+
+  vector<reg> regs;
+  for (int i = 0; i < 16; i++) regs.push_back(reg(i));
+  auto mems = [&](uint8_t size) {
+    vector<Operand> result;
+    for (reg base : regs) {
+      for (int32_t displacement : {0, 8, -4, -300, 127, -128, 128}) {
+        result.push_back(Operand::mem(reg64(base), displacement, size));
+      }
+    }
+    return result;
+  };
+
+  for (reg x : regs) {
+    for (reg y : regs) {
+      a.emit(Mnemonic::mov, Operand::r(x), Operand::r(y));
+      a.emit(Mnemonic::mov, Operand::r(reg64(x)), Operand::r(reg64(y)));
+      a.emit(Mnemonic::add, Operand::r(x), Operand::r(y));
+      a.emit(Mnemonic::sub, Operand::r(x), Operand::r(y));
+      a.emit(Mnemonic::cmp, Operand::r(x), Operand::r(y));
+      a.emit(Mnemonic::imul, Operand::r(x), Operand::r(y));
+      a.emit(Mnemonic::imul, Operand::r(x), Operand::r(y), Operand::imm(3));
+      a.emit(Mnemonic::imul, Operand::r(x), Operand::r(y), Operand::imm(1000));
+      a.emit(Mnemonic::movzx, Operand::r(x), Operand::lowByte(y));
+      a.emit(Mnemonic::movsx, Operand::r(x), Operand::lowByte(y));
+      // rsp can't be an index.
+      if (regNumber(y) != 4) {
+        a.emit(Mnemonic::lea, Operand::r(x), Operand::address(reg64(x), reg64(y)));
+        a.emit(Mnemonic::lea, Operand::r(x), Operand::address(reg64(y), reg64(y)));
+      }
+    }
+  }
+
+  for (reg x : regs) {
+    for (int32_t value : {0, 1, -1, 127, 128, -129, 100000}) {
+      a.emit(Mnemonic::mov, Operand::r(x), Operand::imm(value));
+      a.emit(Mnemonic::mov, Operand::r(reg64(x)), Operand::imm(value));
+      a.emit(Mnemonic::add, Operand::r(x), Operand::imm(value));
+      a.emit(Mnemonic::sub, Operand::r(reg64(x)), Operand::imm(value));
+      a.emit(Mnemonic::cmp, Operand::r(x), Operand::imm(value));
+      a.emit(Mnemonic::lea, Operand::r(x), Operand::address(reg64(x), value));
+    }
+    a.emit(Mnemonic::idiv, Operand::r(x));
+    a.emit(Mnemonic::neg, Operand::r(x));
+    a.emit(Mnemonic::push, Operand::r(reg64(x)));
+    a.emit(Mnemonic::pop, Operand::r(reg64(x)));
+    for (Mnemonic set : {Mnemonic::sete, Mnemonic::setne, Mnemonic::setl,
+                         Mnemonic::setg, Mnemonic::setle, Mnemonic::setge}) {
+      a.emit(set, Operand::lowByte(x));
+    }
+    for (Operand m : mems(4)) {
+      a.emit(Mnemonic::mov, Operand::r(x), m);
+      a.emit(Mnemonic::mov, m, Operand::r(x));
+      a.emit(Mnemonic::add, Operand::r(x), m);
+      a.emit(Mnemonic::sub, m, Operand::r(x));
+      a.emit(Mnemonic::cmp, m, Operand::imm(0));
+      a.emit(Mnemonic::imul, Operand::r(x), m);
+      a.emit(Mnemonic::imul, Operand::r(x), m, Operand::imm(-7));
+    }
+    for (Operand m : mems(1)) {
+      a.emit(Mnemonic::movsx, Operand::r(x), m);
+      a.emit(Mnemonic::mov, m, Operand::lowByte(x));
+      a.emit(Mnemonic::mov, Operand::lowByte(x), m);
+    }
+    for (Operand m : mems(8)) a.emit(Mnemonic::mov, Operand::r(reg64(x)), m);
+  }
+
+  for (Operand m : mems(4)) {
+    a.emit(Mnemonic::mov, m, Operand::imm(5));
+    a.emit(Mnemonic::idiv, m);
+    a.emit(Mnemonic::neg, m);
+    a.emit(Mnemonic::add, m, Operand::imm(1000));
+  }
+  for (Operand m : mems(1)) a.emit(Mnemonic::mov, m, Operand::imm(-5));
+  a.emit(Mnemonic::cdq);
+  a.emit(Mnemonic::ret);
+  a.emit(Mnemonic::syscall);
+  a.emit(Mnemonic::call, Operand::label(back));
+  a.bind(ahead);
+  a.emit(Mnemonic::jmp, Operand::label(back));
+  a.emit(Mnemonic::ret);
+  return a;
+}
+
+int main() {
+  if (system("command -v objcopy >/dev/null") != 0 || !haveGnuAs()) {
+    printf("skip encoder, since there's no GNU as and objcopy to compare with\n");
+    return 0;
+  }
+
+  char dir[] = "/tmp/toycpp-encode-XXXXXX";
+  if (!mkdtemp(dir)) {
+    printf("FAIL can't set up a directory to work in\n");
+    return 1;
+  }
+  const string base = string(dir) + "/everything";
+
+  Assembly assembly = everything();
+  std::ofstream(base + ".s", std::ios::trunc) << fasmToGas(assembly.toText());
+  string assemble = "as -o " + base + ".o " + base + ".s && " +
+                    "objcopy -O binary -j .text " + base + ".o " + base + ".bin";
+  if (system(assemble.c_str()) != 0) {
+    printf("FAIL encoder: GNU as doesn't take the text version\n");
+    return 1;
+  }
+  std::ifstream file(base + ".bin", std::ios::binary);
+  vector<uint8_t> expected{std::istreambuf_iterator<char>(file), {}};
+  system(("rm -rf " + string(dir)).c_str());
+
+  vector<uint8_t> bytes = encode(assembly).bytes;
+  size_t at = 0;
+  while (at < bytes.size() && at < expected.size() && bytes[at] == expected[at]) at++;
+  if (at != bytes.size() || at != expected.size()) {
+    printf("FAIL encoder: %zu bytes, GNU as has %zu, first difference at %zu\n",
+           bytes.size(), expected.size(), at);
+    return 1;
+  }
+  printf("ok   encoder (%zu bytes, same as GNU as)\n", bytes.size());
+  return 0;
+}
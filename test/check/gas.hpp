@@ -0,0 +1,33 @@
+#pragma once
+
+// Running the FASM that the code generator writes through GNU as instead, since that's
+// usually around when fasm isn't. The instructions are spelled the same in both, as
+// long as as is in Intel syntax mode.
+
+#include <cstdlib>
+#include <regex>
+#include <sstream>
+#include <string>
+
+/// Whether GNU as and ld are on the PATH.
+inline bool haveGnuAs() {
+  return system("command -v as >/dev/null && command -v ld >/dev/null") == 0;
+}
+
+/// `fasm` translated into something GNU as takes: no format directive, no comments,
+/// and "ptr" after memory operand sizes.
+inline std::string fasmToGas(const std::string &fasm) {
+  static const std::regex comment(";.*");
+  static const std::regex size("\\b(byte|word|dword|qword) \\[");
+
+  std::ostringstream gas;
+  gas << ".intel_syntax noprefix\n.globl _start\n";
+  std::istringstream lines(fasm);
+  std::string line;
+  while (std::getline(lines, line)) {
+    if (line.rfind("format ", 0) == 0) continue;
+    line = std::regex_replace(line, comment, "");
+    gas << std::regex_replace(line, size, "$1 ptr [") << "\n";
+  }
+  return gas.str();
+}
@@ -0,0 +1,143 @@
+// The compile server's grammar watcher has to survive whatever gets saved to
+// grammar.rule in the meantime, keeping the last grammar that worked until it's fixed.
+// It has to notice a grammar.rule that only shows up once the server's running, and
+// keep handing out the old grammar while it builds the table for a new one.
+
+#include "../../src/driver.hpp"
+#include "../../src/file.hpp"
+#include "../../src/table.hpp"
+#include "../../src/utils.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+using std::string;
+
+static int failures = 0;
+
+static void expect(bool condition, const char *name) {
+  printf("%s %s\n", condition ? "ok  " : "FAIL", name);
+  if (!condition) failures++;
+}
+
+static void writeGrammar(const string &text) {
+  std::ofstream("grammar.rule", std::ios::trunc) << text;
+}
+
+/// Output that holds up the thread writing to it the first time, until release().
+class HoldingBuffer : public std::streambuf {
+public:
+  void waitUntilWritten() {
+    std::unique_lock lock(_mutex);
+    _changed.wait(lock, [&] { return _written; });
+  }
+
+  void release() {
+    std::lock_guard lock(_mutex);
+    _released = true;
+    _changed.notify_all();
+  }
+
+protected:
+  int overflow(int c) override {
+    std::unique_lock lock(_mutex);
+    _written = true;
+    _changed.notify_all();
+    _changed.wait(lock, [&] { return _released; });
+    return c;
+  }
+
+private:
+  std::mutex _mutex;
+  std::condition_variable _changed;
+  bool _written = false, _released = false;
+};
+
+int main() {
+  auto file = FileContents::read("grammar.rule");
+  if (!file.has_value()) {
+    printf("FAIL can't read grammar.rule - run this from the repository root\n");
+    return 1;
+  }
+  const string grammar(file->text());
+
+  char dir[] = "/tmp/toycpp-grammar-reload-XXXXXX";
+  if (!mkdtemp(dir) || chdir(dir) != 0) {
+    printf("FAIL can't set up a directory to work in\n");
+    return 1;
+  }
+
+  std::ostringstream messages;
+  diagnosticStream = &messages;
+
+  {
+    GrammarWatcher watcher;
+    expect(watcher.load() && watcher.get()->rules.empty(),
+           "uses the built-in table without grammar.rule");
+    writeGrammar(grammar);
+    expect(!watcher.get()->rules.empty(), "switches to grammar.rule once it's created");
+  }
+
+  GrammarWatcher watcher;
+  expect(watcher.load(), "loads grammar.rule");
+  auto good = watcher.get();
+
+  // Renaming the rule everything starts from used to take the whole server down.
+  string renamed = grammar;
+  renamed.replace(renamed.find("program ->"), 7, "translationUnit");
+  writeGrammar(renamed);
+  auto afterRename = watcher.get();
+  expect(afterRename == good, "keeps the old grammar when 'program' is renamed");
+  expect(messages.str().find("no 'program' rule") != string::npos,
+         "says what's wrong with the new one");
+
+  string removed = grammar;
+  size_t program = removed.find("program ->");
+  removed.erase(program, removed.find('\n', program) - program);
+  writeGrammar(removed);
+  expect(watcher.get() == good, "keeps the old grammar when 'program' is removed");
+
+  writeGrammar(grammar + "\n");
+  auto fixed = watcher.get();
+  expect(fixed != good && fixed->table.numStates == good->table.numStates,
+         "picks the grammar up again once it's fixed");
+
+  // Without its %left line, the grammar has conflicts, which get warned about while
+  // the table's built. Holding up the first warning holds up the reload halfway.
+  string conflicted = grammar;
+  size_t left = conflicted.find("%left");
+  conflicted.erase(left, conflicted.find('\n', left) + 1 - left);
+  writeGrammar(conflicted);
+
+  HoldingBuffer held;
+  std::thread reloading([&] {
+    std::ostream warnings(&held);
+    diagnosticStream = &warnings;
+    watcher.get();
+  });
+  held.waitUntilWritten();
+
+  auto during = std::async(std::launch::async, [&] { return watcher.get(); });
+  bool answered = during.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+  held.release();
+  reloading.join();
+  expect(answered && during.get() == fixed,
+         "keeps handing out the old grammar while it builds the new one");
+  expect(watcher.get() != fixed, "and then switches to the new one");
+
+  diagnosticStream = &std::cerr;
+  unlink("grammar.rule");
+  unlink("grammar.rule.cache");
+  rmdir(dir);
+  return failures != 0;
+}
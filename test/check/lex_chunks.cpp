@@ -0,0 +1,64 @@
+// Lexing a big file in parallel chunks has to give exactly the tokens lexing it in
+// one go does, including when chunks start in the middle of a comment or a literal.
+
+#include "../../src/lex.hpp"
+
+#include <cstdio>
+#include <string>
+
+using std::string;
+
+static int failures = 0;
+
+/// `line` over and over, until there's at least `size` bytes of it.
+static string repeat(const string &line, size_t size) {
+  string result;
+  result.reserve(size + line.size());
+  while (result.size() < size) result += line;
+  return result;
+}
+
+static lex::TokenBuffer lexWith(const string &source, unsigned numThreads) {
+  lex::Lexer lexer("check.cpp", source);
+  lexer.lexAll(numThreads);
+  lex::Token token = lexer.nextToken();
+  lex::TokenBuffer result(token.file);
+  for (; token.type != lex::Eof; token = lexer.nextToken()) result.push_back(token);
+  return result;
+}
+
+static void check(const char *name, const string &source) {
+  const lex::TokenBuffer expected = lexWith(source, 1);
+  for (unsigned numThreads : {2, 3, 5, 8}) {
+    const lex::TokenBuffer tokens = lexWith(source, numThreads);
+    if (tokens.types != expected.types || tokens.offsets != expected.offsets ||
+        tokens.lengths != expected.lengths) {
+      printf("FAIL %s: %zu tokens with %u threads, %zu in one go\n", name,
+             tokens.size(), numThreads, expected.size());
+      failures++;
+      return;
+    }
+  }
+  printf("ok   %s (%zu tokens)\n", name, expected.size());
+}
+
+int main() {
+  constexpr size_t SIZE = 10 << 20;
+
+  check("plain code", repeat("int f(int a, int b) { return a + b * 2; }\n", SIZE));
+
+  // Every line closes the comment the one before it opened. A chunk that starts at
+  // a line sees a string where the real tokens are, so none of them line up with the
+  // real ones, and the first thing stitching that chunk does is relex.
+  check("chunks starting mid-comment",
+        "/*\n" + repeat("x \" */ int b; /* \" y\n", SIZE) + "*/\n");
+
+  // The same, but with strings that span lines and have a comment start in them.
+  check("chunks starting mid-literal",
+        "char *s = \"\n" + repeat("x /* y \"; int c; char *s = \"\n", SIZE) + "\";\n");
+
+  check("one long comment",
+        "int a;\n/*\n" + repeat("just a comment\n", SIZE) + "*/ int b;\n");
+
+  return failures != 0;
+}
@@ -0,0 +1,95 @@
+// Peeking, marking, consuming and rewinding in any order has to give the same tokens
+// as just lexing the file once, token by token. That includes marks taken while the
+// buffer is empty or half consumed, after the lexer has cleared and refilled it many
+// times, and peeks and rewinds that go past the Eof.
+
+#include "../../src/lex.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::string, std::vector;
+
+static string source() {
+  string result;
+  for (int i = 0; i < 2000; i++) {
+    result += "int f" + std::to_string(i) + "(int a) { /* " + std::to_string(i) +
+              " */\n  return a + \"s\" - 'c'; // end\n}\n";
+  }
+  return result;
+}
+
+static bool same(const lex::Token &a, const lex::Token &b) {
+  return a.type == b.type && a.offset == b.offset && a.length == b.length;
+}
+
+int main() {
+  const string text = source();
+
+  vector<lex::Token> expected;
+  {
+    lex::Lexer lexer("check.cpp", text);
+    for (lex::Token token; token.type != lex::Eof;) {
+      token = lexer.nextToken();
+      expected.push_back(token);
+    }
+  }
+  auto at = [&](size_t i) { return expected[std::min(i, expected.size() - 1)]; };
+
+  lex::Lexer lexer("check.cpp", text);
+  std::mt19937 random(12);
+  // Where the lexer should be, and the marks taken so far along with where they were.
+  size_t position = 0;
+  vector<std::pair<lex::Lexer::Mark, size_t>> marks;
+  int failures = 0;
+
+  auto consume = [&]() {
+    if (!same(lexer.nextToken(), at(position))) failures++;
+    position = std::min(position + 1, expected.size() - 1);
+  };
+  auto peek = [&](size_t k) {
+    if (!same(lexer.peek(k), at(position + k))) failures++;
+  };
+  auto rewind = [&](size_t i) {
+    lexer.rewind(marks[i].first);
+    position = marks[i].second;
+  };
+
+  for (int step = 0; step < 100000 && failures == 0; step++) {
+    // Nothing gets marked for the first stretch, so the buffer gets refilled a lot.
+    // Mostly consuming, so the buffer runs out between peeks, and marks get taken then.
+    int what = random() % (step < 5000 ? 5 : 8);
+
+    if (what < 4) {
+      consume();
+    } else if (what == 4) {
+      peek(random() % 20);
+    } else if (what == 5) {
+      marks.push_back({lexer.mark(), position});
+    } else if (what == 6 && !marks.empty()) {
+      // Back to one of the last few marks, like a parser backtracking would.
+      rewind(marks.size() - 1 - random() % std::min<size_t>(marks.size(), 4));
+    }
+  }
+
+  // Then on to the Eof and past it, and all of that again from the first mark.
+  for (int pass = 0; pass < 2 && failures == 0; pass++) {
+    while (position + 1 < expected.size()) consume();
+    for (int i = 0; i < 3; i++) {
+      peek(i);
+      consume();
+    }
+    rewind(0);
+  }
+
+  if (failures != 0) {
+    printf("FAIL mark and rewind: wrong token at token %zu\n", position);
+    return 1;
+  }
+  printf("ok   mark and rewind (%zu tokens, %zu marks)\n", expected.size(),
+         marks.size());
+  return 0;
+}
@@ -0,0 +1,148 @@
+// Reparsing after random edits has to give the tree parsing the edited source code from
+// scratch does, including when the tree being edited came from reparse() itself, and
+// the nodes reparse() replaces mustn't pile up however many edits there are.
+
+#include "../../src/grammar.hpp"
+#include "../../src/utils.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using grammar::Edit, grammar::Tree;
+using std::string, std::vector;
+
+/// The source code a tree was parsed from, and the lexer that registered it, which
+/// both have to live as long as the tree.
+struct Version {
+  string source;
+  std::unique_ptr<lex::Lexer> lexer;
+
+  explicit Version(string text)
+      : source(std::move(text)), lexer(new lex::Lexer("check.cpp", source)) {}
+};
+
+static string generateSource(std::mt19937 &random) {
+  string result;
+  for (int f = 0; f < 40; f++) {
+    result += "int f" + std::to_string(f) + "(int a, int b) {\n";
+    int numStatements = random() % 8;
+    for (int s = 0; s < numStatements; s++) {
+      switch (random() % 4) {
+      case 0 : result += "  int c = a + " + std::to_string(s) + ";\n"; break;
+      case 1 : result += "  a = -b - a + 1;\n"; break;
+      case 2 : result += "  g(a, \"s\", 'c');\n"; break;
+      default: result += "  /* comment */ b = a;\n"; break;
+      }
+    }
+    result += "  return a;\n}\n\n";
+  }
+  return result;
+}
+
+/// Up to three edits at random places, each inserting, deleting or replacing a little.
+/// Most keep the code valid, but some don't, to check that reparse() fails too then.
+static vector<Edit> randomEdits(std::mt19937 &random, const string &source,
+                                string &edited) {
+  static const char *SNIPPETS[] = {"a",     "1",         " ",      "\n",
+                                   "x = 2;", "int y;",    "/* */",  "+ 1",
+                                   "b",     "return 0;", "// c\n", ";"};
+
+  vector<uint32_t> offsets;
+  for (int i = random() % 3; i >= 0; i--) offsets.push_back(random() % source.size());
+  std::sort(offsets.begin(), offsets.end());
+
+  vector<Edit> edits;
+  edited.clear();
+  uint32_t copied = 0;
+  for (uint32_t offset : offsets) {
+    if (offset < copied) continue;
+
+    uint32_t oldLength = std::min<uint32_t>(random() % 3, source.size() - offset);
+    string text = random() % 3 == 0 ? "" : SNIPPETS[random() % std::size(SNIPPETS)];
+    edited.append(source, copied, offset - copied);
+    edited += text;
+    copied = offset + oldLength;
+    edits.push_back({offset, oldLength, uint32_t(text.size())});
+  }
+  edited.append(source, copied);
+  return edits;
+}
+
+static string print(const Tree &tree) {
+  std::ostringstream result;
+  grammar::printNodeTree(tree, result);
+  return result.str();
+}
+
+int main() {
+  const grammar::Grammar *theGrammar = grammar::defaultGrammar();
+  std::mt19937 random(17);
+  std::ostringstream messages;
+  diagnosticStream = &messages;
+
+  auto current = std::make_unique<Version>(generateSource(random));
+  Tree tree = grammar::parse(theGrammar, *current->lexer);
+
+  int failures = 0, numReparsed = 0, numRejected = 0;
+  for (int i = 0; i < 1000 && failures == 0; i++) {
+    string edited;
+    vector<Edit> edits = randomEdits(random, current->source, edited);
+
+    auto expectedVersion = std::make_unique<Version>(edited);
+    std::optional<Tree> expected;
+    try {
+      expected = grammar::parse(theGrammar, *expectedVersion->lexer);
+    } catch (const FatalError &) {
+    }
+
+    auto next = std::make_unique<Version>(edited);
+    std::optional<Tree> reparsed;
+    try {
+      reparsed = grammar::reparse(theGrammar, tree, *next->lexer, edits);
+    } catch (const FatalError &) {
+    }
+
+    if (!expected.has_value() || !reparsed.has_value()) {
+      if (expected.has_value() != reparsed.has_value()) {
+        printf("FAIL reparse: edit %d %s, but parsing from scratch %s\n", i,
+               reparsed ? "parses" : "doesn't parse", expected ? "does" : "doesn't");
+        failures++;
+      }
+      numRejected++;
+      continue;
+    }
+
+    if (print(*reparsed) != print(*expected) ||
+        reparsed->tokens.offsets != expected->tokens.offsets) {
+      printf("FAIL reparse: edit %d gives a different tree than parsing from scratch\n",
+             i);
+      failures++;
+    } else if (reparsed->history.size() != reparsed->nodes.size()) {
+      // The next reparse() would have to start from scratch.
+      printf("FAIL reparse: edit %d leaves a tree that can't be reparsed\n", i);
+      failures++;
+    } else if (reparsed->nodes.size() > 2 * expected->nodes.size()) {
+      printf("FAIL reparse: %zu nodes after edit %d, for a tree of %zu\n",
+             reparsed->nodes.size(), i, expected->nodes.size());
+      failures++;
+    }
+
+    tree = std::move(*reparsed);
+    current = std::move(next);
+    numReparsed++;
+  }
+
+  diagnosticStream = &std::cerr;
+  if (failures == 0) {
+    printf("ok   reparse (%d edits, %d of them invalid code)\n",
+           numReparsed + numRejected, numRejected);
+  }
+  return failures != 0;
+}
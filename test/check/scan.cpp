@@ -0,0 +1,98 @@
+// Every set of scanning kernels the CPU supports, scalar, SSE2 or AVX2, has to stop
+// where going a byte at a time does, on random strings of the characters they tell
+// apart. None may read a byte past the end they're given - the strings end right
+// before a page that can't be read.
+
+#include "../../src/scan.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using lex::scan::Kernels;
+using std::string;
+
+/// Where each kernel should stop, worked out a byte at a time without the kernels.
+static const char *skipWhitespace(const char *p, const char *end) {
+  while (p < end && *p != '\0' && strchr(" \t\n\v\f\r", *p)) p++;
+  return p;
+}
+
+static const char *findWordEnd(const char *p, const char *end) {
+  while (p < end && !lex::scan::isWordSeparator(*p)) p++;
+  return p;
+}
+
+static const char *findNewline(const char *p, const char *end) {
+  while (p < end && *p != '\n' && *p != '\r') p++;
+  return p;
+}
+
+/// Runs of whitespace, words, punctuation and bytes >= 0x80, in random lengths up to
+/// a few SIMD chunks, so stops land anywhere in a chunk.
+static string randomString(std::mt19937 &random) {
+  static const string KINDS[] = {" \t\v\f", "\n\r", "abcXYZ_019", "()[]{}.,;-+/*'\"=",
+                                 "\x80\xa9\xff"};
+
+  string result;
+  size_t length = random() % 100;
+  while (result.size() < length) {
+    const string &kind = KINDS[random() % std::size(KINDS)];
+    for (int run = random() % 40; run > 0; run--) {
+      result += kind[random() % kind.size()];
+    }
+  }
+  result.resize(length);
+  return result;
+}
+
+int main() {
+  const long pageSize = sysconf(_SC_PAGESIZE);
+  char *pages = (char *) mmap(nullptr, 2 * pageSize, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED || mprotect(pages + pageSize, pageSize, PROT_NONE) != 0) {
+    printf("FAIL can't set up a guard page\n");
+    return 1;
+  }
+  char *const guard = pages + pageSize;
+
+  constexpr int NUM_STRINGS = 200000;
+  int failures = 0;
+  for (const Kernels *kernels : lex::scan::supportedKernels()) {
+    std::mt19937 random(9);
+    int numWrong = 0;
+
+    for (int i = 0; i < NUM_STRINGS; i++) {
+      string text = randomString(random);
+      char *begin = guard - text.size();
+      memcpy(begin, text.data(), text.size());
+
+      // Stopping at an `end` before the end of the string has to work too.
+      const char *end = guard - (text.empty() ? 0 : random() % (text.size() / 4 + 1));
+      for (const char *p = begin; p <= end; p += 1 + random() % 24) {
+        if (kernels->skipWhitespace(p, end) != skipWhitespace(p, end) ||
+            kernels->findWordEnd(p, end) != findWordEnd(p, end) ||
+            kernels->findNewline(p, end) != findNewline(p, end)) {
+          if (numWrong++ == 0) {
+            printf("FAIL %s kernels: stop somewhere else in string %d, from byte %zu\n",
+                   kernels->name, i, size_t(p - begin));
+          }
+        }
+      }
+    }
+
+    if (numWrong == 0) {
+      printf("ok   %s kernels (%d strings)\n", kernels->name, NUM_STRINGS);
+    } else {
+      failures++;
+    }
+  }
+
+  munmap(pages, 2 * pageSize);
+  return failures != 0;
+}
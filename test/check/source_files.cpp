@@ -0,0 +1,61 @@
+// Running out of source file IDs has to be an error the caller can recover from, and
+// neither that nor a file too big to lex may use up an ID for good.
+
+#include "../../src/lex.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::string, std::vector;
+
+static int failures = 0;
+
+static void check(const char *name, bool ok) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+  if (!ok) failures++;
+}
+
+/// Register a file, or return 0 if that's a fatal error.
+static lex::FileId tryRegister(const char *filename) {
+  try {
+    return lex::registerSourceFile(filename, "");
+  } catch (const FatalError &) {
+    return 0;
+  }
+}
+
+int main() {
+  std::ostringstream messages;
+  diagnosticStream = &messages;
+
+  vector<lex::FileId> ids;
+  for (lex::FileId id; (id = tryRegister("check.cpp")) != 0;) ids.push_back(id);
+  check("running out of IDs is a fatal error",
+        !ids.empty() && messages.str().find("Too many source files") != string::npos);
+  check("and stays one", tryRegister("check.cpp") == 0);
+
+  lex::FileId freed = ids.back();
+  ids.pop_back();
+  lex::releaseSourceFile(freed);
+
+  // The size is checked before anything reads the text, so it doesn't need to exist.
+  const char text[] = "";
+  bool tooBig = false;
+  try {
+    lex::Lexer lexer("huge.cpp", text, size_t(UINT32_MAX) + 1);
+  } catch (const FatalError &) {
+    tooBig = true;
+  }
+  check("a file of 4 GB is too big", tooBig);
+
+  lex::FileId reused = tryRegister("check.cpp");
+  check("a freed ID can be used again", reused == freed);
+  if (reused != 0) ids.push_back(reused);
+
+  for (lex::FileId id : ids) lex::releaseSourceFile(id);
+  diagnosticStream = &std::cerr;
+  return failures == 0 ? 0 : 1;
+}
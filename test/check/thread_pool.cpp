@@ -0,0 +1,75 @@
+// Tasks submitted from outside the pool have to run about in the order they were
+// submitted in, since the driver prints each file's output in that order and can only
+// free it once it has. With twice as many tasks as workers, queued up while every
+// worker is busy, the first half has to start and finish before the second half.
+
+#include "../../src/thread_pool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+using std::vector;
+
+static int failures = 0;
+
+/// Whether every task in `order` is in the same round of `roundSize` tasks as its
+/// number. Within a round, the workers race each other.
+static void check(const char *name, const vector<unsigned> &order, unsigned roundSize) {
+  bool ok = true;
+  for (unsigned i = 0; i < order.size(); i++) {
+    if (order[i] / roundSize != i / roundSize) ok = false;
+  }
+
+  printf("%s %s:", ok ? "ok  " : "FAIL", name);
+  for (unsigned task : order) printf(" %u", task);
+  printf("\n");
+  if (!ok) failures++;
+}
+
+int main() {
+  constexpr unsigned NUM_THREADS = 4, NUM_TASKS = 2 * NUM_THREADS;
+
+  vector<unsigned> started(NUM_TASKS), finished(NUM_TASKS);
+  std::atomic<unsigned> numStarted{0}, numFinished{0};
+  // Keeps every worker busy until all the tasks are queued.
+  std::atomic<bool> go{false};
+  {
+    ThreadPool pool(NUM_THREADS);
+    for (unsigned i = 0; i < NUM_THREADS; i++) {
+      pool.submit([&] {
+        while (!go) std::this_thread::yield();
+      });
+    }
+
+    for (unsigned i = 0; i < NUM_TASKS; i++) {
+      pool.submit([&, i] {
+        started[numStarted++] = i;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        finished[numFinished++] = i;
+      });
+    }
+    go = true;
+  }
+
+  check("tasks from outside start in order", started, NUM_THREADS);
+  check("and finish in order", finished, NUM_THREADS);
+
+  // Tasks that tasks submit still all run.
+  std::atomic<unsigned> numNested{0};
+  {
+    ThreadPool pool(NUM_THREADS);
+    for (unsigned i = 0; i < NUM_TASKS; i++) {
+      pool.submit([&] {
+        for (unsigned j = 0; j < NUM_TASKS; j++) pool.submit([&] { numNested++; });
+      });
+    }
+  }
+  bool nestedOk = numNested == NUM_TASKS * NUM_TASKS;
+  printf("%s tasks submitted by workers\n", nestedOk ? "ok  " : "FAIL");
+  if (!nestedOk) failures++;
+
+  return failures == 0 ? 0 : 1;
+}